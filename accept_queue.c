@@ -0,0 +1,245 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "accept_queue.h"
+
+// The most listeners the sampler keeps track of (one per worker).
+#define ACCEPT_QUEUE_MAX_LISTENERS 1024
+
+/*
+    Listeners are registered once at startup and read by the sampler
+    thread, so a plain mutex is fine here: nothing on the request
+    path ever touches it.
+*/
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static int watched[ACCEPT_QUEUE_MAX_LISTENERS];
+static int nwatched;
+
+// The latest sample, published with atomic stores for readers on other threads.
+static struct accept_queue_stats latest;
+
+static int sample_interval;
+
+/**
+ * @brief Reads the kernel's cap on listen() backlogs.
+ *
+ * listen() silently truncates its backlog argument to
+ * net.core.somaxconn, so there is no point asking for more.
+ *
+ * @return the value of /proc/sys/net/core/somaxconn, or 4096 (the
+ * default since Linux 5.4) if it cannot be read.
+ */
+int accept_queue_somaxconn(void)
+{
+    FILE *fp;
+    int value = 4096;
+
+    fp = fopen("/proc/sys/net/core/somaxconn", "r");
+    if (fp != NULL)
+    {
+        if (fscanf(fp, "%d", &value) != 1 || value < 1)
+        {
+            value = 4096;
+        }
+        fclose(fp);
+    }
+    return value;
+}
+
+/**
+ * @brief Adds a listening socket to the set the sampler reports on.
+ *
+ * @param sockfd
+ * @return 0 on success, -1 if too many listeners are registered.
+ */
+int accept_queue_watch(int sockfd)
+{
+    int rc = -1;
+
+    pthread_mutex_lock(&watch_lock);
+    if (nwatched < ACCEPT_QUEUE_MAX_LISTENERS)
+    {
+        watched[nwatched++] = sockfd;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&watch_lock);
+    return rc;
+}
+
+/**
+ * @brief Reads ListenOverflows and ListenDrops from /proc/net/netstat.
+ *
+ * The file holds pairs of lines: a header line naming the counters
+ * of a group ("TcpExt: SyncookiesSent ...") followed by a line with
+ * their values in the same order.
+ *
+ * @param overflows
+ * @param drops
+ * @return 0 on success, -1 if the counters could not be found.
+ */
+static int read_listen_counters(unsigned long *overflows, unsigned long *drops)
+{
+    char names[4096], values[4096];
+    char *name_save, *value_save;
+    char *name, *value;
+    FILE *fp;
+    int found = 0;
+
+    fp = fopen("/proc/net/netstat", "r");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+
+    while (fgets(names, sizeof(names), fp) != NULL && fgets(values, sizeof(values), fp) != NULL)
+    {
+        if (strncmp(names, "TcpExt:", 7) != 0)
+        {
+            continue;
+        }
+
+        name = strtok_r(names, " \n", &name_save);
+        value = strtok_r(values, " \n", &value_save);
+        while (name != NULL && value != NULL)
+        {
+            if (strcmp(name, "ListenOverflows") == 0)
+            {
+                *overflows = strtoul(value, NULL, 10);
+                found++;
+            }
+            else if (strcmp(name, "ListenDrops") == 0)
+            {
+                *drops = strtoul(value, NULL, 10);
+                found++;
+            }
+            name = strtok_r(NULL, " \n", &name_save);
+            value = strtok_r(NULL, " \n", &value_save);
+        }
+        break;
+    }
+
+    fclose(fp);
+    return found == 2 ? 0 : -1;
+}
+
+/**
+ * @brief Takes one sample of every watched listener and the kernel counters.
+ *
+ * For a socket in the LISTEN state, TCP_INFO reports the current
+ * accept queue length in tcpi_unacked and its capacity in tcpi_sacked.
+ *
+ * @param sample
+ */
+static void take_sample(struct accept_queue_stats *sample)
+{
+    struct tcp_info info;
+    socklen_t len;
+    int i;
+
+    pthread_mutex_lock(&watch_lock);
+    for (i = 0; i < nwatched; i++)
+    {
+        len = sizeof(info);
+        if (getsockopt(watched[i], IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+        {
+            sample->depth += info.tcpi_unacked;
+            sample->backlog += info.tcpi_sacked;
+        }
+    }
+    pthread_mutex_unlock(&watch_lock);
+
+    read_listen_counters(&sample->overflows, &sample->drops);
+}
+
+/**
+ * @brief The sampler thread: samples, publishes and warns when the
+ * kernel had to turn connections away since the previous sample.
+ *
+ * @param arg unused.
+ * @return never returns.
+ */
+static void *sampler_run(void *arg)
+{
+    struct accept_queue_stats sample;
+    unsigned long max_depth = 0;
+    unsigned long last_overflows = 0, last_drops = 0;
+    int first = 1;
+
+    (void) arg;
+
+    for (;;)
+    {
+        memset(&sample, 0, sizeof(sample));
+        take_sample(&sample);
+        if (sample.depth > max_depth)
+        {
+            max_depth = sample.depth;
+        }
+
+        __atomic_store_n(&latest.depth, sample.depth, __ATOMIC_RELAXED);
+        __atomic_store_n(&latest.max_depth, max_depth, __ATOMIC_RELAXED);
+        __atomic_store_n(&latest.backlog, sample.backlog, __ATOMIC_RELAXED);
+        __atomic_store_n(&latest.overflows, sample.overflows, __ATOMIC_RELAXED);
+        __atomic_store_n(&latest.drops, sample.drops, __ATOMIC_RELAXED);
+
+        if (!first && (sample.overflows > last_overflows || sample.drops > last_drops))
+        {
+            fprintf(stderr,
+                    "WARNING accept queue overflowed: depth %lu/%lu, +%lu overflows, +%lu drops\n",
+                    sample.depth, sample.backlog,
+                    sample.overflows - last_overflows, sample.drops - last_drops);
+        }
+        last_overflows = sample.overflows;
+        last_drops = sample.drops;
+        first = 0;
+
+        sleep(sample_interval);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts the background thread that samples the accept queues.
+ *
+ * @param interval seconds between samples; 0 disables sampling.
+ * @return 0 on success, -1 on failure with errno set.
+ */
+int accept_queue_start_sampler(int interval)
+{
+    pthread_t thread;
+
+    if (interval <= 0)
+    {
+        return 0;
+    }
+
+    sample_interval = interval;
+    errno = pthread_create(&thread, NULL, sampler_run, NULL);
+    if (errno != 0)
+    {
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/**
+ * @brief Copies the most recent sample.
+ *
+ * @param stats
+ */
+void accept_queue_snapshot(struct accept_queue_stats *stats)
+{
+    stats->depth = __atomic_load_n(&latest.depth, __ATOMIC_RELAXED);
+    stats->max_depth = __atomic_load_n(&latest.max_depth, __ATOMIC_RELAXED);
+    stats->backlog = __atomic_load_n(&latest.backlog, __ATOMIC_RELAXED);
+    stats->overflows = __atomic_load_n(&latest.overflows, __ATOMIC_RELAXED);
+    stats->drops = __atomic_load_n(&latest.drops, __ATOMIC_RELAXED);
+}
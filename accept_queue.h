@@ -0,0 +1,33 @@
+#ifndef ACCEPT_QUEUE_H
+#define ACCEPT_QUEUE_H
+
+/*
+    A snapshot of how full the listeners' accept queues are. Depth
+    and backlog are summed over every registered listener; the
+    overflow and drop counters are the kernel's TcpExt counters and
+    cover every listener in the network namespace.
+*/
+struct accept_queue_stats
+{
+    // Connections currently waiting to be accepted.
+    unsigned long depth;
+
+    // The largest depth seen by the sampler so far.
+    unsigned long max_depth;
+
+    // The accept queue size the kernel granted, i.e. min(backlog, somaxconn).
+    unsigned long backlog;
+
+    // TcpExt ListenOverflows: handshakes completed into a full queue.
+    unsigned long overflows;
+
+    // TcpExt ListenDrops: SYNs and handshakes dropped for any reason.
+    unsigned long drops;
+};
+
+int accept_queue_somaxconn(void);
+int accept_queue_watch(int sockfd);
+int accept_queue_start_sampler(int interval);
+void accept_queue_snapshot(struct accept_queue_stats *stats);
+
+#endif
@@ -0,0 +1,180 @@
+#include <string.h>
+
+#include "arena.h"
+#include "buffer.h"
+
+/*
+    Handlers need scratch memory (strings, small tables, a parsed
+    body) that lives exactly as long as the request. Asking malloc()
+    for each piece and freeing it again costs more than most of the
+    work done with it, so instead each request carves its pieces out
+    of an arena, and they all go at once when it is done.
+
+    The chunks come from the buffer size classes (see buffer.c), so a
+    new chunk is usually a pointer swap off a per-thread free list.
+    The first chunk is small and is kept when the arena is reset, so
+    a connection's arena settles on it and a request that fits costs
+    no allocation at all; resetting it is then just moving the bump
+    pointer back. Each further chunk is twice the previous one, up to
+    the largest size class, and those are given back on reset. An
+    allocation too large for that gets a chunk of its own.
+*/
+
+struct arena_chunk
+{
+    struct arena_chunk *next;
+    size_t cap;
+
+    // Padding keeps data aligned to ARENA_ALIGN.
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+/**
+ * @brief Prepares an empty arena.
+ *
+ * @param arena
+ */
+void arena_init(struct arena *arena)
+{
+    memset(arena, 0, sizeof(*arena));
+}
+
+/**
+ * @brief The slow path of arena_alloc(): starts a new chunk.
+ *
+ * @param arena
+ * @param size already rounded up to ARENA_ALIGN.
+ * @return the memory, or NULL if memory is exhausted.
+ */
+void *arena_grow(struct arena *arena, size_t size)
+{
+    struct arena_chunk *chunk;
+    size_t want = BUFFER_SMALL;
+    size_t cap;
+
+    if (arena->chunk != NULL)
+    {
+        want = arena->chunk->cap * 2 < BUFFER_LARGE ? arena->chunk->cap * 2 : BUFFER_LARGE;
+    }
+    if (want < sizeof(*chunk) + size)
+    {
+        want = sizeof(*chunk) + size;
+    }
+
+    chunk = buffer_block_alloc(want, &cap);
+    if (chunk == NULL)
+    {
+        return NULL;
+    }
+    chunk->next = arena->chunk;
+    chunk->cap = cap;
+    arena->chunk = chunk;
+    if (arena->first == NULL)
+    {
+        arena->first = chunk;
+    }
+
+    arena->ptr = chunk->data + size;
+    arena->end = (char *) chunk + cap;
+    arena->last = chunk->data;
+    return chunk->data;
+}
+
+/**
+ * @brief Resizes an allocation, in place if it is the latest one and
+ * there is room, which is how a string or array being built up grows.
+ *
+ * @param arena
+ * @param ptr from this arena, or NULL.
+ * @param old_size its size.
+ * @param size
+ * @return the memory, or NULL if memory is exhausted (ptr is then
+ * still valid).
+ */
+void *arena_realloc(struct arena *arena, void *ptr, size_t old_size, size_t size)
+{
+    size_t rounded = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    void *moved;
+
+    if (ptr != NULL && ptr == arena->last && (size_t) (arena->end - arena->last) >= rounded)
+    {
+        arena->ptr = arena->last + rounded;
+        return ptr;
+    }
+
+    moved = arena_alloc(arena, size);
+    if (moved != NULL && ptr != NULL)
+    {
+        memcpy(moved, ptr, old_size < size ? old_size : size);
+    }
+    return moved;
+}
+
+/**
+ * @brief Copies a string into the arena.
+ *
+ * @param arena
+ * @param s
+ * @param len
+ * @return the NUL-terminated copy, or NULL if memory is exhausted.
+ */
+char *arena_strndup(struct arena *arena, const char *s, size_t len)
+{
+    char *copy = arena_alloc(arena, len + 1);
+
+    if (copy != NULL)
+    {
+        memcpy(copy, s, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+/**
+ * @brief Takes back everything allocated from the arena. Constant
+ * time unless the request outgrew the first chunk.
+ *
+ * @param arena
+ */
+void arena_reset(struct arena *arena)
+{
+    struct arena_chunk *chunk;
+
+    if (arena->first == NULL)
+    {
+        return;
+    }
+    if (arena->first->cap > BUFFER_LARGE)
+    {
+        // Started with an outsized allocation: not worth keeping for the next request.
+        arena_release(arena);
+        return;
+    }
+    while (arena->chunk != arena->first)
+    {
+        chunk = arena->chunk;
+        arena->chunk = chunk->next;
+        buffer_block_free(chunk, chunk->cap);
+    }
+    arena->ptr = arena->first->data;
+    arena->end = (char *) arena->first + arena->first->cap;
+    arena->last = NULL;
+}
+
+/**
+ * @brief Gives every chunk back, leaving the arena empty.
+ *
+ * @param arena
+ */
+void arena_release(struct arena *arena)
+{
+    struct arena_chunk *chunk;
+
+    while (arena->chunk != NULL)
+    {
+        chunk = arena->chunk;
+        arena->chunk = chunk->next;
+        buffer_block_free(chunk, chunk->cap);
+    }
+    arena_init(arena);
+}
@@ -0,0 +1,62 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Every allocation is aligned for any type, as with malloc().
+#define ARENA_ALIGN 16
+
+struct arena_chunk;
+
+/*
+    Scratch memory for one request: allocations bump a pointer
+    through the current chunk, nothing is freed on its own, and
+    arena_reset() takes everything back at once when the response is
+    done. An arena starts empty and holds no memory until it is first
+    used.
+*/
+struct arena
+{
+    // The chunk being carved up, the older ones linked behind it.
+    struct arena_chunk *chunk;
+
+    // The oldest chunk, kept across resets.
+    struct arena_chunk *first;
+
+    // The free part of the current chunk.
+    char *ptr;
+    char *end;
+
+    // The latest allocation, which arena_realloc() can grow in place.
+    char *last;
+};
+
+void arena_init(struct arena *arena);
+void *arena_grow(struct arena *arena, size_t size);
+void *arena_realloc(struct arena *arena, void *ptr, size_t old_size, size_t size);
+char *arena_strndup(struct arena *arena, const char *s, size_t len);
+void arena_reset(struct arena *arena);
+void arena_release(struct arena *arena);
+
+/**
+ * @brief Allocates size bytes from the arena. They stay valid until
+ * the arena is reset.
+ *
+ * @param arena
+ * @param size
+ * @return the memory, or NULL if memory is exhausted.
+ */
+static inline void *arena_alloc(struct arena *arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1 + (size == 0)) & ~(size_t) (ARENA_ALIGN - 1);
+    if ((size_t) (arena->end - arena->ptr) < size)
+    {
+        return arena_grow(arena, size);
+    }
+    arena->last = arena->ptr;
+    arena->ptr += size;
+    return arena->last;
+}
+
+#endif
@@ -0,0 +1,366 @@
+/*
+    Build:
+        cc -O2 -o bench_http bench_http.c output.c buffer.c
+
+    Measures the delimiter scanners of the HTTP parser, the scalar
+    ones against SSE4.2 and AVX2 where the CPU has them, in bytes per
+    cycle, and the whole parser with each set of scanners in requests
+    per second. Before timing anything it checks that the vector
+    scanners find exactly what the scalar ones do, for every length
+    and alignment and delimiter position around the block sizes, and
+    that whole requests parse the same either way. Exits non-zero if
+    a check fails.
+
+    The scanners are private to http.c, so it is compiled in here
+    rather than linked.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "http.c"
+
+#define NS_PER_SEC 1000000000ULL
+
+// Bytes scanned per timed run, and the longest stretch scanned at once.
+#define BENCH_BYTES (1ULL << 31)
+#define BENCH_BUFFER 4096
+
+// A typical header line, as well as a long stretch.
+#define BENCH_LINE 64
+
+// Requests parsed per timed run.
+#define BENCH_REQUESTS 2000000
+
+// Lengths and alignments the vector scanners are checked at.
+#define CHECK_LEN 160
+#define CHECK_ALIGN 32
+
+typedef const char *(*scan_lf_fn)(const char *p, const char *end);
+typedef const char *(*scan_set_fn)(const char *p, const char *end, const char *set, int nset);
+
+static int failures;
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * @brief A cycle count where the CPU offers one (the TSC, which
+ * ticks at a fixed rate close to the nominal clock), else 0.
+ */
+static unsigned long long now_cycles(void)
+{
+#ifdef HTTP_X86
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void report(const char *what, unsigned long long bytes, unsigned long long ns, unsigned long long cycles)
+{
+    printf("%-26s %6.2f GB/s", what, (double) bytes / ns);
+    if (cycles > 0)
+    {
+        printf("  %6.2f bytes/cycle", (double) bytes / cycles);
+    }
+    printf("\n");
+}
+
+/**
+ * @brief Compares a line feed scanner with the scalar one for every
+ * length, alignment and line feed position up to CHECK_LEN.
+ */
+static void check_lf(const char *name, scan_lf_fn scan)
+{
+    static char buf[CHECK_ALIGN + CHECK_LEN + 64];
+    const char *want, *got;
+    size_t align, len, pos;
+
+    for (align = 0; align < CHECK_ALIGN; align++)
+    {
+        for (len = 0; len <= CHECK_LEN; len++)
+        {
+            // pos == len puts the line feed just past the end, where it must not be found.
+            for (pos = 0; pos <= len; pos++)
+            {
+                memset(buf, 'a', sizeof(buf));
+                buf[align + pos] = '\n';
+                if (pos + 1 < len)
+                {
+                    // A second one behind the first: the first must win.
+                    buf[align + len - 1] = '\n';
+                }
+                want = http_scan_lf_scalar(buf + align, buf + align + len);
+                got = scan(buf + align, buf + align + len);
+                if (got != want)
+                {
+                    printf("FAIL %s: align %zu, len %zu, lf at %zu\n", name, align, len, pos);
+                    failures++;
+                    return;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Compares a set scanner with the scalar one, as check_lf()
+ * does, for each of the parser's sets and one of several characters.
+ */
+static void check_set(const char *name, scan_set_fn scan)
+{
+    static const char several[16] = " :\t";
+    static const struct
+    {
+        const char *set;
+        int nset;
+    } sets[] = {
+        { http_space, 1 },
+        { http_colon, 1 },
+        { several, 3 },
+    };
+    static char buf[CHECK_ALIGN + CHECK_LEN + 64];
+    const char *want, *got;
+    size_t align, len, pos, s;
+
+    for (s = 0; s < sizeof(sets) / sizeof(sets[0]); s++)
+    {
+        for (align = 0; align < CHECK_ALIGN; align++)
+        {
+            for (len = 0; len <= CHECK_LEN; len++)
+            {
+                for (pos = 0; pos <= len; pos++)
+                {
+                    // Filler that includes NUL bytes, which must not match the set's padding.
+                    memset(buf, 'a', sizeof(buf));
+                    buf[align + pos / 2] = '\0';
+                    buf[align + pos] = sets[s].set[pos % sets[s].nset];
+                    want = http_scan_set_scalar(buf + align, buf + align + len, sets[s].set, sets[s].nset);
+                    got = scan(buf + align, buf + align + len, sets[s].set, sets[s].nset);
+                    if (got != want)
+                    {
+                        printf("FAIL %s: set %zu, align %zu, len %zu, match at %zu\n", name, s, align, len, pos);
+                        failures++;
+                        return;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static const char *const requests[] = {
+    "GET / HTTP/1.1\r\nHost: a\r\n\r\n",
+    "GET /index.html?x=1 HTTP/1.0\r\nHost: example.com\r\nConnection: keep-alive\r\n\r\n",
+    "POST /hash HTTP/1.1\r\nHost: example.com\r\nContent-Length: 5\r\nContent-Type: text/plain\r\n\r\nhello",
+    "GET /a/fairly/long/path/that/spans/more/than/one/vector/block/of/thirty/two/bytes HTTP/1.1\r\n"
+    "Host: example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko)\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+    "Connection: close\r\n"
+    "\r\n",
+    "GET / HTTP/1.1\nHost:a\n\n",
+    "GET /no-colon HTTP/1.1\r\nBroken header\r\n\r\n",
+    "GET  HTTP/1.1\r\n\r\n",
+    "GET /x HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n",
+};
+
+static int same_string(const struct http_string *a, const struct http_string *b)
+{
+    return a->data == b->data && a->len == b->len;
+}
+
+/**
+ * @brief Parses each request with the scalar scanners and with the
+ * ones http_init() picks, and compares everything that comes out.
+ */
+static void check_parse(void)
+{
+    struct http_request a, b;
+    size_t scanned_a, scanned_b;
+    ssize_t na, nb;
+    size_t i;
+    int h;
+
+    for (i = 0; i < sizeof(requests) / sizeof(requests[0]); i++)
+    {
+        memset(&a, 0, sizeof(a));
+        memset(&b, 0, sizeof(b));
+        scanned_a = scanned_b = 0;
+
+        http_scan_lf = http_scan_lf_scalar;
+        http_scan_set = http_scan_set_scalar;
+        na = http_parse(requests[i], strlen(requests[i]), &scanned_a, 65536, &a);
+        http_init();
+        nb = http_parse(requests[i], strlen(requests[i]), &scanned_b, 65536, &b);
+
+        if (na != nb || scanned_a != scanned_b)
+        {
+            printf("FAIL parsing request %zu: %zd against %zd\n", i, na, nb);
+            failures++;
+            continue;
+        }
+        if (na <= 0)
+        {
+            continue;
+        }
+        if (!same_string(&a.method, &b.method) || !same_string(&a.target, &b.target) ||
+            !same_string(&a.body, &b.body) || a.minor_version != b.minor_version ||
+            a.keep_alive != b.keep_alive || a.nheaders != b.nheaders)
+        {
+            printf("FAIL parsing request %zu: the requests differ\n", i);
+            failures++;
+            continue;
+        }
+        for (h = 0; h < a.nheaders; h++)
+        {
+            if (!same_string(&a.headers[h].name, &b.headers[h].name) ||
+                !same_string(&a.headers[h].value, &b.headers[h].value))
+            {
+                printf("FAIL parsing request %zu: header %d differs\n", i, h);
+                failures++;
+                break;
+            }
+        }
+    }
+}
+
+static void bench_lf(const char *name, scan_lf_fn scan, size_t len)
+{
+    static char buf[BENCH_BUFFER];
+    unsigned long long start, cycles, bytes;
+    unsigned long found = 0;
+
+    // No line feed at all: the scanner goes through all len bytes every time.
+    memset(buf, 'a', sizeof(buf));
+    start = now_ns();
+    cycles = now_cycles();
+    for (bytes = 0; bytes < BENCH_BYTES; bytes += len)
+    {
+        found += scan(buf, buf + len) != NULL;
+        __asm__ volatile("" : : "r"(buf) : "memory");
+    }
+    cycles = now_cycles() - cycles;
+    report(name, bytes, now_ns() - start, cycles);
+    if (found > 0)
+    {
+        printf("\n");
+    }
+}
+
+static void bench_set(const char *name, scan_set_fn scan, size_t len, unsigned long long total)
+{
+    static char buf[BENCH_BUFFER];
+    unsigned long long start, cycles, bytes;
+    unsigned long found = 0;
+
+    memset(buf, 'a', sizeof(buf));
+    start = now_ns();
+    cycles = now_cycles();
+    for (bytes = 0; bytes < total; bytes += len)
+    {
+        found += scan(buf, buf + len, http_colon, 1) != NULL;
+        __asm__ volatile("" : : "r"(buf) : "memory");
+    }
+    cycles = now_cycles() - cycles;
+    report(name, bytes, now_ns() - start, cycles);
+    if (found > 0)
+    {
+        printf("\n");
+    }
+}
+
+static void bench_parse(const char *name)
+{
+    // The long browser-like request: most of its bytes are scanned.
+    const char *req = requests[3];
+    size_t len = strlen(req);
+    struct http_request r;
+    unsigned long long start, cycles, ns;
+    size_t scanned;
+    long ok = 0;
+    int i;
+
+    start = now_ns();
+    cycles = now_cycles();
+    for (i = 0; i < BENCH_REQUESTS; i++)
+    {
+        scanned = 0;
+        ok += http_parse(req, len, &scanned, 65536, &r) > 0;
+        __asm__ volatile("" : : "r"(req) : "memory");
+    }
+    cycles = now_cycles() - cycles;
+    ns = now_ns() - start;
+    report(name, (unsigned long long) len * BENCH_REQUESTS, ns, cycles);
+    printf("%-26s %6.1f ns per request\n", "", (double) ns / BENCH_REQUESTS);
+    if (ok != BENCH_REQUESTS)
+    {
+        printf("FAIL the benchmark request did not parse\n");
+        failures++;
+    }
+}
+
+int main(void)
+{
+    int avx2 = 0, sse42 = 0;
+
+#ifdef HTTP_X86
+    __builtin_cpu_init();
+    avx2 = __builtin_cpu_supports("avx2");
+    sse42 = __builtin_cpu_supports("sse4.2");
+    if (avx2)
+    {
+        check_lf("avx2 line feed scanner", http_scan_lf_avx2);
+    }
+    if (sse42)
+    {
+        check_set("sse4.2 set scanner", http_scan_set_sse42);
+    }
+#endif
+    check_parse();
+    if (failures > 0)
+    {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("scanner checks passed (avx2 %s, sse4.2 %s)\n", avx2 ? "checked" : "not available",
+           sse42 ? "checked" : "not available");
+
+    bench_lf("line feeds, scalar, 64", http_scan_lf_scalar, BENCH_LINE);
+    bench_lf("line feeds, scalar, 4096", http_scan_lf_scalar, BENCH_BUFFER);
+#ifdef HTTP_X86
+    if (avx2)
+    {
+        bench_lf("line feeds, avx2, 64", http_scan_lf_avx2, BENCH_LINE);
+        bench_lf("line feeds, avx2, 4096", http_scan_lf_avx2, BENCH_BUFFER);
+    }
+#endif
+    // The scalar set scanner is far slower, so it gets fewer bytes.
+    bench_set("set, scalar, 64", http_scan_set_scalar, BENCH_LINE, BENCH_BYTES / 16);
+    bench_set("set, scalar, 4096", http_scan_set_scalar, BENCH_BUFFER, BENCH_BYTES / 16);
+#ifdef HTTP_X86
+    if (sse42)
+    {
+        bench_set("set, sse4.2, 64", http_scan_set_sse42, BENCH_LINE, BENCH_BYTES);
+        bench_set("set, sse4.2, 4096", http_scan_set_sse42, BENCH_BUFFER, BENCH_BYTES);
+    }
+#endif
+
+    http_scan_lf = http_scan_lf_scalar;
+    http_scan_set = http_scan_set_scalar;
+    bench_parse("parse, scalar");
+    http_init();
+    bench_parse("parse, as http_init picks");
+    return failures > 0;
+}
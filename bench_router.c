@@ -0,0 +1,301 @@
+/*
+    Build:
+        cc -O2 -o bench_router bench_router.c router.c
+
+    First checks that the router matches what it should (static
+    routes over captures, backing up out of dead ends, rest captures,
+    the perfect hash table, duplicates refused), then times lookups
+    in a large route set against a linear scan of the same patterns.
+    Exits non-zero if a check fails.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "router.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+// The route set timed: this many routes without captures, and with.
+#define BENCH_FIXED 5000
+#define BENCH_PARAM 1000
+
+// Lookups per timed run.
+#define BENCH_LOOKUPS 2000000
+
+// Longest generated path or pattern.
+#define BENCH_PATH_MAX 64
+
+// A route as the linear scan sees it.
+struct naive_route
+{
+    const char *method;
+    char pattern[BENCH_PATH_MAX];
+    int value;
+};
+
+static int failures;
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * @brief Matches a path against one pattern, a segment at a time, the
+ * way a router without an index would.
+ *
+ * @return 1 if it matches.
+ */
+static int naive_match(const char *pattern, const char *path, size_t len)
+{
+    const char *end = path + len;
+    const char *slash;
+
+    while (*pattern != '\0')
+    {
+        if (*pattern == '*')
+        {
+            return path < end;
+        }
+        if (*pattern == ':')
+        {
+            slash = memchr(path, '/', end - path);
+            if (slash == path)
+            {
+                return 0;
+            }
+            path = slash != NULL ? slash : end;
+            pattern += strcspn(pattern, "/");
+            continue;
+        }
+        if (path == end || *pattern != *path)
+        {
+            return 0;
+        }
+        pattern++;
+        path++;
+    }
+    return path == end;
+}
+
+static int naive_lookup(const struct naive_route *routes, int n, const char *method, const char *path, size_t len)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (strcmp(routes[i].method, method) == 0 && naive_match(routes[i].pattern, path, len))
+        {
+            return routes[i].value;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Checks one lookup: the value it should find and, if any, the
+ * name and value of its last capture.
+ */
+static void expect(const struct router *router, const char *method, const char *path, int value,
+                   const char *name, const char *capture)
+{
+    struct route_match match;
+    const struct route_param *p;
+    int got = router_match(router, method, strlen(method), path, strlen(path), &match);
+
+    if (got != value)
+    {
+        printf("FAIL %s %s: got %d, expected %d\n", method, path, got, value);
+        failures++;
+        return;
+    }
+    if (name == NULL || got < 0)
+    {
+        return;
+    }
+    p = match.nparams > 0 ? &match.params[match.nparams - 1] : NULL;
+    if (p == NULL || p->name_len != strlen(name) || memcmp(p->name, name, p->name_len) != 0 ||
+        p->len != strlen(capture) || memcmp(p->value, capture, p->len) != 0)
+    {
+        printf("FAIL %s %s: capture %.*s=%.*s, expected %s=%s\n", method, path,
+               p != NULL ? (int) p->name_len : 0, p != NULL ? p->name : "",
+               p != NULL ? (int) p->len : 0, p != NULL ? p->value : "", name, capture);
+        failures++;
+    }
+}
+
+static void check(int ok, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAIL %s\n", what);
+        failures++;
+    }
+}
+
+static void check_semantics(void)
+{
+    struct router router;
+    char path[BENCH_PATH_MAX];
+    int i;
+
+    router_init(&router);
+    check(router_add(&router, "GET", "/users/me", 1) == 0, "add /users/me");
+    check(router_add(&router, "GET", "/users/:id", 2) == 0, "add /users/:id");
+    check(router_add(&router, "GET", "/users/:id/posts", 3) == 0, "add /users/:id/posts");
+    check(router_add(&router, "GET", "/files/:name", 4) == 0, "add /files/:name");
+    check(router_add(&router, "GET", "/files/*path", 5) == 0, "add /files/*path");
+    check(router_add(&router, "GET", "/a/b/:z/q", 6) == 0, "add /a/b/:z/q");
+    check(router_add(&router, "GET", "/a/:y/c/w", 7) == 0, "add /a/:y/c/w");
+    check(router_add(&router, "POST", "/users/:id", 8) == 0, "add POST /users/:id");
+    check(router_add(&router, "GET", "/users/:other", 9) < 0, "same capture under another name refused");
+    check(router_add(&router, "GET", "/users/:id", 10) < 0, "same capture route twice refused");
+    check(router_add(&router, "GET", "/x*y", 11) < 0, "capture inside a segment refused");
+    check(router_add(&router, "GET", "/*rest/more", 12) < 0, "rest capture before the end refused");
+    for (i = 0; i < 1000; i++)
+    {
+        snprintf(path, sizeof(path), "/static/%d", i);
+        check(router_add(&router, i % 2 ? "GET" : "PUT", path, 100 + i) == 0, "add a static route");
+    }
+    check(router_build(&router) == 0, "build");
+
+    // Static routes win over captures; captures take one segment.
+    expect(&router, "GET", "/users/me", 1, NULL, NULL);
+    expect(&router, "GET", "/users/42", 2, "id", "42");
+    expect(&router, "GET", "/users/42/posts", 3, "id", "42");
+    expect(&router, "GET", "/users/me/posts", 3, "id", "me");
+    expect(&router, "GET", "/users/", -1, NULL, NULL);
+    expect(&router, "GET", "/users/42/", -1, NULL, NULL);
+
+    // A segment capture is preferred to a rest capture, which takes the rest.
+    expect(&router, "GET", "/files/a.txt", 4, "name", "a.txt");
+    expect(&router, "GET", "/files/dir/a.txt", 5, "path", "dir/a.txt");
+
+    // A static branch that dead-ends backs up into the capture beside it.
+    expect(&router, "GET", "/a/b/c/q", 6, "z", "c");
+    expect(&router, "GET", "/a/b/c/w", 7, "y", "b");
+    expect(&router, "GET", "/a/b/c/x", -1, NULL, NULL);
+
+    // Methods are kept apart.
+    expect(&router, "POST", "/users/7", 8, "id", "7");
+    expect(&router, "POST", "/users/me", 8, "id", "me");
+    expect(&router, "DELETE", "/users/7", -1, NULL, NULL);
+
+    // Every route in the perfect hash table has a slot, and near misses find none.
+    for (i = 0; i < 1000; i++)
+    {
+        snprintf(path, sizeof(path), "/static/%d", i);
+        expect(&router, i % 2 ? "GET" : "PUT", path, 100 + i, NULL, NULL);
+        expect(&router, i % 2 ? "PUT" : "GET", path, -1, NULL, NULL);
+        snprintf(path, sizeof(path), "/static/%d/", i);
+        expect(&router, i % 2 ? "GET" : "PUT", path, -1, NULL, NULL);
+    }
+    router_destroy(&router);
+
+    // A route without captures added twice is caught when the table is built.
+    router_init(&router);
+    check(router_add(&router, "GET", "/dup", 1) == 0, "add /dup");
+    check(router_add(&router, "GET", "/other", 2) == 0, "add /other");
+    check(router_add(&router, "GET", "/dup", 3) == 0, "add /dup again");
+    check(router_build(&router) < 0, "duplicate route refused by build");
+    check(router_add(&router, "GET", "/late", 4) < 0, "add after build refused");
+    router_destroy(&router);
+}
+
+static void bench(void)
+{
+    static struct naive_route routes[BENCH_FIXED + BENCH_PARAM];
+    static char paths[BENCH_FIXED + BENCH_PARAM][BENCH_PATH_MAX];
+    struct router router;
+    struct route_match match;
+    unsigned long long start, elapsed;
+    unsigned long sum = 0;
+    int n = BENCH_FIXED + BENCH_PARAM;
+    int lookups;
+    int i, k;
+
+    router_init(&router);
+    for (i = 0; i < n; i++)
+    {
+        routes[i].method = i % 4 == 0 ? "POST" : "GET";
+        routes[i].value = i;
+        if (i < BENCH_FIXED)
+        {
+            snprintf(routes[i].pattern, BENCH_PATH_MAX, "/api/v1/resource%d/items", i);
+            snprintf(paths[i], BENCH_PATH_MAX, "/api/v1/resource%d/items", i);
+        }
+        else
+        {
+            snprintf(routes[i].pattern, BENCH_PATH_MAX, "/api/v2/group%d/:id/detail", i);
+            snprintf(paths[i], BENCH_PATH_MAX, "/api/v2/group%d/%d/detail", i, i * 7);
+        }
+        if (router_add(&router, routes[i].method, routes[i].pattern, i) < 0)
+        {
+            printf("FAIL adding %s\n", routes[i].pattern);
+            exit(1);
+        }
+    }
+    if (router_build(&router) < 0)
+    {
+        printf("FAIL building the benchmark routes\n");
+        exit(1);
+    }
+
+    // Both must agree before either is timed.
+    for (i = 0; i < n; i++)
+    {
+        if (router_match(&router, routes[i].method, strlen(routes[i].method), paths[i], strlen(paths[i]), &match) != i ||
+            naive_lookup(routes, n, routes[i].method, paths[i], strlen(paths[i])) != i)
+        {
+            printf("FAIL benchmark route %s\n", paths[i]);
+            exit(1);
+        }
+    }
+
+    start = now_ns();
+    for (k = 0; k < BENCH_LOOKUPS; k++)
+    {
+        // A stride through the routes, so lookups do not follow insertion order.
+        i = (int) (((unsigned) k * 2654435761u) % (unsigned) n);
+        sum += router_match(&router, routes[i].method, strlen(routes[i].method), paths[i], strlen(paths[i]), &match);
+    }
+    elapsed = now_ns() - start;
+    printf("router:      %d routes, %.1f ns per lookup\n", n, (double) elapsed / BENCH_LOOKUPS);
+
+    // The scan is far slower, so it gets fewer lookups.
+    lookups = BENCH_LOOKUPS / 1000;
+    start = now_ns();
+    for (k = 0; k < lookups; k++)
+    {
+        i = (int) (((unsigned) k * 2654435761u) % (unsigned) n);
+        sum += naive_lookup(routes, n, routes[i].method, paths[i], strlen(paths[i]));
+    }
+    elapsed = now_ns() - start;
+    printf("linear scan: %d routes, %.1f ns per lookup\n", n, (double) elapsed / lookups);
+
+    // Keeps the lookups from being optimised away.
+    if (sum == 0)
+    {
+        printf("\n");
+    }
+    router_destroy(&router);
+}
+
+int main(void)
+{
+    check_semantics();
+    if (failures > 0)
+    {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("router checks passed\n");
+    bench();
+    return 0;
+}
@@ -0,0 +1,216 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+
+#define BUFFER_CLASSES 3
+
+// How many blocks are carved out of each slab.
+#define BUFFER_BLOCKS_PER_SLAB 32
+
+static const size_t class_size[BUFFER_CLASSES] = { BUFFER_SMALL, BUFFER_MEDIUM, BUFFER_LARGE };
+
+/*
+    A free block stores the pointer to the next free block in its
+    own first bytes, so the free list needs no memory of its own.
+*/
+struct free_block
+{
+    struct free_block *next;
+};
+
+/*
+    Each thread has its own free lists. Connections are owned by one
+    worker thread for their whole life, so blocks are allocated and
+    returned on the same thread and no locking is needed.
+*/
+static __thread struct free_block *free_lists[BUFFER_CLASSES];
+
+/**
+ * @brief Finds the smallest size class that holds size bytes.
+ *
+ * @param size
+ * @return the class index, or -1 if size is larger than every class.
+ */
+static int class_of(size_t size)
+{
+    int i;
+
+    for (i = 0; i < BUFFER_CLASSES; i++)
+    {
+        if (size <= class_size[i])
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Carves a fresh slab into blocks and puts them on the free list.
+ *
+ * Slabs are never given back: the blocks in them are recycled for
+ * the lifetime of the thread.
+ *
+ * @param cls
+ * @return 0 on success, -1 if memory is exhausted.
+ */
+static int refill(int cls)
+{
+    char *slab;
+    struct free_block *block;
+    int i;
+
+    slab = malloc(class_size[cls] * BUFFER_BLOCKS_PER_SLAB);
+    if (slab == NULL)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < BUFFER_BLOCKS_PER_SLAB; i++)
+    {
+        block = (struct free_block *) (slab + (size_t) i * class_size[cls]);
+        block->next = free_lists[cls];
+        free_lists[cls] = block;
+    }
+    return 0;
+}
+
+/**
+ * @brief Gets a block of at least size bytes.
+ *
+ * @param size
+ * @param cap set to the real size of the block.
+ * @return the block, or NULL if memory is exhausted.
+ */
+void *buffer_block_alloc(size_t size, size_t *cap)
+{
+    struct free_block *block;
+    int cls = class_of(size);
+
+    if (cls < 0)
+    {
+        *cap = size;
+        return malloc(size);
+    }
+
+    if (free_lists[cls] == NULL && refill(cls) < 0)
+    {
+        return NULL;
+    }
+
+    block = free_lists[cls];
+    free_lists[cls] = block->next;
+    *cap = class_size[cls];
+    return block;
+}
+
+/**
+ * @brief Returns a block obtained from buffer_block_alloc().
+ *
+ * @param block
+ * @param cap the capacity buffer_block_alloc() reported.
+ */
+void buffer_block_free(void *block, size_t cap)
+{
+    struct free_block *free_block = block;
+    int cls;
+
+    if (block == NULL)
+    {
+        return;
+    }
+
+    cls = class_of(cap);
+    if (cls < 0 || class_size[cls] != cap)
+    {
+        free(block);
+        return;
+    }
+
+    free_block->next = free_lists[cls];
+    free_lists[cls] = free_block;
+}
+
+/**
+ * @brief Makes sure at least need bytes can be appended at buf->end.
+ *
+ * The unconsumed bytes are first moved to the front of the block if
+ * that makes enough room; otherwise they are moved into a block of
+ * the next size class that fits.
+ *
+ * @param buf
+ * @param need
+ * @param limit the most bytes the buffer may hold once need is added.
+ * @return 0 on success, -1 if that would exceed limit or memory is
+ * exhausted.
+ */
+int buffer_reserve(struct buffer *buf, size_t need, size_t limit)
+{
+    size_t len = buffer_len(buf);
+    size_t cap;
+    char *data;
+
+    if (buf->cap - buf->end >= need)
+    {
+        return 0;
+    }
+    if (len + need > limit)
+    {
+        return -1;
+    }
+
+    if (buf->data != NULL && buf->cap >= len + need)
+    {
+        memmove(buf->data, buf->data + buf->start, len);
+    }
+    else
+    {
+        data = buffer_block_alloc(len + need, &cap);
+        if (data == NULL)
+        {
+            return -1;
+        }
+        if (len > 0)
+        {
+            memcpy(data, buf->data + buf->start, len);
+        }
+        buffer_block_free(buf->data, buf->cap);
+        buf->data = data;
+        buf->cap = cap;
+    }
+
+    buf->start = 0;
+    buf->end = len;
+    return 0;
+}
+
+/**
+ * @brief Drops n bytes from the front of the buffer.
+ *
+ * When the buffer becomes empty its block goes straight back to the
+ * pool, so a connection that is waiting for its next message holds
+ * no buffer memory at all.
+ *
+ * @param buf
+ * @param n
+ */
+void buffer_consume(struct buffer *buf, size_t n)
+{
+    buf->start += n;
+    if (buf->start == buf->end)
+    {
+        buffer_release(buf);
+    }
+}
+
+/**
+ * @brief Returns the buffer's block to the pool and empties it.
+ *
+ * @param buf
+ */
+void buffer_release(struct buffer *buf)
+{
+    buffer_block_free(buf->data, buf->cap);
+    memset(buf, 0, sizeof(*buf));
+}
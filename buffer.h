@@ -0,0 +1,45 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+
+/*
+    Buffers come in a few fixed sizes. Blocks of each size are carved
+    out of larger slabs and recycled through a per-thread free list,
+    so getting or returning one is a pointer swap rather than a trip
+    through malloc(). Anything larger than the biggest class falls
+    back to malloc().
+*/
+#define BUFFER_SMALL (2 * 1024)
+#define BUFFER_MEDIUM (16 * 1024)
+#define BUFFER_LARGE (64 * 1024)
+
+/*
+    A growable byte buffer. The bytes between start and end are
+    valid; consuming from the front just advances start, so parsed
+    messages never have to be shifted out one by one.
+*/
+struct buffer
+{
+    char *data;
+    size_t cap;
+    size_t start;
+    size_t end;
+};
+
+void *buffer_block_alloc(size_t size, size_t *cap);
+void buffer_block_free(void *block, size_t cap);
+
+int buffer_reserve(struct buffer *buf, size_t need, size_t limit);
+void buffer_consume(struct buffer *buf, size_t n);
+void buffer_release(struct buffer *buf);
+
+/**
+ * @brief The number of unconsumed bytes in the buffer.
+ */
+static inline size_t buffer_len(const struct buffer *buf)
+{
+    return buf->end - buf->start;
+}
+
+#endif
@@ -1,37 +1,770 @@
+/*
+    Build:
+        cc -O2 -pthread -o client client.c framing.c http.c output.c buffer.c histogram.c
+
+    With just a hostname and port the client sends one line read from
+    stdin and prints the reply. With any of the options below it
+    becomes a load generator instead.
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 
+#include "framing.h"
+#include "histogram.h"
+
+// The most reply bytes a benchmark connection buffers.
+#define REPLY_BUFFER 4096
+
+#define NS_PER_SEC 1000000000ULL
+
+// What a benchmark connection is doing right now.
+#define STATE_CONNECTING 0
+#define STATE_READY 1
+#define STATE_DONE 2
+
+/*
+    How requests are paced.
+
+    MODE_CLOSED: each connection sends its next request as soon as
+                 the previous reply arrives.
+    MODE_RATE:   as MODE_CLOSED, but no faster than rate / connections
+                 per connection. Latency is measured from the actual
+                 send, so a server stall delays sends and hides itself
+                 (coordinated omission).
+    MODE_OPEN:   requests are sent on a fixed timeline whether or not
+                 replies have arrived, and latency is measured from
+                 when each request was meant to be sent. A stall then
+                 shows up in the latency of every request scheduled
+                 during it, as it would for real users.
+*/
+#define MODE_CLOSED 0
+#define MODE_RATE 1
+#define MODE_OPEN 2
+
+/*
+    Benchmark settings, shared read-only by every thread.
+*/
+struct bench
+{
+    struct sockaddr_in serv_addr;
+    int connections;
+    int threads;
+    size_t payload;
+    long messages;
+    double rate;
+    int mode;
+    int framing;
+
+    // One framed request, sent over and over.
+    char *request;
+    size_t request_len;
+};
+
+/*
+    One benchmark connection. Requests are queued on it (one at a
+    time, or ahead of replies in open-loop mode), written out, and
+    matched with replies in order.
+*/
+struct bench_conn
+{
+    int fd;
+    int state;
+
+    // Requests queued so far, and replies received (or given up on).
+    long scheduled;
+    long completed;
+
+    // Queued requests not yet fully written, and progress on the first.
+    long unwritten;
+    size_t off;
+
+    // When the next request is due, and the spacing between them.
+    uint64_t next_at;
+    uint64_t interval;
+
+    /*
+        The start time of every outstanding request, oldest first.
+        Replies come back in order, so each reply is matched with the
+        head of this queue.
+    */
+    uint64_t *starts;
+    size_t starts_head;
+    size_t starts_len;
+    size_t starts_cap;
+
+    struct framer framer;
+    char reply[REPLY_BUFFER];
+    size_t reply_len;
+};
+
+/*
+    Per-thread results, merged once every thread has finished.
+*/
+struct bench_thread
+{
+    pthread_t thread;
+    const struct bench *bench;
+    int first_conn;
+    int nconns;
+
+    struct histogram *latency;
+    unsigned long errors;
+    unsigned long reconnects;
+};
+
 void error(char *msg)
 {
     perror(msg);
     exit(0);
 }
 
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * @brief Queues one request that started (or should have started) at start.
+ *
+ * @param conn
+ * @param start
+ */
+static void bench_enqueue(struct bench_conn *conn, uint64_t start)
+{
+    uint64_t *grown;
+    size_t i;
+
+    if (conn->starts_len == conn->starts_cap)
+    {
+        grown = malloc((conn->starts_cap ? conn->starts_cap * 2 : 16) * sizeof(*grown));
+        if (grown == NULL)
+        {
+            error("ERROR allocating request queue");
+        }
+        for (i = 0; i < conn->starts_len; i++)
+        {
+            grown[i] = conn->starts[(conn->starts_head + i) % conn->starts_cap];
+        }
+        free(conn->starts);
+        conn->starts = grown;
+        conn->starts_head = 0;
+        conn->starts_cap = conn->starts_cap ? conn->starts_cap * 2 : 16;
+    }
+
+    conn->starts[(conn->starts_head + conn->starts_len) % conn->starts_cap] = start;
+    conn->starts_len++;
+    conn->scheduled++;
+    conn->unwritten++;
+}
+
+/**
+ * @brief Starts a non-blocking connect for a benchmark connection.
+ *
+ * @param bench
+ * @param conn
+ * @param epfd
+ * @return 0 on success, -1 on failure.
+ */
+static int bench_connect(const struct bench *bench, struct bench_conn *conn, int epfd)
+{
+    struct epoll_event ev;
+    int on = 1;
+
+    conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd < 0)
+    {
+        return -1;
+    }
+
+    // Requests are tiny and latency matters, so do not let Nagle batch them.
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    if (connect(conn->fd, (struct sockaddr *) &bench->serv_addr, sizeof(bench->serv_addr)) < 0 &&
+        errno != EINPROGRESS)
+    {
+        close(conn->fd);
+        return -1;
+    }
+
+    conn->state = STATE_CONNECTING;
+    conn->reply_len = 0;
+    framer_init(&conn->framer, bench->framing, REPLY_BUFFER);
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0)
+    {
+        close(conn->fd);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Queues whatever requests are due on a connection.
+ *
+ * @param bench
+ * @param conn
+ * @param now
+ * @return when this connection next needs attention for pacing, or
+ * UINT64_MAX if it is waiting on the server instead.
+ */
+static uint64_t bench_schedule(const struct bench *bench, struct bench_conn *conn, uint64_t now)
+{
+    if (conn->state == STATE_DONE || conn->scheduled == bench->messages)
+    {
+        return UINT64_MAX;
+    }
+
+    switch (bench->mode)
+    {
+    case MODE_OPEN:
+        // Everything whose time has come, whether or not replies are back.
+        while (conn->next_at <= now && conn->scheduled < bench->messages)
+        {
+            bench_enqueue(conn, conn->next_at);
+            conn->next_at += conn->interval;
+        }
+        return conn->scheduled < bench->messages ? conn->next_at : UINT64_MAX;
+
+    case MODE_RATE:
+        if (conn->starts_len > 0)
+        {
+            return UINT64_MAX;
+        }
+        if (conn->next_at > now)
+        {
+            return conn->next_at;
+        }
+        bench_enqueue(conn, now);
+        conn->next_at += conn->interval;
+        return UINT64_MAX;
+
+    default:
+        if (conn->starts_len == 0)
+        {
+            bench_enqueue(conn, now);
+        }
+        return UINT64_MAX;
+    }
+}
+
+/**
+ * @brief Writes queued requests until they are all out or the socket is full.
+ *
+ * @param bench
+ * @param conn
+ * @return 0 on success (even if only partly written), -1 on error.
+ */
+static int bench_send(const struct bench *bench, struct bench_conn *conn)
+{
+    ssize_t n;
+
+    while (conn->state == STATE_READY && conn->unwritten > 0)
+    {
+        n = send(conn->fd, bench->request + conn->off, bench->request_len - conn->off, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN ? 0 : -1;
+        }
+
+        conn->off += n;
+        if (conn->off == bench->request_len)
+        {
+            conn->off = 0;
+            conn->unwritten--;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads replies and records the latency of every request they
+ * complete.
+ *
+ * @param bench
+ * @param t
+ * @param conn
+ * @return 0 to carry on, 1 if the server closed the connection, -1 on error.
+ */
+static int bench_receive(const struct bench *bench, struct bench_thread *t, struct bench_conn *conn)
+{
+    struct frame frame;
+    ssize_t consumed;
+    ssize_t n;
+    size_t off;
+
+    for (;;)
+    {
+        if (conn->reply_len == sizeof(conn->reply))
+        {
+            return -1;
+        }
+
+        n = recv(conn->fd, conn->reply + conn->reply_len, sizeof(conn->reply) - conn->reply_len, 0);
+        if (n == 0)
+        {
+            return 1;
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN ? 0 : -1;
+        }
+        conn->reply_len += n;
+
+        // One read may complete several pipelined replies.
+        off = 0;
+        while ((consumed = framer_next(&conn->framer, conn->reply + off, conn->reply_len - off, &frame)) > 0)
+        {
+            off += consumed;
+            if (conn->starts_len == 0)
+            {
+                // A reply nobody asked for.
+                return -1;
+            }
+
+            histogram_record(t->latency, now_ns() - conn->starts[conn->starts_head]);
+            conn->starts_head = (conn->starts_head + 1) % conn->starts_cap;
+            conn->starts_len--;
+            conn->completed++;
+        }
+        if (consumed < 0)
+        {
+            return -1;
+        }
+        memmove(conn->reply, conn->reply + off, conn->reply_len - off);
+        conn->reply_len -= off;
+
+        if (conn->completed == bench->messages)
+        {
+            conn->state = STATE_DONE;
+            return 0;
+        }
+    }
+}
+
+/**
+ * @brief Drops a connection and, if it still has messages to send,
+ * opens a new one in its place.
+ *
+ * Requests still outstanding on the old connection count as errors.
+ * Servers that close after every reply are measured this way too:
+ * each message then also pays for a new connection.
+ *
+ * @param bench
+ * @param t
+ * @param conn
+ * @param epfd
+ * @return 1 if the connection is finished for good, 0 otherwise.
+ */
+static int bench_reset(const struct bench *bench, struct bench_thread *t, struct bench_conn *conn, int epfd)
+{
+    close(conn->fd);
+    conn->fd = -1;
+
+    t->errors += conn->starts_len;
+    conn->completed += conn->starts_len;
+    conn->starts_len = 0;
+    conn->unwritten = 0;
+    conn->off = 0;
+
+    if (conn->completed >= bench->messages)
+    {
+        conn->state = STATE_DONE;
+        return 1;
+    }
+
+    t->reconnects++;
+    if (bench_connect(bench, conn, epfd) < 0)
+    {
+        t->errors += bench->messages - conn->completed;
+        conn->state = STATE_DONE;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief One benchmark thread, driving its connections with epoll.
+ *
+ * @param arg the thread's struct bench_thread.
+ * @return NULL
+ */
+static void *bench_run(void *arg)
+{
+    struct bench_thread *t = arg;
+    const struct bench *bench = t->bench;
+    struct epoll_event events[256];
+    struct bench_conn *conns, *conn;
+    struct timespec timeout;
+    uint64_t now, next, due;
+    int epfd, n, i, rc;
+    int remaining = t->nconns;
+    int err;
+    socklen_t len;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    conns = calloc(t->nconns, sizeof(*conns));
+    t->latency = histogram_create();
+    if (epfd < 0 || conns == NULL || t->latency == NULL)
+    {
+        error("ERROR setting up benchmark thread");
+    }
+
+    now = now_ns();
+    for (i = 0; i < t->nconns; i++)
+    {
+        conn = &conns[i];
+        if (bench->mode != MODE_CLOSED)
+        {
+            /*
+                Every connection sends at rate / connections messages
+                per second, with start times spread out so they do not
+                all fire together.
+            */
+            conn->interval = (uint64_t) (NS_PER_SEC * bench->connections / bench->rate);
+            conn->next_at = now + conn->interval * (t->first_conn + i) / bench->connections;
+        }
+        if (bench_connect(bench, conn, epfd) < 0)
+        {
+            error("ERROR connecting");
+        }
+    }
+
+    while (remaining > 0)
+    {
+        /*
+            Queue and send whatever is due and work out how long we may
+            sleep before the next request is.
+        */
+        now = now_ns();
+        next = UINT64_MAX;
+        for (i = 0; i < t->nconns; i++)
+        {
+            conn = &conns[i];
+            due = bench_schedule(bench, conn, now);
+            if (due < next)
+            {
+                next = due;
+            }
+            if (bench_send(bench, conn) < 0)
+            {
+                remaining -= bench_reset(bench, t, conn, epfd);
+            }
+        }
+        /*
+            epoll_pwait2() takes a nanosecond timeout; with the
+            millisecond timeout of epoll_wait() requests in open-loop
+            mode would routinely go out late, and that delay would be
+            charged to the server.
+        */
+        if (next != UINT64_MAX)
+        {
+            timeout.tv_sec = (next - now) / NS_PER_SEC;
+            timeout.tv_nsec = (next - now) % NS_PER_SEC;
+        }
+        n = epoll_pwait2(epfd, events, 256, next == UINT64_MAX ? NULL : &timeout, NULL);
+        if (n < 0 && errno != EINTR)
+        {
+            error("ERROR on epoll_pwait2");
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            conn = events[i].data.ptr;
+            if (conn->state == STATE_DONE)
+            {
+                continue;
+            }
+
+            if (conn->state == STATE_CONNECTING)
+            {
+                len = sizeof(err);
+                if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+                {
+                    remaining -= bench_reset(bench, t, conn, epfd);
+                    continue;
+                }
+                if (!(events[i].events & EPOLLOUT))
+                {
+                    continue;
+                }
+                conn->state = STATE_READY;
+            }
+
+            if ((events[i].events & EPOLLOUT) && bench_send(bench, conn) < 0)
+            {
+                remaining -= bench_reset(bench, t, conn, epfd);
+                continue;
+            }
+
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            {
+                rc = bench_receive(bench, t, conn);
+                if (rc != 0)
+                {
+                    remaining -= bench_reset(bench, t, conn, epfd);
+                    continue;
+                }
+            }
+
+            if (conn->state == STATE_DONE)
+            {
+                close(conn->fd);
+                conn->fd = -1;
+                remaining--;
+            }
+        }
+    }
+
+    for (i = 0; i < t->nconns; i++)
+    {
+        free(conns[i].starts);
+    }
+    close(epfd);
+    free(conns);
+    return NULL;
+}
+
+/**
+ * @brief Runs the benchmark and prints throughput and latency.
+ *
+ * @param bench
+ */
+static void bench_main(struct bench *bench)
+{
+    static const char *mode_names[] = { "closed loop", "fixed rate", "open loop" };
+    struct bench_thread *threads;
+    struct histogram *all;
+    unsigned long errors = 0, reconnects = 0;
+    uint64_t start, elapsed;
+    double seconds;
+    int i, per, extra;
+
+    /*
+        The request is built once: a payload of 'x' characters framed
+        the way the server expects.
+    */
+    bench->request = malloc(bench->payload + FRAMING_HEADER_LEN + 1);
+    if (bench->request == NULL)
+    {
+        error("ERROR allocating request");
+    }
+    if (bench->framing == FRAMING_LENGTH)
+    {
+        bench->request[0] = (char) (bench->payload >> 24);
+        bench->request[1] = (char) (bench->payload >> 16);
+        bench->request[2] = (char) (bench->payload >> 8);
+        bench->request[3] = (char) bench->payload;
+        memset(bench->request + FRAMING_HEADER_LEN, 'x', bench->payload);
+        bench->request_len = bench->payload + FRAMING_HEADER_LEN;
+    }
+    else
+    {
+        memset(bench->request, 'x', bench->payload);
+        bench->request[bench->payload] = '\n';
+        bench->request_len = bench->payload + 1;
+    }
+
+    threads = calloc(bench->threads, sizeof(*threads));
+    all = histogram_create();
+    if (threads == NULL || all == NULL)
+    {
+        error("ERROR allocating threads");
+    }
+
+    per = bench->connections / bench->threads;
+    extra = bench->connections % bench->threads;
+
+    start = now_ns();
+    for (i = 0; i < bench->threads; i++)
+    {
+        threads[i].bench = bench;
+        threads[i].first_conn = i * per + (i < extra ? i : extra);
+        threads[i].nconns = per + (i < extra);
+        if (threads[i].nconns == 0)
+        {
+            continue;
+        }
+        errno = pthread_create(&threads[i].thread, NULL, bench_run, &threads[i]);
+        if (errno != 0)
+        {
+            error("ERROR creating thread");
+        }
+    }
+
+    for (i = 0; i < bench->threads; i++)
+    {
+        if (threads[i].nconns == 0)
+        {
+            continue;
+        }
+        pthread_join(threads[i].thread, NULL);
+        histogram_merge(all, threads[i].latency);
+        histogram_destroy(threads[i].latency);
+        errors += threads[i].errors;
+        reconnects += threads[i].reconnects;
+    }
+    elapsed = now_ns() - start;
+    seconds = (double) elapsed / NS_PER_SEC;
+
+    printf("%d connections, %d threads, %zu byte payload, %s",
+           bench->connections, bench->threads, bench->payload, mode_names[bench->mode]);
+    if (bench->mode != MODE_CLOSED)
+    {
+        printf(" at %.0f req/s", bench->rate);
+    }
+    printf("\n");
+    printf("  requests:   %llu in %.3f s, %lu errors, %lu reconnects\n",
+           (unsigned long long) all->count, seconds, errors, reconnects);
+    printf("  throughput: %.0f req/s, %.2f MB/s sent\n",
+           all->count / seconds, all->count * (double) bench->request_len / seconds / 1e6);
+    printf("  latency us: p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           histogram_percentile(all, 50) / 1000.0, histogram_percentile(all, 99) / 1000.0,
+           histogram_percentile(all, 99.9) / 1000.0, all->max / 1000.0);
+    if (bench->mode == MODE_OPEN)
+    {
+        printf("              (measured from each request's scheduled send time)\n");
+    }
+
+    histogram_destroy(all);
+    free(threads);
+    free(bench->request);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage %s [options] hostname port\n"
+            "  -c, --connections=N        concurrent connections (default: 1)\n"
+            "  -t, --threads=N            threads sharing the connections (default: 1)\n"
+            "  -n, --messages=N           messages per connection (default: 1000)\n"
+            "  -s, --size=BYTES           payload size (default: 16)\n"
+            "  -r, --rate=N               total messages per second, 0 for closed loop (default: 0)\n"
+            "  -o, --open-loop            send on the --rate timeline without waiting for replies\n"
+            "  -f, --framing=line|length  message framing (default: line)\n",
+            prog);
+    exit(0);
+}
+
 int main(int argc, char *argv[])
 {
+    static const struct option options[] = {
+        { "connections", required_argument, NULL, 'c' },
+        { "threads", required_argument, NULL, 't' },
+        { "messages", required_argument, NULL, 'n' },
+        { "size", required_argument, NULL, 's' },
+        { "rate", required_argument, NULL, 'r' },
+        { "open-loop", no_argument, NULL, 'o' },
+        { "framing", required_argument, NULL, 'f' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct bench bench;
+    int benchmark = 0;
+    int open_loop = 0;
+    int c;
+
     int sockfd, portNumber, n;
 
     struct sockaddr_in serv_addr;
     struct hostent *server;
 
     char buffer[256];
-    if (argc < 3)
+
+    memset(&bench, 0, sizeof(bench));
+    bench.connections = 1;
+    bench.threads = 1;
+    bench.messages = 1000;
+    bench.payload = 16;
+    bench.framing = FRAMING_LINE;
+
+    while ((c = getopt_long(argc, argv, "c:t:n:s:r:of:", options, NULL)) != -1)
     {
-        fprintf(stderr, "usage %s hostname port\n", argv[0]);
+        benchmark = 1;
+        switch (c)
+        {
+        case 'c':
+            bench.connections = atoi(optarg);
+            break;
+        case 't':
+            bench.threads = atoi(optarg);
+            break;
+        case 'n':
+            bench.messages = atol(optarg);
+            break;
+        case 's':
+            bench.payload = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            bench.rate = atof(optarg);
+            break;
+        case 'o':
+            open_loop = 1;
+            break;
+        case 'f':
+            if (strcmp(optarg, "line") == 0)
+            {
+                bench.framing = FRAMING_LINE;
+            }
+            else if (strcmp(optarg, "length") == 0)
+            {
+                bench.framing = FRAMING_LENGTH;
+            }
+            else
+            {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
     }
 
-    portNumber = atoi(argv[2]);
+    if (argc - optind < 2)
+    {
+        usage(argv[0]);
+    }
+    if (bench.connections < 1 || bench.threads < 1 || bench.messages < 1 || bench.rate < 0)
+    {
+        usage(argv[0]);
+    }
 
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0)
+    // An open loop needs a timeline to follow.
+    if (open_loop && bench.rate <= 0)
     {
-        error("ERROR opening socket");
+        usage(argv[0]);
     }
+    bench.mode = open_loop ? MODE_OPEN : bench.rate > 0 ? MODE_RATE : MODE_CLOSED;
+
+    portNumber = atoi(argv[optind + 1]);
 
-    server = gethostbyname(argv[1]);
+    server = gethostbyname(argv[optind]);
     if (server == NULL)
     {
         fprintf(stderr, "ERROR, no such host\n");
@@ -44,21 +777,42 @@ int main(int argc, char *argv[])
 
     bcopy(
         (char *)server->h_addr,
-        (char *)&serv_addr.sin_addr.s_addr, 
+        (char *)&serv_addr.sin_addr.s_addr,
         server->h_length
     );
     serv_addr.sin_port = htons(portNumber);
+
+    if (benchmark)
+    {
+        bench.serv_addr = serv_addr;
+        bench_main(&bench);
+        return 0;
+    }
+
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0)
+    {
+        error("ERROR opening socket");
+    }
+
     if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
     {
         error("ERROR connecting");
     }
-    
+
     printf("Please enter the message: ");
     bzero(buffer, 256);
     fgets(buffer, 255, stdin);
-    
+
     n = write(sockfd, buffer, strlen(buffer));
-    if (n < 0) 
+    if (n < 0)
+    {
+        error("ERROR writing to socket");
+    }
+
+    bzero(buffer, 256);
+    n = read(sockfd, buffer, 255);
+    if (n < 0)
     {
         error("ERROR reading from socket");
     }
@@ -66,4 +820,4 @@ int main(int argc, char *argv[])
     printf("%s\n", buffer);
 
     return 0;
-}
\ No newline at end of file
+}
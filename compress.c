@@ -0,0 +1,581 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compress.h"
+#include "pool.h"
+#include "respcache.h"
+#include "task.h"
+
+/*
+    Content codings for static files.
+
+    The coding is picked from the client's Accept-Encoding header,
+    among those built in: gzip always (zlib), zstd when compiled with
+    -DHAVE_ZSTD (and linked with -lzstd). If a file has a
+    precompressed sibling, e.g. site.css.gz next to site.css, that is
+    sent as is; the caller looks for it with compress_suffix().
+
+    Otherwise files of a compressible type and of moderate size are
+    compressed on the fly. That happens on the thread pool when there
+    is one, and the result lands in the response cache, so the
+    request that started it is answered uncompressed and the ones
+    after it get the compressed response from memory. Without a pool
+    the worker compresses while the request waits.
+
+    Compressed bodies are also kept in a cache of their own, keyed by
+    the uncompressed contents and the coding. When a file changes the
+    response cache forgets it, but if the contents come back the same
+    (the file was touched, or rewritten by a deploy) or several paths
+    hold the same contents, the compressed body is found here rather
+    than compressed again. A hash of the contents only finds the
+    candidates: the checksums it is made of are easy to make collide
+    on purpose, so each body keeps a copy of what it was compressed
+    from, and a match is confirmed byte for byte. The cache holds at
+    most its byte budget, copies included, and drops the least
+    recently used body first.
+*/
+
+struct encoding
+{
+    const char *name;
+
+    // The extension of precompressed siblings.
+    const char *suffix;
+
+    // Compresses into out; returns the compressed size, or 0 if it does not fit in cap.
+    size_t (*compress)(const char *in, size_t len, char *out, size_t cap);
+};
+
+// A compressed body in the cache.
+struct compressed
+{
+    struct compressed *hash_next;
+    struct compressed *lru_prev;
+    struct compressed *lru_next;
+
+    // The key: the uncompressed contents, their hash and size, and the coding.
+    uint64_t hash;
+    size_t size;
+    char *original;
+    const struct encoding *encoding;
+
+    // The cache's reference, while cached, plus one per user.
+    int refs;
+
+    size_t len;
+    char data[];
+};
+
+/*
+    A file being compressed on the pool. It holds a reference to the
+    file, which is only dropped back on the worker it came from.
+*/
+struct compress_job
+{
+    // Must stay first: the job is handed to the pool as a task.
+    struct task task;
+
+    // The worker's other jobs in progress.
+    struct compress_job *next;
+
+    struct file_entry *file;
+    const struct encoding *encoding;
+    const char *content_type;
+
+    // respcache_version() when the job was started.
+    unsigned long version;
+
+    size_t path_len;
+    char path[];
+};
+
+static struct
+{
+    pthread_mutex_t lock;
+
+    size_t budget;
+    size_t bytes;
+
+    // The least recently used body is at the tail.
+    struct compressed *lru_head;
+    struct compressed *lru_tail;
+
+    struct compressed *buckets[COMPRESS_BUCKETS];
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// This worker's compressions in progress, so the same one is not started twice.
+static __thread struct compress_job *pending;
+static __thread int npending;
+
+static size_t compress_gzip(const char *in, size_t len, char *out, size_t cap)
+{
+    z_stream z;
+    size_t n = 0;
+
+    memset(&z, 0, sizeof(z));
+    // 16 added to the window bits asks for a gzip header and trailer rather than zlib's.
+    if (deflateInit2(&z, COMPRESS_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return 0;
+    }
+    z.next_in = (Bytef *) in;
+    z.avail_in = len;
+    z.next_out = (Bytef *) out;
+    z.avail_out = cap;
+    if (deflate(&z, Z_FINISH) == Z_STREAM_END)
+    {
+        n = z.total_out;
+    }
+    deflateEnd(&z);
+    return n;
+}
+
+#ifdef HAVE_ZSTD
+static size_t compress_zstd(const char *in, size_t len, char *out, size_t cap)
+{
+    size_t n = ZSTD_compress(out, cap, in, len, COMPRESS_ZSTD_LEVEL);
+
+    return ZSTD_isError(n) ? 0 : n;
+}
+#endif
+
+// In order of preference when the client likes several equally.
+static const struct encoding encodings[] = {
+#ifdef HAVE_ZSTD
+    { "zstd", ".zst", compress_zstd },
+#endif
+    { "gzip", ".gz", compress_gzip },
+};
+
+#define COMPRESS_NENCODINGS (sizeof(encodings) / sizeof(encodings[0]))
+
+static const struct encoding *compress_encoding(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < COMPRESS_NENCODINGS; i++)
+    {
+        if (encodings[i].name == name || strcmp(encodings[i].name, name) == 0)
+        {
+            return &encodings[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Whether a type is worth compressing. Images other than SVG,
+ * and most binary formats, are compressed already.
+ *
+ * Responses of such a type depend on the request's Accept-Encoding,
+ * whether they end up compressed or not, and say so with Vary.
+ */
+int compress_worthwhile(const char *content_type)
+{
+    static const char *const types[] = {
+        "text/", "application/json", "application/xml", "image/svg+xml", "application/wasm",
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+    {
+        if (strncmp(content_type, types[i], strlen(types[i])) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Sets the byte budget of the compression cache. Call before
+ * the workers start; 0 turns off compression on the fly, leaving
+ * only precompressed files.
+ *
+ * @param budget
+ */
+void compress_init(size_t budget)
+{
+    cache.budget = budget;
+}
+
+/**
+ * @brief Picks the content coding for a response.
+ *
+ * @param req
+ * @param content_type of the file asked for.
+ * @return the name of the coding, a string constant, or NULL to send
+ * the file as it is.
+ */
+const char *compress_negotiate(const struct http_request *req, const char *content_type)
+{
+    const char *best = NULL;
+    int best_q = 0;
+    int q;
+    size_t i;
+
+    if (!compress_worthwhile(content_type))
+    {
+        return NULL;
+    }
+    for (i = 0; i < COMPRESS_NENCODINGS; i++)
+    {
+        q = http_accepts(req, encodings[i].name);
+        if (q > best_q)
+        {
+            best = encodings[i].name;
+            best_q = q;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief The extension of a precompressed sibling in the given coding.
+ *
+ * @param encoding as returned by compress_negotiate().
+ * @return e.g. ".gz".
+ */
+const char *compress_suffix(const char *encoding)
+{
+    return compress_encoding(encoding)->suffix;
+}
+
+/**
+ * @brief Whether a path names the precompressed sibling of another
+ * file, whose responses are cached under that file's path.
+ *
+ * @param path
+ * @param len
+ * @return the length of the other file's path, or 0 if path has no
+ * known suffix.
+ */
+size_t compress_sibling_of(const char *path, size_t len)
+{
+    size_t suffix_len;
+    size_t i;
+
+    for (i = 0; i < COMPRESS_NENCODINGS; i++)
+    {
+        suffix_len = strlen(encodings[i].suffix);
+        if (len > suffix_len && memcmp(path + len - suffix_len, encodings[i].suffix, suffix_len) == 0)
+        {
+            return len - suffix_len;
+        }
+    }
+    return 0;
+}
+
+static void compress_release(struct compressed *c)
+{
+    if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(c->original);
+        free(c);
+    }
+}
+
+static void compress_lru_unlink(struct compressed *c)
+{
+    if (c->lru_prev != NULL)
+    {
+        c->lru_prev->lru_next = c->lru_next;
+    }
+    else
+    {
+        cache.lru_head = c->lru_next;
+    }
+    if (c->lru_next != NULL)
+    {
+        c->lru_next->lru_prev = c->lru_prev;
+    }
+    else
+    {
+        cache.lru_tail = c->lru_prev;
+    }
+}
+
+static void compress_lru_push(struct compressed *c)
+{
+    c->lru_prev = NULL;
+    c->lru_next = cache.lru_head;
+    if (cache.lru_head != NULL)
+    {
+        cache.lru_head->lru_prev = c;
+    }
+    else
+    {
+        cache.lru_tail = c;
+    }
+    cache.lru_head = c;
+}
+
+static struct compressed **compress_bucket(uint64_t hash)
+{
+    return &cache.buckets[hash & (COMPRESS_BUCKETS - 1)];
+}
+
+/**
+ * @brief Looks up a compressed body. Called with the lock held.
+ *
+ * @param hash of the uncompressed contents.
+ * @param original the uncompressed contents.
+ * @param size
+ * @param encoding
+ * @return the body, with a reference taken, or NULL.
+ */
+static struct compressed *compress_find(uint64_t hash, const char *original, size_t size,
+                                        const struct encoding *encoding)
+{
+    struct compressed *c;
+
+    for (c = *compress_bucket(hash); c != NULL; c = c->hash_next)
+    {
+        if (c->hash == hash && c->size == size && c->encoding == encoding &&
+            memcmp(c->original, original, size) == 0)
+        {
+            compress_lru_unlink(c);
+            compress_lru_push(c);
+            __atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+            return c;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Drops the least recently used body. Called with the lock held.
+ */
+static void compress_evict(void)
+{
+    struct compressed *c = cache.lru_tail;
+    struct compressed **p = compress_bucket(c->hash);
+
+    while (*p != c)
+    {
+        p = &(*p)->hash_next;
+    }
+    *p = c->hash_next;
+    compress_lru_unlink(c);
+    cache.bytes -= c->len + c->size;
+    compress_release(c);
+}
+
+/**
+ * @brief Adds a body to the cache, unless an equal one got there first.
+ *
+ * @param c holding the caller's reference.
+ * @return the body to use, with a reference for the caller.
+ */
+static struct compressed *compress_insert(struct compressed *c)
+{
+    struct compressed *existing;
+
+    pthread_mutex_lock(&cache.lock);
+    existing = compress_find(c->hash, c->original, c->size, c->encoding);
+    if (existing != NULL)
+    {
+        pthread_mutex_unlock(&cache.lock);
+        compress_release(c);
+        return existing;
+    }
+    if (c->len + c->size <= cache.budget)
+    {
+        while (cache.bytes + c->len + c->size > cache.budget)
+        {
+            compress_evict();
+        }
+        c->refs++;
+        c->hash_next = *compress_bucket(c->hash);
+        *compress_bucket(c->hash) = c;
+        compress_lru_push(c);
+        cache.bytes += c->len + c->size;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return c;
+}
+
+/**
+ * @brief Reads a whole file.
+ *
+ * @return the contents, to be freed, or NULL on failure.
+ */
+static char *compress_read(int fd, size_t size)
+{
+    char *body = malloc(size);
+    size_t got = 0;
+    ssize_t n;
+
+    while (body != NULL && got < size)
+    {
+        n = pread(fd, body + got, size - got, got);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            free(body);
+            return NULL;
+        }
+        got += n;
+    }
+    return body;
+}
+
+/**
+ * @brief Runs on a pool thread: compresses the file, or finds it
+ * compressed already, and puts the response in the response cache.
+ *
+ * @param task
+ */
+static void compress_run(struct task *task)
+{
+    struct compress_job *job = (struct compress_job *) task;
+    size_t size = job->file->size;
+    struct compressed *c;
+    struct resp_entry *entry;
+    uint64_t hash;
+    char *body;
+
+    body = compress_read(job->file->fd, size);
+    if (body == NULL)
+    {
+        return;
+    }
+
+    // Two cheap checksums zlib computes quickly, to find the bodies worth comparing.
+    hash = (uint64_t) crc32(0, (const Bytef *) body, size) << 32 | adler32(1, (const Bytef *) body, size);
+
+    pthread_mutex_lock(&cache.lock);
+    c = compress_find(hash, body, size, job->encoding);
+    pthread_mutex_unlock(&cache.lock);
+
+    if (c != NULL)
+    {
+        free(body);
+    }
+    else
+    {
+        c = malloc(sizeof(*c) + size);
+        if (c == NULL)
+        {
+            free(body);
+            return;
+        }
+        // No room for more than the original means it is not worth it.
+        c->len = job->encoding->compress(body, size, c->data, size);
+        if (c->len == 0)
+        {
+            free(c);
+            free(body);
+            return;
+        }
+        c->hash = hash;
+        c->size = size;
+        c->original = body;
+        c->encoding = job->encoding;
+        c->refs = 1;
+        c = compress_insert(c);
+    }
+
+    entry = respcache_put_data(job->path, job->path_len, job->encoding->name, job->content_type,
+                               c->data, c->len, job->version);
+    if (entry != NULL)
+    {
+        respcache_release(entry);
+    }
+    compress_release(c);
+}
+
+/**
+ * @brief Runs on the worker that started the job once it is done.
+ *
+ * @param task
+ */
+static void compress_complete(struct task *task)
+{
+    struct compress_job *job = (struct compress_job *) task;
+    struct compress_job **p;
+
+    for (p = &pending; *p != job; p = &(*p)->next)
+    {
+    }
+    *p = job->next;
+    npending--;
+
+    filecache_release(job->file);
+    free(job);
+}
+
+/**
+ * @brief Starts compressing a file whose response should be in the
+ * response cache, under (path, encoding), once done.
+ *
+ * Nothing happens if on-the-fly compression is off, the file is too
+ * small or too large, the same compression is already under way, or
+ * this worker has too many under way.
+ *
+ * @param reactor the worker's.
+ * @param path relative to the document root.
+ * @param len
+ * @param encoding as returned by compress_negotiate().
+ * @param file the open file; the job takes its own reference.
+ */
+void compress_start(struct reactor *reactor, const char *path, size_t len,
+                    const char *encoding, struct file_entry *file)
+{
+    const struct encoding *enc = compress_encoding(encoding);
+    struct compress_job *job;
+
+    if (cache.budget == 0 || file->size < COMPRESS_BODY_MIN || file->size > COMPRESS_BODY_MAX ||
+        npending >= COMPRESS_MAX_PENDING)
+    {
+        return;
+    }
+    for (job = pending; job != NULL; job = job->next)
+    {
+        if (job->encoding == enc && job->path_len == len && memcmp(job->path, path, len) == 0)
+        {
+            return;
+        }
+    }
+
+    job = malloc(sizeof(*job) + len);
+    if (job == NULL)
+    {
+        return;
+    }
+    job->task.run = compress_run;
+    job->task.complete = compress_complete;
+    job->task.reactor = reactor;
+    job->file = file;
+    job->encoding = enc;
+    job->content_type = file->content_type;
+    job->version = respcache_version();
+    job->path_len = len;
+    memcpy(job->path, path, len);
+    filecache_retain(file);
+
+    job->next = pending;
+    pending = job;
+    npending++;
+
+    if (reactor->pool != NULL)
+    {
+        pool_submit(reactor->pool, &job->task);
+    }
+    else
+    {
+        compress_run(&job->task);
+        compress_complete(&job->task);
+    }
+}
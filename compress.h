@@ -0,0 +1,36 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+
+#include "filecache.h"
+#include "http.h"
+#include "reactor.h"
+
+// Files up to this size are compressed on the fly.
+#define COMPRESS_BODY_MAX (1024 * 1024)
+
+// Smaller files are not worth compressing.
+#define COMPRESS_BODY_MIN 256
+
+// The most compressions one worker has in progress at a time.
+#define COMPRESS_MAX_PENDING 16
+
+// Hash buckets in the compression cache. Must be a power of two.
+#define COMPRESS_BUCKETS 1024
+
+// The zlib level used for gzip.
+#define COMPRESS_GZIP_LEVEL 6
+
+// The zstd level used for zstd.
+#define COMPRESS_ZSTD_LEVEL 3
+
+void compress_init(size_t budget);
+int compress_worthwhile(const char *content_type);
+const char *compress_negotiate(const struct http_request *req, const char *content_type);
+const char *compress_suffix(const char *encoding);
+size_t compress_sibling_of(const char *path, size_t len);
+void compress_start(struct reactor *reactor, const char *path, size_t len,
+                    const char *encoding, struct file_entry *file);
+
+#endif
@@ -0,0 +1,332 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "accept_queue.h"
+#include "buffer.h"
+#include "config.h"
+
+/**
+ * @brief Prints how to invoke the server and exits.
+ *
+ * @param prog
+ */
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options] port\n"
+            "  -e, --engine=epoll|uring   I/O engine (default: epoll)\n"
+            "  -f, --framing=MODE         line, length or http (default: line)\n"
+            "  -m, --max-frame=BYTES      largest message accepted (default: 65532)\n"
+            "  -w, --workers=N            worker threads, one per core (default: 1)\n"
+            "  -b, --backlog=N            listen backlog (default and maximum: somaxconn)\n"
+            "  -a, --accept-batch=N       connections accepted per wakeup, 0 for all (default: 64)\n"
+            "  -s, --sample-interval=SEC  accept queue sampling period, 0 to disable (default: 1)\n"
+            "  -i, --idle-timeout=MS      close connections idle between messages (default: 60000)\n"
+            "  -r, --read-timeout=MS      close connections stalled inside a message (default: 10000)\n"
+            "  -W, --write-timeout=MS     close connections not reading their replies (default: 10000)\n"
+            "                             a timeout of 0 disables it\n"
+            "  -H, --handler=ack|hash     what to reply with (default: ack)\n"
+            "  -p, --pool=N               threads to run handlers on, 0 for the workers (default: 0;\n"
+            "                             more implies --engine=epoll)\n"
+            "  -d, --root=DIR             serve files from DIR (HTTP only; implies\n"
+            "                             --engine=epoll)\n"
+            "  -C, --file-cache=N         open files kept per worker (default: 1024)\n"
+            "  -M, --response-cache=BYTES memory for cached small responses, 0 to disable\n"
+            "                             (default: 16777216)\n"
+            "  -z, --compress-cache=BYTES memory for bodies compressed on the fly, 0 to\n"
+            "                             only send precompressed files (default: 16777216)\n"
+            "  -Z, --zerocopy=BYTES       send writes of at least BYTES with MSG_ZEROCOPY,\n"
+            "                             0 to disable (default: 65536)\n"
+            "  -P, --proxy=HOST:PORT,...  forward HTTP requests to upstream servers\n"
+            "                             (implies --framing=http and --engine=epoll)\n"
+            "  -B, --balance=least|hash   send each request to the server with the fewest\n"
+            "                             outstanding, or by hash of its target (default: least)\n"
+            "  -A, --admin-port=[ADDR:]PORT\n"
+            "                             serve Prometheus metrics at GET /metrics on PORT,\n"
+            "                             on ADDR (default: 127.0.0.1)\n",
+            prog);
+    exit(1);
+}
+
+/**
+ * @brief Fills in config from the command line, exiting with a
+ * message if the arguments do not make sense.
+ *
+ * @param config
+ * @param argc
+ * @param argv
+ */
+void config_parse(struct config *config, int argc, char *argv[])
+{
+    static const struct option options[] = {
+        { "engine", required_argument, NULL, 'e' },
+        { "framing", required_argument, NULL, 'f' },
+        { "max-frame", required_argument, NULL, 'm' },
+        { "workers", required_argument, NULL, 'w' },
+        { "backlog", required_argument, NULL, 'b' },
+        { "accept-batch", required_argument, NULL, 'a' },
+        { "sample-interval", required_argument, NULL, 's' },
+        { "idle-timeout", required_argument, NULL, 'i' },
+        { "read-timeout", required_argument, NULL, 'r' },
+        { "write-timeout", required_argument, NULL, 'W' },
+        { "handler", required_argument, NULL, 'H' },
+        { "pool", required_argument, NULL, 'p' },
+        { "root", required_argument, NULL, 'd' },
+        { "file-cache", required_argument, NULL, 'C' },
+        { "response-cache", required_argument, NULL, 'M' },
+        { "compress-cache", required_argument, NULL, 'z' },
+        { "zerocopy", required_argument, NULL, 'Z' },
+        { "proxy", required_argument, NULL, 'P' },
+        { "balance", required_argument, NULL, 'B' },
+        { "admin-port", required_argument, NULL, 'A' },
+        { NULL, 0, NULL, 0 }
+    };
+    char *colon;
+    int c;
+
+    memset(config, 0, sizeof(*config));
+    config->engine = ENGINE_EPOLL;
+    config->framing = FRAMING_LINE;
+    config->max_frame = BUFFER_LARGE - FRAMING_HEADER_LEN;
+    config->workers = 1;
+    config->backlog = accept_queue_somaxconn();
+    config->accept_batch = 64;
+    config->sample_interval = 1;
+    config->idle_timeout = 60000;
+    config->read_timeout = 10000;
+    config->write_timeout = 10000;
+    config->handler = HANDLER_ACK;
+    config->pool_threads = 0;
+    config->root = NULL;
+    config->file_cache = 1024;
+    config->response_cache = 16 << 20;
+    config->compress_cache = 16 << 20;
+    config->zerocopy = 64 * 1024;
+    config->proxy = NULL;
+    config->balance = BALANCE_LEAST;
+    config->admin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    config->admin_port = 0;
+
+    while ((c = getopt_long(argc, argv, "e:f:m:w:b:a:s:i:r:W:H:p:d:C:M:z:Z:P:B:A:", options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'e':
+            if (strcmp(optarg, "epoll") == 0)
+            {
+                config->engine = ENGINE_EPOLL;
+            }
+            else if (strcmp(optarg, "uring") == 0)
+            {
+                config->engine = ENGINE_URING;
+            }
+            else
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'f':
+            if (strcmp(optarg, "line") == 0)
+            {
+                config->framing = FRAMING_LINE;
+            }
+            else if (strcmp(optarg, "length") == 0)
+            {
+                config->framing = FRAMING_LENGTH;
+            }
+            else if (strcmp(optarg, "http") == 0)
+            {
+                config->framing = FRAMING_HTTP;
+            }
+            else
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'm':
+            if (atol(optarg) < 1)
+            {
+                usage(argv[0]);
+            }
+            config->max_frame = atol(optarg);
+            break;
+        case 'w':
+            config->workers = atoi(optarg);
+            if (config->workers < 1)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'b':
+            config->backlog = atoi(optarg);
+            if (config->backlog < 1)
+            {
+                usage(argv[0]);
+            }
+            if (config->backlog > accept_queue_somaxconn())
+            {
+                fprintf(stderr, "WARNING backlog %d exceeds somaxconn, using %d\n",
+                        config->backlog, accept_queue_somaxconn());
+                config->backlog = accept_queue_somaxconn();
+            }
+            break;
+        case 'a':
+            config->accept_batch = atoi(optarg);
+            if (config->accept_batch < 0)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 's':
+            config->sample_interval = atoi(optarg);
+            if (config->sample_interval < 0)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'i':
+            config->idle_timeout = atoi(optarg);
+            if (config->idle_timeout < 0)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'r':
+            config->read_timeout = atoi(optarg);
+            if (config->read_timeout < 0)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'W':
+            config->write_timeout = atoi(optarg);
+            if (config->write_timeout < 0)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'H':
+            if (strcmp(optarg, "ack") == 0)
+            {
+                config->handler = HANDLER_ACK;
+            }
+            else if (strcmp(optarg, "hash") == 0)
+            {
+                config->handler = HANDLER_HASH;
+            }
+            else
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'p':
+            config->pool_threads = atoi(optarg);
+            if (config->pool_threads < 0)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'd':
+            config->root = optarg;
+            break;
+        case 'C':
+            config->file_cache = atoi(optarg);
+            if (config->file_cache < 0)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'M':
+            if (atol(optarg) < 0)
+            {
+                usage(argv[0]);
+            }
+            config->response_cache = atol(optarg);
+            break;
+        case 'z':
+            if (atol(optarg) < 0)
+            {
+                usage(argv[0]);
+            }
+            config->compress_cache = atol(optarg);
+            break;
+        case 'Z':
+            if (atol(optarg) < 0)
+            {
+                usage(argv[0]);
+            }
+            config->zerocopy = atol(optarg);
+            break;
+        case 'P':
+            config->proxy = optarg;
+            break;
+        case 'B':
+            if (strcmp(optarg, "least") == 0)
+            {
+                config->balance = BALANCE_LEAST;
+            }
+            else if (strcmp(optarg, "hash") == 0)
+            {
+                config->balance = BALANCE_HASH;
+            }
+            else
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'A':
+            colon = strrchr(optarg, ':');
+            if (colon != NULL)
+            {
+                *colon = '\0';
+                if (inet_pton(AF_INET, optarg, &config->admin_addr) != 1)
+                {
+                    usage(argv[0]);
+                }
+                optarg = colon + 1;
+            }
+            config->admin_port = atoi(optarg);
+            if (config->admin_port <= 0 || config->admin_port > 65535)
+            {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    // The proxy speaks HTTP, and is only built on the epoll reactor.
+    if (config->proxy != NULL)
+    {
+        config->framing = FRAMING_HTTP;
+        config->engine = ENGINE_EPOLL;
+    }
+
+    // Files are only served, and handlers only run on a pool, by the epoll reactor too.
+    if (config->root != NULL || config->pool_threads > 0)
+    {
+        config->engine = ENGINE_EPOLL;
+    }
+
+    /*
+      The user needs to pass in the port number on which 
+      the server will accept connections as an argument.
+      
+      This code displays an error message if the user fails to do this.
+    */
+    if (optind >= argc)
+    {
+        fprintf(stderr, "ERROR, no port provided\n");
+        exit(1);
+    }
+
+    /*
+        This uses atoi() to convert the port from a string
+        of digits to an integer.
+    */
+    config->port = atoi(argv[optind]);
+}
@@ -0,0 +1,91 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <netinet/in.h>
+
+#include "framing.h"
+#include "handler.h"
+
+// The I/O engines the server can run on.
+#define ENGINE_EPOLL 0
+#define ENGINE_URING 1
+
+// How the proxy spreads requests over its upstream servers.
+#define BALANCE_LEAST 0
+#define BALANCE_HASH 1
+
+/*
+    Settings chosen on the command line. Everything except the port
+    is optional and has a sensible default.
+*/
+struct config
+{
+    // The port number on which the server accepts connections.
+    int port;
+
+    // ENGINE_EPOLL or ENGINE_URING.
+    int engine;
+
+    // FRAMING_LINE, FRAMING_LENGTH or FRAMING_HTTP.
+    int framing;
+
+    // The largest message accepted, excluding its framing.
+    size_t max_frame;
+
+    // Number of worker threads, each with its own SO_REUSEPORT listener.
+    int workers;
+
+    // The listen() backlog, at most net.core.somaxconn.
+    int backlog;
+
+    // Most connections accepted per listener wakeup, 0 for no limit.
+    int accept_batch;
+
+    // Seconds between accept queue samples; 0 disables the sampler.
+    int sample_interval;
+
+    /*
+        Milliseconds a connection may spend waiting for the client
+        before it is closed, 0 for no limit: between messages, in the
+        middle of a message, and with replies the client is not
+        reading.
+    */
+    int idle_timeout;
+    int read_timeout;
+    int write_timeout;
+
+    // HANDLER_ACK or HANDLER_HASH.
+    int handler;
+
+    // Threads in the handler pool, 0 to run handlers on the workers.
+    int pool_threads;
+
+    // Directory GET and HEAD requests are served from in HTTP mode, or NULL.
+    const char *root;
+
+    // Files each worker keeps open.
+    int file_cache;
+
+    // Bytes of small responses kept in memory, shared by all workers.
+    size_t response_cache;
+
+    // Bytes of bodies compressed on the fly, shared by all workers.
+    size_t compress_cache;
+
+    // Writes of at least this many bytes use MSG_ZEROCOPY, 0 for none.
+    size_t zerocopy;
+
+    // The upstream servers requests are forwarded to as "host:port,...", or NULL.
+    const char *proxy;
+
+    // BALANCE_LEAST (fewest requests outstanding) or BALANCE_HASH (by target).
+    int balance;
+
+    // The address and port serving GET /metrics, 0 for none; loopback by default.
+    struct in_addr admin_addr;
+    int admin_port;
+};
+
+void config_parse(struct config *config, int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,912 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "arena.h"
+#include "compress.h"
+#include "connection.h"
+#include "filecache.h"
+#include "handler.h"
+#include "http.h"
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
+#include "respcache.h"
+
+/*
+    A message handed to the thread pool. It carries its own copy of
+    the message, since the input buffer moves on as soon as the task
+    is submitted, and room for the reply the handler produces.
+*/
+struct connection_task
+{
+    // Must stay first: the pool and the reactor only know about the task.
+    struct task task;
+
+    struct connection *conn;
+
+    // The next message of the same connection.
+    struct connection_task *next;
+
+    int handler;
+    int done;
+
+    // 0 if the reply is the last one the connection sends.
+    int keep_alive;
+
+    // When the message was complete (metrics_now()).
+    uint64_t start;
+
+    char *msg;
+    size_t msg_cap;
+    size_t msg_len;
+
+    size_t reply_len;
+    char reply[HANDLER_REPLY_MAX];
+};
+
+// Tasks are created and freed on the reactor thread, so each keeps its own.
+static __thread struct connection_task *free_tasks;
+
+/*
+    The frame of connection_serve(): everything it keeps across a
+    suspension.
+*/
+struct connection_co
+{
+    struct coroutine co;
+    int status;
+    struct frame frame;
+    int keep_alive;
+    int handler;
+    uint64_t start;
+    size_t reply_len;
+    char reply[HANDLER_REPLY_MAX];
+
+    // Scratch memory for the request being handled, reset once its reply is queued.
+    struct arena arena;
+};
+
+static void connection_on_event(struct reactor *reactor, struct event_source *source, uint32_t events);
+static void connection_on_timeout(struct timer *timer);
+static void connection_schedule(struct connection *conn);
+
+/**
+ * @brief Wraps an accepted, non-blocking socket in a connection and
+ * registers it with the reactor.
+ *
+ * @param reactor
+ * @param fd
+ * @param config
+ * @return the new connection, or NULL if it could not be set up
+ * (in which case fd has been closed).
+ */
+struct connection *connection_open(struct reactor *reactor, int fd, const struct config *config)
+{
+    struct connection *conn;
+
+    conn = calloc(1, sizeof(*conn));
+    if (conn == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    conn->source.fd = fd;
+    conn->source.on_event = connection_on_event;
+    conn->reactor = reactor;
+    conn->config = config;
+    framer_init(&conn->framer, config->framing, config->max_frame);
+    timer_init(&conn->timer, connection_on_timeout, conn);
+
+    conn->co = co_frame_alloc(sizeof(*conn->co));
+    if (conn->co == NULL)
+    {
+        close(fd);
+        free(conn);
+        return NULL;
+    }
+    arena_init(&conn->co->arena);
+
+    /*
+        The socket is registered once for both directions in
+        edge-triggered mode. epoll then only reports a change of state
+        (new data arrived, buffer space became available), so the
+        handlers below must keep reading or writing until the kernel
+        returns EAGAIN, but the registration never has to be modified.
+    */
+    if (reactor_add(reactor, &conn->source, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) < 0)
+    {
+        close(fd);
+        co_frame_free(conn->co, sizeof(*conn->co));
+        free(conn);
+        return NULL;
+    }
+
+    /*
+        Large replies are sent without copying them into the socket
+        buffer where the kernel supports it (see output_zerocopy()).
+    */
+    if (config->zerocopy > 0)
+    {
+        output_zerocopy(&conn->out, fd, config->zerocopy);
+    }
+
+    reactor->connections++;
+    conn->opened = metrics_now();
+    metrics_count(METRIC_ACCEPTED, 1);
+    connection_schedule(conn);
+    return conn;
+}
+
+/**
+ * @brief Closes the client socket and releases the connection state.
+ *
+ * @param reactor
+ * @param conn
+ */
+void connection_close(struct reactor *reactor, struct connection *conn)
+{
+    // close() also removes the descriptor from the epoll set.
+    output_close(&conn->out, conn->source.fd);
+    reactor->connections--;
+    metrics_count(METRIC_CLOSED, 1);
+    reactor_timer_cancel(reactor, &conn->timer);
+    buffer_release(&conn->in);
+    arena_release(&conn->co->arena);
+    co_frame_free(conn->co, sizeof(*conn->co));
+    conn->co = NULL;
+
+    /*
+        Tasks still in the pool point at the connection, so it lives
+        on until the last of them completes. The reactor skips any
+        further events for it either way.
+    */
+    conn->closed = 1;
+    conn->source.fd = -1;
+    if (conn->inflight == 0)
+    {
+        reactor_free(reactor, &conn->source);
+    }
+}
+
+/**
+ * @brief Works out which timeout applies and moves the deadline.
+ *
+ * Replies waiting for the client to read them fall under the write
+ * timeout, a partly received message under the read timeout, and a
+ * connection with neither under the idle timeout. While the pool is
+ * working on the connection's messages it is not timed. The write and
+ * idle timeouts restart whenever there is progress; the read timeout
+ * runs from the first byte of the message.
+ *
+ * @param conn
+ */
+static void connection_schedule(struct connection *conn)
+{
+    struct reactor *reactor = conn->reactor;
+    uint64_t start = reactor->now;
+    int timeout;
+
+    if (buffer_len(&conn->in) == 0)
+    {
+        conn->message_start = 0;
+    }
+    else if (conn->message_start == 0)
+    {
+        conn->message_start = reactor->now;
+    }
+
+    if (conn->out.bytes > 0 || conn->out.held_head != NULL)
+    {
+        timeout = conn->config->write_timeout;
+    }
+    else if (conn->inflight > 0)
+    {
+        // Waiting on the pool, not on the client.
+        timeout = 0;
+    }
+    else if (conn->message_start != 0)
+    {
+        timeout = conn->config->read_timeout;
+        start = conn->message_start;
+    }
+    else
+    {
+        timeout = conn->config->idle_timeout;
+    }
+
+    if (timeout == 0)
+    {
+        conn->deadline = 0;
+        reactor_timer_cancel(reactor, &conn->timer);
+        return;
+    }
+
+    conn->deadline = start + timeout;
+    if (!timer_armed(&conn->timer) ||
+        conn->deadline < conn->timer.expires * REACTOR_TICK_MS)
+    {
+        reactor_timer_arm(reactor, &conn->timer, conn->deadline);
+    }
+}
+
+/**
+ * @brief Called by the reactor's timing wheel when the connection's
+ * timer expires.
+ *
+ * @param timer
+ */
+static void connection_on_timeout(struct timer *timer)
+{
+    struct connection *conn = timer->data;
+    struct reactor *reactor = conn->reactor;
+
+    if (conn->deadline > reactor->now)
+    {
+        // There has been activity since the timer was armed.
+        reactor_timer_arm(reactor, timer, conn->deadline);
+        return;
+    }
+    metrics_count(METRIC_ERR_TIMEOUT, 1);
+    connection_close(reactor, conn);
+}
+
+/**
+ * @brief Reads whatever the client has sent until the socket is drained.
+ *
+ * The input buffer starts at the smallest size class and moves up
+ * to larger ones as a message grows, up to the size of the largest
+ * message we accept. Sets conn->eof when the client has closed its
+ * end.
+ *
+ * @param conn
+ * @return the number of bytes read, or -1 on error.
+ */
+static ssize_t connection_fill(struct connection *conn)
+{
+    struct buffer *in = &conn->in;
+    size_t limit = conn->config->max_frame + FRAMING_HEADER_LEN;
+    ssize_t total = 0;
+    ssize_t n;
+
+    while (!conn->eof)
+    {
+        if (buffer_reserve(in, 1, limit) < 0)
+        {
+            // Full of messages we have not processed yet.
+            break;
+        }
+
+        n = read(conn->source.fd, in->data + in->end, in->cap - in->end);
+        if (n == 0)
+        {
+            conn->eof = 1;
+            break;
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            return -1;
+        }
+        in->end += n;
+        total += n;
+    }
+    metrics_count(METRIC_BYTES_IN, total);
+
+    // Do not hold on to a block for a connection that sent nothing.
+    if (buffer_len(in) == 0)
+    {
+        buffer_release(in);
+    }
+    return total;
+}
+
+/**
+ * @brief Runs the handler on a pool thread.
+ *
+ * Only the task is touched here, never the connection, which belongs
+ * to the reactor thread.
+ *
+ * @param task
+ */
+static void connection_task_run(struct task *task)
+{
+    struct connection_task *ct = (struct connection_task *) task;
+    uint64_t start = metrics_now();
+
+    ct->reply_len = handler_run(ct->handler, ct->msg, ct->msg_len, ct->reply);
+    metrics_time(METRIC_HANDLER, start);
+}
+
+/**
+ * @brief Queues a handler's reply, framed for the connection.
+ *
+ * @param conn
+ * @param reply
+ * @param len
+ * @param keep_alive 0 if the connection is closed after this reply.
+ * @return 0 on success, -1 if memory is exhausted.
+ */
+static int connection_reply(struct connection *conn, const char *reply, size_t len, int keep_alive)
+{
+    if (conn->config->framing == FRAMING_HTTP)
+    {
+        return http_respond(&conn->out, 200, reply, len, keep_alive);
+    }
+    return framing_encode(conn->config->framing, &conn->out, reply, len);
+}
+
+static void connection_task_free(struct connection_task *ct)
+{
+    buffer_block_free(ct->msg, ct->msg_cap);
+    ct->next = free_tasks;
+    free_tasks = ct;
+}
+
+/**
+ * @brief Back on the reactor thread once the pool has run a task.
+ *
+ * Replies are queued strictly in message order: a task that finishes
+ * before the ones ahead of it waits at its place in the list, and is
+ * sent along with them once they are done.
+ *
+ * @param task
+ */
+static void connection_task_complete(struct task *task)
+{
+    struct connection_task *ct = (struct connection_task *) task;
+    struct connection *conn = ct->conn;
+    struct reactor *reactor = conn->reactor;
+    int failed = 0;
+
+    ct->done = 1;
+    while (conn->tasks != NULL && conn->tasks->done)
+    {
+        ct = conn->tasks;
+        conn->tasks = ct->next;
+        conn->inflight--;
+
+        if (!conn->closed && !failed && connection_reply(conn, ct->reply, ct->reply_len, ct->keep_alive) < 0)
+        {
+            failed = 1;
+        }
+        metrics_time(METRIC_REQUEST, ct->start);
+        connection_task_free(ct);
+    }
+    if (conn->tasks == NULL)
+    {
+        conn->tasks_tail = NULL;
+    }
+
+    if (conn->closed)
+    {
+        if (conn->inflight == 0)
+        {
+            reactor_free(reactor, &conn->source);
+        }
+        return;
+    }
+    if (failed)
+    {
+        connection_close(reactor, conn);
+        return;
+    }
+
+    // Write the replies and pick up any messages held back meanwhile.
+    connection_on_event(reactor, &conn->source, 0);
+}
+
+/**
+ * @brief Hands a message to the thread pool.
+ *
+ * @param conn
+ * @param frame
+ * @param handler
+ * @param keep_alive 0 if the reply is the last one on the connection.
+ * @return 0 on success, -1 if memory is exhausted.
+ */
+static int connection_offload(struct connection *conn, const struct frame *frame, int handler, int keep_alive)
+{
+    struct connection_task *ct = free_tasks;
+
+    if (ct != NULL)
+    {
+        free_tasks = ct->next;
+    }
+    else
+    {
+        ct = malloc(sizeof(*ct));
+        if (ct == NULL)
+        {
+            return -1;
+        }
+    }
+
+    ct->msg = buffer_block_alloc(frame->len > 0 ? frame->len : 1, &ct->msg_cap);
+    if (ct->msg == NULL)
+    {
+        ct->next = free_tasks;
+        free_tasks = ct;
+        return -1;
+    }
+    memcpy(ct->msg, frame->data, frame->len);
+    ct->msg_len = frame->len;
+    ct->conn = conn;
+    ct->next = NULL;
+    ct->handler = handler;
+    ct->keep_alive = keep_alive;
+    ct->start = conn->co->start;
+    ct->done = 0;
+    ct->task.run = connection_task_run;
+    ct->task.complete = connection_task_complete;
+    ct->task.reactor = conn->reactor;
+
+    if (conn->tasks_tail != NULL)
+    {
+        conn->tasks_tail->next = ct;
+    }
+    else
+    {
+        conn->tasks = ct;
+    }
+    conn->tasks_tail = ct;
+    conn->inflight++;
+
+    pool_submit(conn->reactor->pool, &ct->task);
+    return 0;
+}
+
+/**
+ * @brief Returns the next complete message in the input buffer.
+ *
+ * The message handed out by the previous call is dropped from the
+ * buffer first; until then it stays where it is, so the caller can
+ * use it without copying.
+ *
+ * @param conn
+ * @param frame filled in when a message is found.
+ * @return 1 if a message was found, 0 if more input is needed, -1 if
+ * the input is invalid (larger than --max-frame).
+ */
+int connection_read_frame(struct connection *conn, struct frame *frame)
+{
+    ssize_t consumed;
+
+    if (conn->frame_size > 0)
+    {
+        buffer_consume(&conn->in, conn->frame_size);
+        conn->frame_size = 0;
+        conn->message_start = 0;
+    }
+    if (buffer_len(&conn->in) == 0)
+    {
+        return 0;
+    }
+
+    consumed = framer_next(&conn->framer, conn->in.data + conn->in.start, buffer_len(&conn->in), frame);
+    if (consumed < 0)
+    {
+        metrics_count(METRIC_ERR_INVALID, 1);
+    }
+    if (consumed <= 0)
+    {
+        return (int) consumed;
+    }
+    conn->frame_size = consumed;
+    return 1;
+}
+
+/**
+ * @brief Queues a reply, framed for the connection.
+ *
+ * @param conn
+ * @param data
+ * @param len
+ * @return 0 on success, -1 if memory is exhausted.
+ */
+int connection_write(struct connection *conn, const char *data, size_t len)
+{
+    return framing_encode(conn->config->framing, &conn->out, data, len);
+}
+
+/**
+ * @brief Whether a request is for a file under --root: a GET or HEAD.
+ */
+static int connection_wants_file(const struct http_request *req)
+{
+    return (req->method.len == 3 && memcmp(req->method.data, "GET", 3) == 0) ||
+           (req->method.len == 4 && memcmp(req->method.data, "HEAD", 4) == 0);
+}
+
+/**
+ * @brief Queues the headers of a file and then the file itself.
+ *
+ * @param conn
+ * @param file a reference, which this takes over.
+ * @param content_type
+ * @param encoding the Content-Encoding of the file, or NULL for none.
+ * @param head nonzero for HEAD, which gets the headers only.
+ * @param keep_alive
+ * @return 0 on success, -1 if memory is exhausted.
+ */
+static int connection_send_uncached(struct connection *conn, struct file_entry *file, const char *content_type,
+                                    const char *encoding, int head, int keep_alive)
+{
+    if (http_respond_header(&conn->out, 200, content_type, encoding, compress_worthwhile(content_type),
+                            file->size, keep_alive) < 0)
+    {
+        filecache_release(file);
+        return -1;
+    }
+    if (head || file->size == 0)
+    {
+        filecache_release(file);
+        return 0;
+    }
+    return output_append_file(&conn->out, file->fd, 0, file->size, filecache_release, file);
+}
+
+/**
+ * @brief Queues a response from the response cache.
+ *
+ * @param conn
+ * @param cached a reference, which this takes over.
+ * @param head nonzero for HEAD: the headers describe the body, which
+ * is not sent.
+ * @return 0 on success, -1 if memory is exhausted.
+ */
+static int connection_send_cached(struct connection *conn, struct resp_entry *cached, int head)
+{
+    return output_append_ref(&conn->out, cached->data, head ? cached->header_len : cached->len,
+                             respcache_release, cached);
+}
+
+/**
+ * @brief Queues the response to a GET or HEAD request for a file.
+ *
+ * Small files come from the response cache, headers and body in one
+ * ready-made block that is queued by reference. Anything else has
+ * its body queued as a file segment, so it is sent with sendfile()
+ * straight from the page cache. Either way the queued segment holds
+ * a reference, which keeps the block or the descriptor alive until
+ * it has gone out even if a cache drops it meanwhile.
+ *
+ * If the client accepts a content coding for the file's type, a
+ * precompressed sibling is sent if there is one; otherwise the file
+ * is compressed in the background for later requests (see
+ * compress.c) and sent as it is for now.
+ *
+ * Cached responses carry no Connection header, so they are only used
+ * when the connection stays open. Only files whose changes the file
+ * cache hears about have their responses cached, since nothing else
+ * would ever invalidate them.
+ *
+ * @param conn
+ * @param req
+ * @param keep_alive
+ * @return 0 on success, -1 if memory is exhausted.
+ */
+static int connection_send_file(struct connection *conn, const struct http_request *req, int keep_alive)
+{
+    static const char not_found[] = "Not Found\n";
+    // With room to append the suffix of a precompressed sibling.
+    char path[FILECACHE_PATH_MAX + 8];
+    ssize_t path_len;
+    const char *content_type;
+    const char *encoding;
+    const char *suffix;
+    struct file_entry *file;
+    struct file_entry *variant;
+    struct resp_entry *cached = NULL;
+    int head = req->method.len == 4;
+
+    path_len = filecache_path(req->target.data, req->target.len, path);
+    if (path_len < 0)
+    {
+        return http_respond(&conn->out, 404, not_found, sizeof(not_found) - 1, keep_alive);
+    }
+    content_type = filecache_content_type(path, path_len);
+    encoding = compress_negotiate(req, content_type);
+
+    if (keep_alive && encoding != NULL)
+    {
+        cached = respcache_get(path, path_len, encoding);
+    }
+    if (cached != NULL)
+    {
+        return connection_send_cached(conn, cached, head);
+    }
+
+    file = filecache_open(conn->reactor->files, path, path_len);
+    if (file == NULL)
+    {
+        return http_respond(&conn->out, 404, not_found, sizeof(not_found) - 1, keep_alive);
+    }
+
+    if (encoding != NULL)
+    {
+        suffix = compress_suffix(encoding);
+        strcpy(path + path_len, suffix);
+        variant = filecache_open(conn->reactor->files, path, path_len + strlen(suffix));
+        path[path_len] = '\0';
+
+        if (variant != NULL)
+        {
+            filecache_release(file);
+            if (keep_alive && variant->watched)
+            {
+                cached = respcache_put(path, path_len, encoding, content_type, variant->fd, variant->size);
+            }
+            if (cached == NULL)
+            {
+                return connection_send_uncached(conn, variant, content_type, encoding, head, keep_alive);
+            }
+            filecache_release(variant);
+            return connection_send_cached(conn, cached, head);
+        }
+
+        if (keep_alive && file->watched)
+        {
+            // Without a thread pool this compresses right away, and the result can be used.
+            compress_start(conn->reactor, path, path_len, encoding, file);
+            cached = respcache_get(path, path_len, encoding);
+            if (cached != NULL)
+            {
+                filecache_release(file);
+                return connection_send_cached(conn, cached, head);
+            }
+        }
+    }
+
+    if (keep_alive)
+    {
+        cached = respcache_get(path, path_len, NULL);
+        if (cached == NULL && file->watched)
+        {
+            cached = respcache_put(path, path_len, NULL, content_type, file->fd, file->size);
+        }
+    }
+    if (cached == NULL)
+    {
+        return connection_send_uncached(conn, file, content_type, NULL, head, keep_alive);
+    }
+    filecache_release(file);
+    return connection_send_cached(conn, cached, head);
+}
+
+/**
+ * @brief The coroutine that answers the messages of one connection.
+ *
+ * It is resumed whenever the connection may be able to make
+ * progress, and reads like the blocking loop it replaces: wait for a
+ * message, work out the reply, write it. Pipelined messages that
+ * arrived together are answered in one go, and their replies are
+ * queued back to back so a single flush sends them in one write, in
+ * the order the messages came in. Writing suspends once
+ * CONNECTION_OUTPUT_HIGH bytes are queued, so a client that sends
+ * without reading cannot make us buffer without bound.
+ *
+ * With a thread pool the messages are handed to it instead, up to
+ * CONNECTION_MAX_INFLIGHT at a time, and their replies are queued as
+ * they complete.
+ *
+ * @param conn
+ * @return CO_WAITING when it cannot go on for now, CO_ERROR if the
+ * input is invalid or memory is exhausted.
+ */
+static int connection_serve(struct connection *conn)
+{
+    struct connection_co *co = conn->co;
+    uint64_t start;
+
+    CO_BEGIN(&co->co);
+    for (;;)
+    {
+        CO_AWAIT(&co->co, conn->inflight < CONNECTION_MAX_INFLIGHT);
+        if (conn->config->framing == FRAMING_HTTP)
+        {
+            /*
+                A malformed request gets a 400 before the connection
+                is closed; other protocols have no way to say so.
+            */
+            CO_AWAIT(&co->co, (co->status = connection_read_frame(conn, &co->frame)) != 0);
+            if (co->status < 0)
+            {
+                // Responses go out in order: let the pool finish first.
+                CO_AWAIT(&co->co, conn->inflight == 0);
+                if (http_respond(&conn->out, 400, "", 0, 0) < 0)
+                {
+                    CO_EXIT(&co->co, CO_ERROR);
+                }
+                CO_EXIT(&co->co, CO_DONE);
+            }
+            co->keep_alive = co->frame.request->keep_alive;
+        }
+        else
+        {
+            CO_AWAIT_FRAME(&co->co, conn, &co->frame, co->status);
+            co->keep_alive = 1;
+        }
+        log_bytes("Here is the message: %.*s\n", co->frame.data, co->frame.len);
+        co->start = metrics_now();
+
+        // Routed requests have a handler of their own; the rest get --handler.
+        co->handler = handler_route(&co->frame, &co->arena);
+        if (co->handler == -2)
+        {
+            CO_EXIT(&co->co, CO_ERROR);
+        }
+        if (co->handler < 0 && co->frame.request != NULL && conn->reactor->files != NULL &&
+            connection_wants_file(co->frame.request))
+        {
+            if (conn->inflight > 0)
+            {
+                /*
+                    Responses go out in order, so wait for the pool to
+                    finish the earlier ones. The request stays in the
+                    buffer meanwhile, but has to be parsed again.
+                */
+                CO_AWAIT(&co->co, conn->inflight == 0);
+                conn->frame_size = 0;
+                connection_read_frame(conn, &co->frame);
+            }
+            if (connection_send_file(conn, co->frame.request, co->keep_alive) < 0)
+            {
+                CO_EXIT(&co->co, CO_ERROR);
+            }
+            metrics_time(METRIC_REQUEST, co->start);
+            if (!co->keep_alive)
+            {
+                CO_EXIT(&co->co, CO_DONE);
+            }
+            CO_AWAIT(&co->co, conn->out.bytes < CONNECTION_OUTPUT_HIGH);
+            continue;
+        }
+        if (co->handler < 0)
+        {
+            co->handler = conn->config->handler;
+        }
+
+        if (conn->reactor->pool != NULL)
+        {
+            if (connection_offload(conn, &co->frame, co->handler, co->keep_alive) < 0)
+            {
+                CO_EXIT(&co->co, CO_ERROR);
+            }
+            // The task has its own copy of the message.
+            arena_reset(&co->arena);
+            if (!co->keep_alive)
+            {
+                // Read no further; the connection closes once the pool's replies are out.
+                CO_EXIT(&co->co, CO_DONE);
+            }
+            continue;
+        }
+
+        start = metrics_now();
+        co->reply_len = handler_run(co->handler, co->frame.data, co->frame.len, co->reply);
+        metrics_time(METRIC_HANDLER, start);
+        arena_reset(&co->arena);
+        if (!co->keep_alive)
+        {
+            // The client asked for the connection to be closed after this one.
+            if (http_respond(&conn->out, 200, co->reply, co->reply_len, 0) < 0)
+            {
+                CO_EXIT(&co->co, CO_ERROR);
+            }
+            metrics_time(METRIC_REQUEST, co->start);
+            CO_EXIT(&co->co, CO_DONE);
+        }
+        metrics_time(METRIC_REQUEST, co->start);
+        CO_WRITE(&co->co, conn, co->reply, co->reply_len);
+    }
+    CO_END(&co->co);
+}
+
+/**
+ * @brief Called by the reactor whenever the client socket changes state.
+ *
+ * The connection is kept open for as many messages as the client
+ * wants to send. Reading, answering and writing alternate until the
+ * socket has nothing more to give or we have as much output queued
+ * as we are willing to hold; in the latter case EPOLLOUT resumes the
+ * loop once the client has read some of it. When the client closes
+ * its end, the remaining replies are written and the connection is
+ * closed.
+ *
+ * @param reactor
+ * @param source
+ * @param events
+ */
+static void connection_on_event(struct reactor *reactor, struct event_source *source, uint32_t events)
+{
+    struct connection *conn = (struct connection *) source;
+    size_t queued;
+    ssize_t n;
+    int status;
+
+    /*
+        EPOLLERR also announces MSG_ZEROCOPY completions on the error
+        queue; only a real error closes the connection.
+    */
+    if ((events & EPOLLHUP) || ((events & EPOLLERR) && output_reap(&conn->out, conn->source.fd) < 0))
+    {
+        metrics_count(METRIC_ERR_IO, 1);
+        connection_close(reactor, conn);
+        return;
+    }
+
+    for (;;)
+    {
+        status = connection_serve(conn);
+        if (status == CO_ERROR)
+        {
+            connection_close(reactor, conn);
+            return;
+        }
+        if (status == CO_DONE)
+        {
+            // Nothing more will be read; close once the replies are out.
+            conn->eof = 1;
+        }
+
+        queued = conn->out.bytes;
+        if (queued > 0 && output_flush(&conn->out, conn->source.fd) < 0)
+        {
+            metrics_count(METRIC_ERR_IO, 1);
+            connection_close(reactor, conn);
+            return;
+        }
+        if (queued > conn->out.bytes)
+        {
+            metrics_count(METRIC_BYTES_OUT, queued - conn->out.bytes);
+            if (conn->opened != 0)
+            {
+                metrics_time(METRIC_FIRST_BYTE, conn->opened);
+                conn->opened = 0;
+            }
+        }
+
+        // Still too much queued: wait for EPOLLOUT before taking more.
+        if (conn->out.bytes >= CONNECTION_OUTPUT_HIGH)
+        {
+            connection_schedule(conn);
+            return;
+        }
+
+        n = connection_fill(conn);
+        if (n < 0)
+        {
+            metrics_count(METRIC_ERR_IO, 1);
+            connection_close(reactor, conn);
+            return;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+    }
+
+    /*
+        Once the client has closed its end and everything it asked for
+        has been written, and the kernel no longer reads any of it
+        from our memory, we are done. Any incomplete message left in
+        the buffer can never be completed.
+    */
+    if (conn->eof && conn->out.bytes == 0 && conn->out.held_head == NULL && conn->inflight == 0)
+    {
+        connection_close(reactor, conn);
+        return;
+    }
+    connection_schedule(conn);
+}
@@ -0,0 +1,143 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stddef.h>
+
+#include "buffer.h"
+#include "config.h"
+#include "coroutine.h"
+#include "framing.h"
+#include "output.h"
+#include "reactor.h"
+#include "timer_wheel.h"
+
+struct connection_task;
+struct connection_co;
+
+// Most messages of one connection the thread pool works on at once.
+#define CONNECTION_MAX_INFLIGHT 64
+
+/*
+    Once this many reply bytes are waiting to be written, no more
+    messages are read from the connection until the client catches up.
+*/
+#define CONNECTION_OUTPUT_HIGH (256 * 1024)
+
+/*
+    Everything the server needs to remember about one client between
+    events. The reactor hands this back to us whenever the client's
+    socket becomes readable or writable, so nothing has to live on the
+    stack of a blocking call.
+*/
+struct connection
+{
+    // Must stay first: the reactor only knows about the event_source.
+    struct event_source source;
+
+    struct reactor *reactor;
+    const struct config *config;
+
+    // Splits the input into messages.
+    struct framer framer;
+
+    /*
+        Characters read from the socket but not yet consumed as a
+        message. The buffer only holds memory while a message is
+        partially received.
+    */
+    struct buffer in;
+
+    /*
+        The reply being written, as a chain of segments that is
+        flushed with one sendmsg() and resumed on EPOLLOUT if the
+        socket cannot take it all.
+    */
+    struct output out;
+
+    // Set once the client has closed its end of the connection.
+    int eof;
+
+    /*
+        When the connection times out, on the reactor's clock. It is
+        pushed back on every event, but the timer is only moved when
+        the deadline comes earlier; otherwise it fires at the old time,
+        finds the deadline has moved on and re-arms itself. Busy
+        connections therefore rarely touch the timing wheel at all.
+    */
+    uint64_t deadline;
+    struct timer timer;
+
+    /*
+        When the first byte of the message still being received
+        arrived, 0 between messages. The read timeout counts from here,
+        so a client trickling a message in byte by byte cannot hold
+        the connection open for longer than one timeout.
+    */
+    uint64_t message_start;
+
+    // When it was accepted (metrics_now()), 0 once its first response byte is out.
+    uint64_t opened;
+
+    /*
+        Messages handed to the thread pool, oldest first, and how many
+        there are. Their replies go out in this order, whatever order
+        the pool finishes them in.
+    */
+    struct connection_task *tasks;
+    struct connection_task *tasks_tail;
+    int inflight;
+
+    // Set once the socket is closed; the memory waits for the pool.
+    int closed;
+
+    /*
+        The coroutine that serves the connection, and the size of the
+        message it was last given, which stays in the input buffer
+        until it asks for the next one.
+    */
+    struct connection_co *co;
+    size_t frame_size;
+};
+
+struct connection *connection_open(struct reactor *reactor, int fd, const struct config *config);
+void connection_close(struct reactor *reactor, struct connection *conn);
+int connection_read_frame(struct connection *conn, struct frame *frame);
+int connection_write(struct connection *conn, const char *data, size_t len);
+
+/*
+    Awaitables for the coroutine serving a connection.
+
+    CO_AWAIT_FRAME suspends until a complete message has arrived and
+    points frame at it; status, which must live in the coroutine's
+    frame, receives the result of connection_read_frame(). The
+    message stays valid until the coroutine next suspends, so copy
+    whatever is needed beyond that.
+
+    CO_WRITE queues a reply, framed for the connection, and suspends
+    while more output is queued than CONNECTION_OUTPUT_HIGH. As with
+    framing_encode(), replies larger than FRAMING_COPY_MAX are not
+    copied and must stay valid until written.
+
+    Both end the coroutine with CO_ERROR if the connection fails.
+*/
+#define CO_AWAIT_FRAME(co, conn, frame, status)                                 \
+    do                                                                          \
+    {                                                                           \
+        CO_AWAIT(co, ((status) = connection_read_frame(conn, frame)) != 0);     \
+        if ((status) < 0)                                                       \
+        {                                                                       \
+            CO_EXIT(co, CO_ERROR);                                              \
+        }                                                                       \
+    } while (0)
+
+#define CO_WRITE(co, conn, data, len)                                           \
+    do                                                                          \
+    {                                                                           \
+        if (connection_write(conn, data, len) < 0)                              \
+        {                                                                       \
+            CO_EXIT(co, CO_ERROR);                                              \
+        }                                                                       \
+        CO_AWAIT(co, (conn)->out.bytes < CONNECTION_OUTPUT_HIGH);               \
+    } while (0)
+
+#endif
@@ -0,0 +1,73 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "coroutine.h"
+
+/*
+    Every connection has a coroutine frame for as long as it is open,
+    so frames are recycled the same way buffer blocks and output
+    segments are: through a free list private to each thread. All
+    frames on the list are CO_FRAME_MAX bytes, whatever the size
+    asked for.
+*/
+struct free_frame
+{
+    struct free_frame *next;
+};
+
+static __thread struct free_frame *free_frames;
+
+/**
+ * @brief Allocates a zeroed coroutine frame, ready to start.
+ *
+ * @param size
+ * @return the frame, or NULL if memory is exhausted.
+ */
+void *co_frame_alloc(size_t size)
+{
+    struct free_frame *frame;
+
+    if (size > CO_FRAME_MAX)
+    {
+        return calloc(1, size);
+    }
+
+    frame = free_frames;
+    if (frame != NULL)
+    {
+        free_frames = frame->next;
+    }
+    else
+    {
+        frame = malloc(CO_FRAME_MAX);
+        if (frame == NULL)
+        {
+            return NULL;
+        }
+    }
+    memset(frame, 0, size);
+    return frame;
+}
+
+/**
+ * @brief Returns a frame from co_frame_alloc().
+ *
+ * @param frame may be NULL.
+ * @param size the size it was allocated with.
+ */
+void co_frame_free(void *frame, size_t size)
+{
+    struct free_frame *f = frame;
+
+    if (f == NULL)
+    {
+        return;
+    }
+    if (size > CO_FRAME_MAX)
+    {
+        free(f);
+        return;
+    }
+    f->next = free_frames;
+    free_frames = f;
+}
@@ -0,0 +1,74 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include <stddef.h>
+
+/*
+    Stackless coroutines in plain C.
+
+    A coroutine is an ordinary function that is called again every
+    time it may be able to make progress, and picks up where it left
+    off. CO_BEGIN opens a switch on the saved resume point and each
+    CO_AWAIT saves its own line as a case label before returning, so
+    the next call jumps straight back to it:
+
+        static int serve(struct session *s)
+        {
+            CO_BEGIN(&s->co);
+            for (;;)
+            {
+                CO_AWAIT(&s->co, have_input(s));
+                ...
+            }
+            CO_END(&s->co);
+        }
+
+    Nothing on the C stack survives a suspension, so every variable
+    that must live across an await goes in a frame structure along
+    with the struct coroutine (see co_frame_alloc()). Two awaits may
+    not share a line, and a switch statement of its own must not
+    enclose one.
+*/
+struct coroutine
+{
+    // Where to resume: 0 to start, -1 once finished, otherwise a line.
+    int resume;
+};
+
+// What a coroutine returns each time it is called.
+#define CO_WAITING 0
+#define CO_DONE 1
+#define CO_ERROR -1
+
+#define CO_BEGIN(co) switch ((co)->resume) { case 0:
+
+#define CO_END(co) } (co)->resume = -1; return CO_DONE
+
+// Suspends until cond is true; cond is re-evaluated on every call.
+#define CO_AWAIT(co, cond)              \
+    do                                  \
+    {                                   \
+        (co)->resume = __LINE__;        \
+        __attribute__((fallthrough));   \
+        case __LINE__:                  \
+        if (!(cond))                    \
+        {                               \
+            return CO_WAITING;          \
+        }                               \
+    } while (0)
+
+// Finishes the coroutine early with CO_DONE or CO_ERROR.
+#define CO_EXIT(co, status)             \
+    do                                  \
+    {                                   \
+        (co)->resume = -1;              \
+        return (status);                \
+    } while (0)
+
+// Frames up to this size come from a per-thread free list.
+#define CO_FRAME_MAX 512
+
+void *co_frame_alloc(size_t size);
+void co_frame_free(void *frame, size_t size);
+
+#endif
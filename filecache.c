@@ -0,0 +1,658 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "compress.h"
+#include "filecache.h"
+#include "respcache.h"
+
+/*
+    Serving a file takes an open() and an fstat() before the first
+    byte can be sent. For the files that are asked for again and
+    again, each worker keeps them open: a hash table maps the path to
+    the descriptor and stat results, and an LRU list picks what to
+    close when the cache is full. A hit costs no system calls at all.
+
+    Keeping files open means noticing when they change. Every
+    directory that holds a cached file, and every one above it, is
+    watched with inotify, and any change to a name in it (written,
+    replaced, renamed, deleted, attributes changed) drops that name
+    from the cache, so the next request opens the file afresh. A
+    directory that is renamed or replaced drops everything. The cache is private to its
+    worker, so none of this needs a lock. The same events invalidate
+    the shared response cache (respcache.c), whose entries are read
+    through these files.
+*/
+
+#define FILECACHE_WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                              IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// A directory watched with inotify, by its path relative to the root.
+struct watched_dir
+{
+    struct watched_dir *next;
+    int wd;
+    size_t len;
+    char path[];
+};
+
+struct filecache
+{
+    // Must stay first: the inotify descriptor, watched by the reactor.
+    struct event_source source;
+
+    int root_fd;
+    const char *root;
+
+    int capacity;
+    int count;
+
+    struct file_entry *lru_head;
+    struct file_entry *lru_tail;
+    struct file_entry *buckets[FILECACHE_BUCKETS];
+
+    struct watched_dir *dirs;
+};
+
+static const struct
+{
+    const char *ext;
+    const char *type;
+} content_types[] = {
+    { "html", "text/html; charset=utf-8" },
+    { "htm", "text/html; charset=utf-8" },
+    { "css", "text/css" },
+    { "js", "text/javascript" },
+    { "json", "application/json" },
+    { "txt", "text/plain; charset=utf-8" },
+    { "xml", "application/xml" },
+    { "svg", "image/svg+xml" },
+    { "png", "image/png" },
+    { "jpg", "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "gif", "image/gif" },
+    { "webp", "image/webp" },
+    { "ico", "image/x-icon" },
+    { "wasm", "application/wasm" },
+    { "pdf", "application/pdf" },
+};
+
+/**
+ * @brief Guesses the Content-Type from the file name's extension.
+ *
+ * @param path NUL-terminated.
+ * @param len
+ * @return a string constant.
+ */
+const char *filecache_content_type(const char *path, size_t len)
+{
+    const char *dot = NULL;
+    size_t i;
+
+    for (i = len; i > 0 && path[i - 1] != '/'; i--)
+    {
+        if (path[i - 1] == '.')
+        {
+            dot = path + i;
+            break;
+        }
+    }
+    if (dot != NULL)
+    {
+        for (i = 0; i < sizeof(content_types) / sizeof(content_types[0]); i++)
+        {
+            if (strcasecmp(dot, content_types[i].ext) == 0)
+            {
+                return content_types[i].type;
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+static size_t filecache_hash(const char *path, size_t len)
+{
+    size_t h = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        h ^= (unsigned char) path[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static struct file_entry **filecache_bucket(struct filecache *cache, const char *path, size_t len)
+{
+    return &cache->buckets[filecache_hash(path, len) & (FILECACHE_BUCKETS - 1)];
+}
+
+static void filecache_lru_unlink(struct filecache *cache, struct file_entry *entry)
+{
+    if (entry->lru_prev != NULL)
+    {
+        entry->lru_prev->lru_next = entry->lru_next;
+    }
+    else
+    {
+        cache->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL)
+    {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    }
+    else
+    {
+        cache->lru_tail = entry->lru_prev;
+    }
+}
+
+static void filecache_lru_push(struct filecache *cache, struct file_entry *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head != NULL)
+    {
+        cache->lru_head->lru_prev = entry;
+    }
+    else
+    {
+        cache->lru_tail = entry;
+    }
+    cache->lru_head = entry;
+}
+
+/**
+ * @brief Takes another reference to an entry.
+ *
+ * @param entry
+ */
+void filecache_retain(struct file_entry *entry)
+{
+    entry->refs++;
+}
+
+/**
+ * @brief Drops a reference; the file is closed with the last one.
+ *
+ * Matches the release callback of output segments, so a response
+ * can hold its reference until the file has been sent.
+ *
+ * @param entry
+ */
+void filecache_release(void *entry)
+{
+    struct file_entry *e = entry;
+
+    if (--e->refs == 0)
+    {
+        close(e->fd);
+        free(e);
+    }
+}
+
+/**
+ * @brief Removes an entry from the cache, dropping the cache's reference.
+ *
+ * @param cache
+ * @param entry
+ */
+static void filecache_remove(struct filecache *cache, struct file_entry *entry)
+{
+    struct file_entry **p = filecache_bucket(cache, entry->path, entry->path_len);
+
+    while (*p != entry)
+    {
+        p = &(*p)->hash_next;
+    }
+    *p = entry->hash_next;
+    filecache_lru_unlink(cache, entry);
+    cache->count--;
+    filecache_release(entry);
+}
+
+static struct file_entry *filecache_find(struct filecache *cache, const char *path, size_t len)
+{
+    struct file_entry *entry;
+
+    for (entry = *filecache_bucket(cache, path, len); entry != NULL; entry = entry->hash_next)
+    {
+        if (entry->path_len == len && memcmp(entry->path, path, len) == 0)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void filecache_clear(struct filecache *cache)
+{
+    while (cache->lru_head != NULL)
+    {
+        filecache_remove(cache, cache->lru_head);
+    }
+    respcache_clear();
+}
+
+/**
+ * @brief Makes sure one directory is watched.
+ *
+ * @param cache
+ * @param path relative to the root, "" for the root itself.
+ * @param dir_len
+ * @return 0 on success, -1 if it cannot be watched.
+ */
+static int filecache_watch_dir(struct filecache *cache, const char *path, size_t dir_len)
+{
+    char full[PATH_MAX];
+    struct watched_dir *dir;
+    int wd;
+
+    for (dir = cache->dirs; dir != NULL; dir = dir->next)
+    {
+        if (dir->len == dir_len && memcmp(dir->path, path, dir_len) == 0)
+        {
+            return 0;
+        }
+    }
+
+    if (strlen(cache->root) + dir_len + 2 > sizeof(full))
+    {
+        return -1;
+    }
+    strcpy(full, cache->root);
+    if (dir_len > 0)
+    {
+        strcat(full, "/");
+        strncat(full, path, dir_len);
+    }
+
+    wd = inotify_add_watch(cache->source.fd, full, FILECACHE_WATCH_MASK);
+    if (wd < 0)
+    {
+        return -1;
+    }
+
+    dir = malloc(sizeof(*dir) + dir_len + 1);
+    if (dir == NULL)
+    {
+        inotify_rm_watch(cache->source.fd, wd);
+        return -1;
+    }
+    dir->wd = wd;
+    dir->len = dir_len;
+    memcpy(dir->path, path, dir_len);
+    dir->path[dir_len] = '\0';
+    dir->next = cache->dirs;
+    cache->dirs = dir;
+    return 0;
+}
+
+/**
+ * @brief Makes sure the directory holding path is watched, and every
+ * directory above it up to the root.
+ *
+ * The ancestors are watched because a directory being renamed or
+ * replaced (the usual way to deploy a new version of a subtree) is
+ * only reported to the directory that holds it, while everything
+ * below it moves away without an event of its own.
+ *
+ * @param cache
+ * @param path relative to the root.
+ * @param len
+ * @return 0 on success, -1 if it cannot be watched (the file must
+ * then not be cached).
+ */
+static int filecache_watch(struct filecache *cache, const char *path, size_t len)
+{
+    size_t i;
+
+    if (filecache_watch_dir(cache, path, 0) < 0)
+    {
+        return -1;
+    }
+    for (i = 0; i < len; i++)
+    {
+        if (path[i] == '/' && filecache_watch_dir(cache, path, i) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Stops watching every directory, after the tree has changed
+ * shape: the paths the watches were set up for may now lead
+ * somewhere else, and are watched afresh as files are opened again.
+ *
+ * @param cache
+ */
+static void filecache_unwatch_all(struct filecache *cache)
+{
+    struct watched_dir *dir;
+
+    while (cache->dirs != NULL)
+    {
+        dir = cache->dirs;
+        cache->dirs = dir->next;
+        inotify_rm_watch(cache->source.fd, dir->wd);
+        free(dir);
+    }
+}
+
+/**
+ * @brief Handles one inotify event: drops the file it names.
+ *
+ * @param cache
+ * @param ev
+ */
+static void filecache_on_change(struct filecache *cache, const struct inotify_event *ev)
+{
+    struct watched_dir **p;
+    struct watched_dir *dir;
+    struct file_entry *entry;
+    char path[FILECACHE_PATH_MAX];
+    size_t base_len;
+    size_t len;
+
+    if (ev->mask & IN_Q_OVERFLOW)
+    {
+        // Events were lost, so anything may have changed.
+        filecache_clear(cache);
+        return;
+    }
+
+    for (p = &cache->dirs; *p != NULL && (*p)->wd != ev->wd; p = &(*p)->next)
+    {
+    }
+    dir = *p;
+    if (dir == NULL)
+    {
+        return;
+    }
+
+    if (ev->mask & IN_IGNORED)
+    {
+        // The watch is gone, and with it any word of changes below.
+        *p = dir->next;
+        free(dir);
+        filecache_clear(cache);
+        return;
+    }
+    if ((ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) ||
+        ((ev->mask & IN_ISDIR) && (ev->mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))))
+    {
+        /*
+            A directory went away, moved or was replaced, taking the
+            paths of everything below it along. This is rare enough
+            that starting over is simplest.
+        */
+        filecache_unwatch_all(cache);
+        filecache_clear(cache);
+        return;
+    }
+
+    if (ev->len == 0)
+    {
+        return;
+    }
+    len = dir->len > 0 ? dir->len + 1 : 0;
+    if (len + strlen(ev->name) >= sizeof(path))
+    {
+        return;
+    }
+    memcpy(path, dir->path, dir->len);
+    if (dir->len > 0)
+    {
+        path[dir->len] = '/';
+    }
+    strcpy(path + len, ev->name);
+    len += strlen(ev->name);
+
+    respcache_invalidate(path, len);
+
+    // A precompressed sibling's responses are cached under the path of the file it stands for.
+    base_len = compress_sibling_of(path, len);
+    if (base_len > 0)
+    {
+        respcache_invalidate(path, base_len);
+    }
+    entry = filecache_find(cache, path, len);
+    if (entry != NULL)
+    {
+        filecache_remove(cache, entry);
+    }
+}
+
+/**
+ * @brief Called by the reactor when inotify has events for us.
+ *
+ * @param reactor
+ * @param source
+ * @param events
+ */
+static void filecache_on_event(struct reactor *reactor, struct event_source *source, uint32_t events)
+{
+    struct filecache *cache = (struct filecache *) source;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t n;
+    char *p;
+
+    (void) reactor;
+    (void) events;
+
+    for (;;)
+    {
+        n = read(source->fd, buf, sizeof(buf));
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+        for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len)
+        {
+            ev = (const struct inotify_event *) p;
+            filecache_on_change(cache, ev);
+        }
+    }
+}
+
+/**
+ * @brief Turns a request target into a path relative to the root.
+ *
+ * The query string is dropped, %XX escapes are decoded and a
+ * trailing slash means index.html. Targets that could escape the
+ * root ("..") or are otherwise unsuitable are refused.
+ *
+ * @param target
+ * @param len
+ * @param path receives the result, NUL-terminated; room for
+ * FILECACHE_PATH_MAX bytes.
+ * @return the length of the path, or -1 if the target is refused.
+ */
+ssize_t filecache_path(const char *target, size_t len, char *path)
+{
+    size_t i, n = 0;
+    int hi, lo;
+
+    if (len == 0 || target[0] != '/')
+    {
+        return -1;
+    }
+
+    for (i = 1; i < len && target[i] != '?' && target[i] != '#'; i++)
+    {
+        char c = target[i];
+
+        if (c == '%')
+        {
+            if (i + 2 >= len)
+            {
+                return -1;
+            }
+            hi = target[i + 1];
+            lo = target[i + 2];
+            hi = hi >= '0' && hi <= '9' ? hi - '0' : (hi | 0x20) >= 'a' && (hi | 0x20) <= 'f' ? (hi | 0x20) - 'a' + 10 : -1;
+            lo = lo >= '0' && lo <= '9' ? lo - '0' : (lo | 0x20) >= 'a' && (lo | 0x20) <= 'f' ? (lo | 0x20) - 'a' + 10 : -1;
+            if (hi < 0 || lo < 0)
+            {
+                return -1;
+            }
+            c = (char) (hi << 4 | lo);
+            i += 2;
+        }
+        if (c == '\0' || n + 1 >= FILECACHE_PATH_MAX - sizeof("index.html"))
+        {
+            return -1;
+        }
+
+        // Refuse ".." as a path segment, and collapse repeated slashes.
+        if (c == '/' && (n == 0 || path[n - 1] == '/'))
+        {
+            continue;
+        }
+        path[n++] = c;
+        if (c == '/' && n >= 3 && path[n - 2] == '.' && path[n - 3] == '.' && (n == 3 || path[n - 4] == '/'))
+        {
+            return -1;
+        }
+    }
+    if (n >= 2 && path[n - 1] == '.' && path[n - 2] == '.' && (n == 2 || path[n - 3] == '/'))
+    {
+        return -1;
+    }
+
+    if (n == 0 || path[n - 1] == '/')
+    {
+        strcpy(path + n, "index.html");
+        n += strlen("index.html");
+    }
+    path[n] = '\0';
+    return n;
+}
+
+/**
+ * @brief Creates a worker's cache and registers its inotify
+ * descriptor with the worker's reactor.
+ *
+ * @param reactor
+ * @param root the document root.
+ * @param capacity the most files kept open.
+ * @return the cache, or NULL on failure with errno set.
+ */
+struct filecache *filecache_create(struct reactor *reactor, const char *root, int capacity)
+{
+    struct filecache *cache;
+
+    cache = calloc(1, sizeof(*cache));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    cache->root = root;
+    cache->capacity = capacity;
+
+    cache->root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cache->root_fd < 0)
+    {
+        free(cache);
+        return NULL;
+    }
+
+    cache->source.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    cache->source.on_event = filecache_on_event;
+    if (cache->source.fd < 0 || reactor_add(reactor, &cache->source, EPOLLIN) < 0)
+    {
+        if (cache->source.fd >= 0)
+        {
+            close(cache->source.fd);
+        }
+        close(cache->root_fd);
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+/**
+ * @brief Opens a file under the root, from the cache if possible.
+ *
+ * @param cache
+ * @param path as returned by filecache_path().
+ * @param path_len
+ * @return a reference to the file, to be dropped with
+ * filecache_release(), or NULL if there is no such regular file
+ * under the root (or it cannot be opened).
+ */
+struct file_entry *filecache_open(struct filecache *cache, const char *path, size_t path_len)
+{
+    struct file_entry *entry;
+    struct file_entry **bucket;
+    struct stat st;
+    int fd;
+
+    entry = filecache_find(cache, path, path_len);
+    if (entry != NULL)
+    {
+        filecache_lru_unlink(cache, entry);
+        filecache_lru_push(cache, entry);
+        entry->refs++;
+        return entry;
+    }
+
+    fd = openat(cache->root_fd, path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    entry = malloc(sizeof(*entry) + path_len + 1);
+    if (entry == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    entry->fd = fd;
+    entry->size = st.st_size;
+    entry->content_type = filecache_content_type(path, path_len);
+    entry->refs = 1;
+    entry->watched = 0;
+    entry->path_len = path_len;
+    memcpy(entry->path, path, path_len + 1);
+
+    // A file whose changes we would not hear about is served but not kept.
+    if (cache->capacity == 0 || filecache_watch(cache, path, path_len) < 0)
+    {
+        return entry;
+    }
+
+    entry->watched = 1;
+    bucket = filecache_bucket(cache, path, path_len);
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    filecache_lru_push(cache, entry);
+    entry->refs++;
+    cache->count++;
+
+    if (cache->count > cache->capacity)
+    {
+        filecache_remove(cache, cache->lru_tail);
+    }
+    return entry;
+}
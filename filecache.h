@@ -0,0 +1,58 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "reactor.h"
+
+// Hash buckets per cache. Must be a power of two.
+#define FILECACHE_BUCKETS 4096
+
+// The longest path, relative to the root, that is looked up.
+#define FILECACHE_PATH_MAX 1024
+
+/*
+    An open file in the cache, with what stat() said about it. It
+    stays valid, and its descriptor open, for as long as anyone holds
+    a reference, even if it has meanwhile been evicted or the file
+    has changed on disk.
+*/
+struct file_entry
+{
+    // Chains entries in the same hash bucket.
+    struct file_entry *hash_next;
+
+    // The least recently used entry is at the tail.
+    struct file_entry *lru_prev;
+    struct file_entry *lru_next;
+
+    int fd;
+    size_t size;
+    const char *content_type;
+
+    // References held by queued responses, plus one while cached.
+    int refs;
+
+    /*
+        Whether a change to the file would be noticed. Only then may
+        anything built from it (a cached response) outlive the
+        request.
+    */
+    int watched;
+
+    // The path relative to the document root, as looked up.
+    size_t path_len;
+    char path[];
+};
+
+struct filecache;
+
+struct filecache *filecache_create(struct reactor *reactor, const char *root, int capacity);
+ssize_t filecache_path(const char *target, size_t len, char *path);
+const char *filecache_content_type(const char *path, size_t len);
+struct file_entry *filecache_open(struct filecache *cache, const char *path, size_t len);
+void filecache_retain(struct file_entry *entry);
+void filecache_release(void *entry);
+
+#endif
@@ -0,0 +1,185 @@
+#include <string.h>
+
+#include "framing.h"
+#include "http.h"
+
+// Where framer_next() puts the request in HTTP mode.
+static __thread struct http_request request;
+
+/**
+ * @brief Prepares a parser for a new connection.
+ *
+ * @param framer
+ * @param mode FRAMING_LINE, FRAMING_LENGTH or FRAMING_HTTP.
+ * @param max_frame the largest message accepted, excluding framing.
+ */
+void framer_init(struct framer *framer, int mode, size_t max_frame)
+{
+    framer->mode = mode;
+    framer->max_frame = max_frame;
+    framer->scanned = 0;
+}
+
+/**
+ * @brief Looks for the next complete message at the start of buf.
+ *
+ * Nothing is copied: the frame points into buf. Once the caller is
+ * done with the frame it drops the returned number of bytes from
+ * the front of its buffer and calls again, so several pipelined
+ * messages that arrived in one read are returned one after the
+ * other, and a message split across reads is returned once its last
+ * piece has been appended.
+ *
+ * @param framer
+ * @param buf the unconsumed input.
+ * @param len
+ * @param frame filled in when a message is found.
+ * @return the number of bytes the message occupies including its
+ * framing, 0 if more input is needed, or -1 if the input is not a
+ * valid message (too large, or a malformed HTTP request).
+ */
+ssize_t framer_next(struct framer *framer, const char *buf, size_t len, struct frame *frame)
+{
+    const char *newline;
+    size_t payload;
+    ssize_t consumed;
+
+    frame->request = NULL;
+    if (framer->mode == FRAMING_HTTP)
+    {
+        consumed = http_parse(buf, len, &framer->scanned, framer->max_frame, &request);
+        if (consumed <= 0)
+        {
+            return consumed;
+        }
+
+        frame->request = &request;
+        if (request.body.len > 0)
+        {
+            frame->data = request.body.data;
+            frame->len = request.body.len;
+        }
+        else
+        {
+            frame->data = request.target.data;
+            frame->len = request.target.len;
+        }
+        return consumed;
+    }
+
+    if (framer->mode == FRAMING_LENGTH)
+    {
+        if (len < FRAMING_HEADER_LEN)
+        {
+            return 0;
+        }
+
+        payload = ((size_t) (unsigned char) buf[0] << 24) |
+                  ((size_t) (unsigned char) buf[1] << 16) |
+                  ((size_t) (unsigned char) buf[2] << 8) |
+                  (size_t) (unsigned char) buf[3];
+        if (payload > framer->max_frame)
+        {
+            return -1;
+        }
+        if (len - FRAMING_HEADER_LEN < payload)
+        {
+            return 0;
+        }
+
+        frame->data = buf + FRAMING_HEADER_LEN;
+        frame->len = payload;
+        return (ssize_t) (FRAMING_HEADER_LEN + payload);
+    }
+
+    // Only the bytes appended since the last call need searching.
+    newline = memchr(buf + framer->scanned, '\n', len - framer->scanned);
+    if (newline == NULL)
+    {
+        framer->scanned = len;
+        if (len > framer->max_frame)
+        {
+            return -1;
+        }
+        return 0;
+    }
+
+    framer->scanned = 0;
+    frame->data = buf;
+    frame->len = newline - buf;
+    if (frame->len > 0 && frame->data[frame->len - 1] == '\r')
+    {
+        frame->len--;
+    }
+    if (frame->len > framer->max_frame)
+    {
+        return -1;
+    }
+    return (newline - buf) + 1;
+}
+
+/**
+ * @brief Queues a reply framed for the given mode.
+ *
+ * Small replies are copied, framing included, into the output's
+ * current pool block, so a run of pipelined replies ends up as one
+ * contiguous stretch of memory and goes out as a single iovec.
+ * Larger payloads are queued by reference instead and must stay
+ * valid until they have been written; only the framing is copied.
+ *
+ * @param mode
+ * @param out
+ * @param payload
+ * @param len
+ * @return 0 on success, -1 if memory is exhausted.
+ */
+int framing_encode(int mode, struct output *out, const char *payload, size_t len)
+{
+    size_t header_len = mode == FRAMING_LENGTH ? FRAMING_HEADER_LEN : 0;
+    size_t trailer_len = mode == FRAMING_LINE ? 1 : 0;
+    size_t copy = header_len + (len <= FRAMING_COPY_MAX ? len + trailer_len : 0);
+    unsigned char *p = NULL;
+
+    if (mode == FRAMING_HTTP)
+    {
+        return http_respond(out, 200, payload, len, 1);
+    }
+
+    if (copy > 0)
+    {
+        p = (unsigned char *) output_reserve(out, copy);
+        if (p == NULL)
+        {
+            return -1;
+        }
+    }
+
+    if (mode == FRAMING_LENGTH)
+    {
+        p[0] = (unsigned char) (len >> 24);
+        p[1] = (unsigned char) (len >> 16);
+        p[2] = (unsigned char) (len >> 8);
+        p[3] = (unsigned char) len;
+    }
+
+    if (len <= FRAMING_COPY_MAX)
+    {
+        memcpy(p + header_len, payload, len);
+        if (trailer_len)
+        {
+            p[header_len + len] = '\n';
+        }
+        output_commit(out, copy);
+        return 0;
+    }
+
+    if (header_len)
+    {
+        output_commit(out, header_len);
+    }
+    if (output_append_ref(out, payload, len, NULL, NULL) < 0)
+    {
+        return -1;
+    }
+    return trailer_len ? output_append_ref(out, "\n", 1, NULL, NULL) : 0;
+}
@@ -0,0 +1,68 @@
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "output.h"
+
+/*
+    How messages are delimited on the wire.
+
+    FRAMING_LINE:   text messages, each terminated by '\n' (an optional
+                    '\r' before it is stripped).
+    FRAMING_LENGTH: binary messages, each preceded by its length as a
+                    4-byte unsigned integer in network byte order.
+    FRAMING_HTTP:   HTTP/1.1 requests (see http.c). The message is the
+                    request body, or the target if there is no body.
+
+    Replies are framed the same way as requests; in HTTP mode that
+    means a 200 response with the reply as its body.
+*/
+#define FRAMING_LINE 0
+#define FRAMING_LENGTH 1
+#define FRAMING_HTTP 2
+
+// Size of the length prefix in FRAMING_LENGTH mode.
+#define FRAMING_HEADER_LEN 4
+
+// Replies up to this size are copied rather than referenced.
+#define FRAMING_COPY_MAX 256
+
+struct http_request;
+
+/*
+    A complete message found by the parser. It points into the
+    caller's buffer, so it is only valid until that buffer changes.
+*/
+struct frame
+{
+    const char *data;
+    size_t len;
+
+    /*
+        In HTTP mode, the whole request. It lives in per-thread
+        storage that the next framer_next() call on the same thread
+        overwrites.
+    */
+    const struct http_request *request;
+};
+
+/*
+    Parser state carried between reads on one connection. In line
+    and HTTP mode it remembers how far the buffer has already been
+    searched for the end of the message (or header block), so a long
+    message arriving in small pieces is scanned only once.
+*/
+struct framer
+{
+    int mode;
+    size_t max_frame;
+    size_t scanned;
+};
+
+void framer_init(struct framer *framer, int mode, size_t max_frame);
+ssize_t framer_next(struct framer *framer, const char *buf, size_t len, struct frame *frame);
+int framing_encode(int mode, struct output *out, const char *payload, size_t len);
+
+#endif
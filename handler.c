@@ -0,0 +1,198 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "handler.h"
+#include "http.h"
+#include "router.h"
+
+#define HANDLER_ACK_REPLY "I got your message"
+
+/*
+    The HTTP routes with a handler of their own. A route's message is
+    what its capture matched, or else the request body. Requests that
+    match none are handled as before: a file under --root for GET and
+    HEAD, otherwise the --handler on the body or target.
+
+    The table is fixed at compile time; handler_init() builds the
+    router from it before any worker starts, and it is only read
+    after that.
+*/
+static const struct
+{
+    const char *method;
+    const char *pattern;
+    int handler;
+} handler_routes[] = {
+    { "GET", "/ack", HANDLER_ACK },
+    { "POST", "/ack", HANDLER_ACK },
+    { "GET", "/ack/:message", HANDLER_ACK },
+    { "GET", "/hash", HANDLER_HASH },
+    { "POST", "/hash", HANDLER_HASH },
+    { "GET", "/hash/:message", HANDLER_HASH },
+};
+
+static struct router router;
+
+/**
+ * @brief Computes the digest returned by HANDLER_HASH: FNV-1a over
+ * the message, fed back into itself HANDLER_HASH_ROUNDS times.
+ *
+ * @param msg
+ * @param len
+ * @return the digest.
+ */
+static uint64_t handler_hash(const char *msg, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+    int round;
+
+    for (round = 0; round < HANDLER_HASH_ROUNDS; round++)
+    {
+        for (i = 0; i < len; i++)
+        {
+            h ^= (unsigned char) msg[i];
+            h *= 1099511628211ULL;
+        }
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+/**
+ * @brief Builds the router from the route table.
+ *
+ * @return 0 on success, -1 if a route is invalid or memory is exhausted.
+ */
+int handler_init(void)
+{
+    size_t i;
+
+    router_init(&router);
+    for (i = 0; i < sizeof(handler_routes) / sizeof(handler_routes[0]); i++)
+    {
+        if (router_add(&router, handler_routes[i].method, handler_routes[i].pattern,
+                       handler_routes[i].handler) < 0)
+        {
+            return -1;
+        }
+    }
+    return router_build(&router);
+}
+
+static int handler_hex(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    c |= 0x20;
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+/**
+ * @brief Undoes the percent-encoding of a captured path segment.
+ *
+ * @param scratch where the decoded copy goes, if one is needed.
+ * @param frame points at the segment, and is pointed at the result.
+ * @return 0 on success, -1 if memory is exhausted.
+ */
+static int handler_decode(struct arena *scratch, struct frame *frame)
+{
+    const char *s = frame->data;
+    size_t len = frame->len;
+    char *decoded;
+    size_t i, n = 0;
+    int hi, lo;
+
+    if (memchr(s, '%', len) == NULL)
+    {
+        return 0;
+    }
+    decoded = arena_alloc(scratch, len);
+    if (decoded == NULL)
+    {
+        return -1;
+    }
+    for (i = 0; i < len; i++)
+    {
+        // A '%' not followed by two hex digits is kept as it is.
+        if (s[i] == '%' && i + 2 < len &&
+            (hi = handler_hex(s[i + 1])) >= 0 && (lo = handler_hex(s[i + 2])) >= 0)
+        {
+            decoded[n++] = (char) (hi << 4 | lo);
+            i += 2;
+        }
+        else
+        {
+            decoded[n++] = s[i];
+        }
+    }
+    frame->data = decoded;
+    frame->len = n;
+    return 0;
+}
+
+/**
+ * @brief Finds the handler for an HTTP request.
+ *
+ * @param frame the request; if a route captured part of its path,
+ * the message is changed to that.
+ * @param scratch the request's arena, for a decoded copy of the
+ * capture.
+ * @return the HANDLER_* of the matching route, -1 if none matches (or
+ * the frame is not an HTTP request), or -2 if memory is exhausted.
+ */
+int handler_route(struct frame *frame, struct arena *scratch)
+{
+    const struct http_request *req = frame->request;
+    struct route_match match;
+    const char *query;
+    size_t len;
+    int handler;
+
+    if (req == NULL)
+    {
+        return -1;
+    }
+    query = memchr(req->target.data, '?', req->target.len);
+    len = query != NULL ? (size_t) (query - req->target.data) : req->target.len;
+    handler = router_match(&router, req->method.data, req->method.len, req->target.data, len, &match);
+    if (handler < 0)
+    {
+        return -1;
+    }
+    if (match.nparams == 0)
+    {
+        frame->data = req->body.data;
+        frame->len = req->body.len;
+        return handler;
+    }
+    frame->data = match.params[0].value;
+    frame->len = match.params[0].len;
+    return handler_decode(scratch, frame) < 0 ? -2 : handler;
+}
+
+/**
+ * @brief Produces the reply to one message.
+ *
+ * Handlers only read the message and write the reply, so they can
+ * run on any thread.
+ *
+ * @param handler HANDLER_ACK or HANDLER_HASH.
+ * @param msg
+ * @param len
+ * @param reply at least HANDLER_REPLY_MAX bytes.
+ * @return the length of the reply.
+ */
+size_t handler_run(int handler, const char *msg, size_t len, char *reply)
+{
+    if (handler == HANDLER_HASH)
+    {
+        return snprintf(reply, HANDLER_REPLY_MAX, "%016llx", (unsigned long long) handler_hash(msg, len));
+    }
+
+    memcpy(reply, HANDLER_ACK_REPLY, sizeof(HANDLER_ACK_REPLY) - 1);
+    return sizeof(HANDLER_ACK_REPLY) - 1;
+}
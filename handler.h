@@ -0,0 +1,29 @@
+#ifndef HANDLER_H
+#define HANDLER_H
+
+#include <stddef.h>
+
+#include "arena.h"
+#include "framing.h"
+
+/*
+    What the server does with a message.
+
+    HANDLER_ACK:  acknowledges it with "I got your message".
+    HANDLER_HASH: replies with a digest of the message, computed with
+                  HANDLER_HASH_ROUNDS rounds of hashing; stands in for
+                  a handler that does real computation.
+*/
+#define HANDLER_ACK 0
+#define HANDLER_HASH 1
+
+#define HANDLER_HASH_ROUNDS 20000
+
+// The largest reply a handler produces; such replies are always copied.
+#define HANDLER_REPLY_MAX FRAMING_COPY_MAX
+
+int handler_init(void);
+int handler_route(struct frame *frame, struct arena *scratch);
+size_t handler_run(int handler, const char *msg, size_t len, char *reply);
+
+#endif
@@ -0,0 +1,160 @@
+#include <stdlib.h>
+
+#include "histogram.h"
+
+/**
+ * @brief Maps a value to the index of the bucket that counts it.
+ *
+ * @param value
+ */
+static int bucket_of(uint64_t value)
+{
+    int msb, shift;
+
+    if (value < HISTOGRAM_SUB)
+    {
+        return (int) value;
+    }
+    if (value > HISTOGRAM_MAX)
+    {
+        value = HISTOGRAM_MAX;
+    }
+
+    /*
+        Keep the top HISTOGRAM_SUB_BITS bits of the value: shift is
+        how many low bits are dropped, which grows by one with every
+        doubling of the value.
+    */
+    msb = 63 - __builtin_clzll(value);
+    shift = msb - (HISTOGRAM_SUB_BITS - 1);
+    return HISTOGRAM_SUB + (shift - 1) * (HISTOGRAM_SUB / 2) +
+           (int) ((value >> shift) - HISTOGRAM_SUB / 2);
+}
+
+/**
+ * @brief The largest value counted by a bucket.
+ *
+ * Reporting the top of the bucket means percentiles are never
+ * understated.
+ *
+ * @param index
+ */
+uint64_t histogram_bucket_value(int index)
+{
+    int shift;
+    uint64_t sub;
+
+    if (index < HISTOGRAM_SUB)
+    {
+        return (uint64_t) index;
+    }
+
+    shift = (index - HISTOGRAM_SUB) / (HISTOGRAM_SUB / 2) + 1;
+    sub = (uint64_t) ((index - HISTOGRAM_SUB) % (HISTOGRAM_SUB / 2) + HISTOGRAM_SUB / 2);
+    return ((sub + 1) << shift) - 1;
+}
+
+/**
+ * @brief Allocates an empty histogram.
+ *
+ * @return the histogram, or NULL if memory is exhausted.
+ */
+struct histogram *histogram_create(void)
+{
+    return calloc(1, sizeof(struct histogram));
+}
+
+void histogram_destroy(struct histogram *h)
+{
+    free(h);
+}
+
+/**
+ * @brief Counts one value.
+ *
+ * Only the owning thread writes, so the updates are plain
+ * read-modify-writes published with relaxed atomic stores; readers on
+ * other threads never see a torn counter.
+ *
+ * @param h
+ * @param value
+ */
+void histogram_record(struct histogram *h, uint64_t value)
+{
+    int i = bucket_of(value);
+
+    __atomic_store_n(&h->counts[i], h->counts[i] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + value, __ATOMIC_RELAXED);
+    if (value > h->max)
+    {
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Adds the counts of src to dst.
+ *
+ * src may be being recorded into concurrently; dst must be private
+ * to the caller.
+ *
+ * @param dst
+ * @param src
+ */
+void histogram_merge(struct histogram *dst, const struct histogram *src)
+{
+    uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    uint64_t c;
+    int i;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        c = __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+        dst->counts[i] += c;
+        dst->count += c;
+    }
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    if (max > dst->max)
+    {
+        dst->max = max;
+    }
+}
+
+/**
+ * @brief The value below which the given percentage of values fall.
+ *
+ * @param h
+ * @param percentile between 0 and 100.
+ * @return the value, or 0 if nothing has been recorded.
+ */
+uint64_t histogram_percentile(const struct histogram *h, double percentile)
+{
+    uint64_t total = 0, seen = 0, target, value;
+    int i;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        total += h->counts[i];
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+
+    target = (uint64_t) (percentile / 100.0 * total + 0.5);
+    if (target < 1)
+    {
+        target = 1;
+    }
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += h->counts[i];
+        if (seen >= target)
+        {
+            value = histogram_bucket_value(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,41 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+    A log-linear ("HDR") histogram of non-negative integer values,
+    typically latencies in nanoseconds.
+
+    Values below HISTOGRAM_SUB are counted exactly. Above that, every
+    power-of-two range is split into HISTOGRAM_SUB / 2 equal buckets,
+    so any recorded value is reported within 1/512 (about 0.2%) of
+    its true value, whatever its magnitude. Values above
+    HISTOGRAM_MAX are counted as HISTOGRAM_MAX.
+
+    Recording is a single increment with no locks. A histogram must
+    only be recorded into by one thread, but other threads may read
+    or merge it at any time and will see a consistent-enough view.
+*/
+#define HISTOGRAM_SUB_BITS 10
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_MAX ((1ULL << HISTOGRAM_MAX_BITS) - 1)
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB + (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS) * (HISTOGRAM_SUB / 2))
+
+struct histogram
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t counts[HISTOGRAM_BUCKETS];
+};
+
+struct histogram *histogram_create(void);
+void histogram_destroy(struct histogram *h);
+void histogram_record(struct histogram *h, uint64_t value);
+void histogram_merge(struct histogram *dst, const struct histogram *src);
+uint64_t histogram_percentile(const struct histogram *h, double percentile);
+uint64_t histogram_bucket_value(int index);
+
+#endif
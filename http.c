@@ -0,0 +1,756 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_X86 1
+#endif
+
+#include "framing.h"
+#include "http.h"
+
+/*
+    An incremental, zero-copy HTTP/1.1 request parser.
+
+    Requests usually arrive in one piece, but may be split anywhere.
+    Until the empty line that ends the header block has arrived the
+    only work done is looking for it, and a later call carries on
+    from where the previous one stopped. Once the header block is
+    complete it is parsed in one pass, and every part of the request
+    is returned as a pointer and length into the caller's buffer.
+
+    Almost all of the time goes into finding delimiters: line feeds,
+    spaces and colons. Where the CPU supports it they are searched
+    for 32 bytes at a time with AVX2 (line feeds) or 16 bytes at a
+    time with SSE4.2 (any of a small set of characters); otherwise a
+    plain loop is used. http_init() picks the implementation once,
+    from what the CPU reports at run time, so one binary runs
+    everywhere.
+*/
+
+/**
+ * @brief Finds the first line feed in [p, end).
+ */
+static const char *http_scan_lf_scalar(const char *p, const char *end)
+{
+    return memchr(p, '\n', end - p);
+}
+
+/**
+ * @brief Finds the first byte in [p, end) that is one of the nset
+ * characters of set.
+ */
+static const char *http_scan_set_scalar(const char *p, const char *end, const char *set, int nset)
+{
+    for (; p < end; p++)
+    {
+        if (memchr(set, *p, nset) != NULL)
+        {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+#ifdef HTTP_X86
+/*
+    Both vector versions only load whole blocks that lie inside the
+    buffer, and leave the last few bytes to the scalar version, so
+    they never read past the end of the data.
+*/
+__attribute__((target("avx2")))
+static const char *http_scan_lf_avx2(const char *p, const char *end)
+{
+    const __m256i lf = _mm256_set1_epi8('\n');
+    unsigned int mask;
+
+    while (end - p >= 32)
+    {
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) p), lf));
+        if (mask != 0)
+        {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return http_scan_lf_scalar(p, end);
+}
+
+/*
+    PCMPESTRI compares each of 16 input bytes against every
+    character of the set at once and returns the index of the first
+    match, or 16 if there is none. set must be readable for 16 bytes.
+*/
+__attribute__((target("sse4.2")))
+static const char *http_scan_set_sse42(const char *p, const char *end, const char *set, int nset)
+{
+    const __m128i chars = _mm_loadu_si128((const __m128i *) set);
+    int i;
+
+    while (end - p >= 16)
+    {
+        i = _mm_cmpestri(chars, nset, _mm_loadu_si128((const __m128i *) p), 16,
+                         _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if (i < 16)
+        {
+            return p + i;
+        }
+        p += 16;
+    }
+    return http_scan_set_scalar(p, end, set, nset);
+}
+#endif
+
+static const char *(*http_scan_lf)(const char *p, const char *end) = http_scan_lf_scalar;
+static const char *(*http_scan_set)(const char *p, const char *end, const char *set, int nset) = http_scan_set_scalar;
+
+// Delimiter sets, padded to 16 bytes for PCMPESTRI.
+static const char http_space[16] = " ";
+static const char http_colon[16] = ":";
+
+/**
+ * @brief Picks the fastest scanners the CPU supports. Call once
+ * before any thread starts parsing; without it the scalar versions
+ * are used.
+ */
+void http_init(void)
+{
+#ifdef HTTP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        http_scan_lf = http_scan_lf_avx2;
+    }
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        http_scan_set = http_scan_set_sse42;
+    }
+#endif
+}
+
+/**
+ * @brief Whether s is the given name, ignoring case.
+ */
+static int http_is(const struct http_string *s, const char *name)
+{
+    return s->len == strlen(name) && strncasecmp(s->data, name, s->len) == 0;
+}
+
+/**
+ * @brief Whether a comma-separated header value contains the given
+ * token, ignoring case (e.g. "close" in "Connection: close").
+ */
+static int http_has_token(const struct http_string *value, const char *token)
+{
+    const char *p = value->data;
+    const char *end = value->data + value->len;
+    struct http_string item;
+
+    while (p < end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+        {
+            p++;
+        }
+        item.data = p;
+        while (p < end && *p != ',')
+        {
+            p++;
+        }
+        item.len = p - item.data;
+        while (item.len > 0 && (item.data[item.len - 1] == ' ' || item.data[item.len - 1] == '\t'))
+        {
+            item.len--;
+        }
+        if (http_is(&item, token))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns the end of the line starting at line, without its
+ * CR, and sets *next to the start of the following line.
+ */
+static const char *http_line_end(const char *line, const char *end, const char **next)
+{
+    const char *lf = http_scan_lf(line, end);
+
+    *next = lf + 1;
+    if (lf > line && lf[-1] == '\r')
+    {
+        lf--;
+    }
+    return lf;
+}
+
+/**
+ * @brief Parses the request line: method, target and version.
+ *
+ * @return 0 on success, -1 if it is malformed.
+ */
+static int http_parse_request_line(const char *line, const char *line_end, struct http_request *req)
+{
+    const char *sp;
+
+    sp = http_scan_set(line, line_end, http_space, 1);
+    if (sp == NULL || sp == line)
+    {
+        return -1;
+    }
+    req->method.data = line;
+    req->method.len = sp - line;
+
+    line = sp + 1;
+    sp = http_scan_set(line, line_end, http_space, 1);
+    if (sp == NULL || sp == line)
+    {
+        return -1;
+    }
+    req->target.data = line;
+    req->target.len = sp - line;
+
+    line = sp + 1;
+    if (line_end - line != 8 || memcmp(line, "HTTP/1.", 7) != 0 || (line[7] != '0' && line[7] != '1'))
+    {
+        return -1;
+    }
+    req->minor_version = line[7] - '0';
+    return 0;
+}
+
+/**
+ * @brief Parses one header line into headers[*nheaders].
+ *
+ * @return 0 on success, -1 if it is malformed or there are too many.
+ */
+static int http_parse_header(const char *line, const char *line_end,
+                             struct http_header *headers, int *nheaders)
+{
+    struct http_header *h;
+    const char *colon;
+    const char *v;
+
+    // Obsolete line folding is not supported.
+    if (*line == ' ' || *line == '\t' || *nheaders == HTTP_MAX_HEADERS)
+    {
+        return -1;
+    }
+
+    colon = http_scan_set(line, line_end, http_colon, 1);
+    if (colon == NULL || colon == line || colon[-1] == ' ' || colon[-1] == '\t')
+    {
+        return -1;
+    }
+
+    h = &headers[(*nheaders)++];
+    h->name.data = line;
+    h->name.len = colon - line;
+
+    v = colon + 1;
+    while (v < line_end && (*v == ' ' || *v == '\t'))
+    {
+        v++;
+    }
+    while (line_end > v && (line_end[-1] == ' ' || line_end[-1] == '\t'))
+    {
+        line_end--;
+    }
+    h->value.data = v;
+    h->value.len = line_end - v;
+    return 0;
+}
+
+/**
+ * @brief Finds the empty line that ends the header block.
+ *
+ * @param buf
+ * @param len
+ * @param scanned how far buf has already been searched; updated.
+ * @param start where the message starts, after any empty lines.
+ * @return the line feed of the empty line, or NULL if it has not
+ * arrived yet.
+ */
+static const char *http_find_head_end(const char *buf, size_t len, size_t *scanned, const char *start)
+{
+    const char *end = buf + len;
+    const char *p = buf + *scanned > start ? buf + *scanned : start;
+    const char *lf;
+
+    for (;;)
+    {
+        lf = http_scan_lf(p, end);
+        if (lf == NULL)
+        {
+            *scanned = len;
+            return NULL;
+        }
+        if (lf > start && (lf[-1] == '\n' || (lf[-1] == '\r' && lf - 1 > start && lf[-2] == '\n')))
+        {
+            return lf;
+        }
+        p = lf + 1;
+    }
+}
+
+/**
+ * @brief Parses the header lines between line and lf.
+ *
+ * @return 0 on success, -1 if one is malformed or there are too many.
+ */
+static int http_parse_headers(const char *line, const char *lf, const char *end,
+                              struct http_header *headers, int *nheaders)
+{
+    const char *line_end;
+    const char *next;
+
+    for (; line < lf; line = next)
+    {
+        line_end = http_line_end(line, end, &next);
+        if (line_end == line)
+        {
+            break;
+        }
+        if (http_parse_header(line, line_end, headers, nheaders) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+    What the header fields say about the body and the connection.
+    Only these are interpreted here; the rest are left to whoever
+    handles the message.
+*/
+struct http_framing
+{
+    size_t content_length;
+    int have_length;
+    int chunked;
+    int keep_alive;
+};
+
+/**
+ * @brief Reads the framing out of a message's header fields.
+ *
+ * @return 0 on success, -1 if they contradict each other or a length
+ * is malformed.
+ */
+static int http_parse_framing(const struct http_header *headers, int nheaders, int minor_version,
+                              struct http_framing *f)
+{
+    const struct http_string *value;
+    size_t n;
+    size_t i;
+    int h;
+
+    memset(f, 0, sizeof(*f));
+    f->keep_alive = minor_version == 1;
+    for (h = 0; h < nheaders; h++)
+    {
+        value = &headers[h].value;
+        if (http_is(&headers[h].name, "Content-Length"))
+        {
+            if (value->len == 0)
+            {
+                return -1;
+            }
+            n = 0;
+            for (i = 0; i < value->len; i++)
+            {
+                if (value->data[i] < '0' || value->data[i] > '9' || n > (SIZE_MAX - 9) / 10)
+                {
+                    return -1;
+                }
+                n = n * 10 + (value->data[i] - '0');
+            }
+            if (f->have_length && n != f->content_length)
+            {
+                return -1;
+            }
+            f->content_length = n;
+            f->have_length = 1;
+        }
+        else if (http_is(&headers[h].name, "Transfer-Encoding"))
+        {
+            f->chunked = 1;
+        }
+        else if (http_is(&headers[h].name, "Connection"))
+        {
+            if (http_has_token(value, "close"))
+            {
+                f->keep_alive = 0;
+            }
+            else if (http_has_token(value, "keep-alive"))
+            {
+                f->keep_alive = 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Parses the header block of a request at the start of buf,
+ * leaving the body to the caller.
+ *
+ * @param buf the unconsumed input.
+ * @param len
+ * @param scanned as for http_parse().
+ * @param max the largest header block accepted.
+ * @param req filled in when the header block is complete. body.data
+ * points just past it and body.len is the Content-Length, whether or
+ * not that much has arrived.
+ * @return the length of the header block, 0 if more input is needed,
+ * or -1 if the request is malformed, too large or has a chunked body.
+ */
+ssize_t http_parse_head(const char *buf, size_t len, size_t *scanned, size_t max,
+                        struct http_request *req)
+{
+    const char *end = buf + len;
+    const char *start = buf;
+    const char *lf;
+    const char *next;
+    struct http_framing f;
+    size_t header_len;
+
+    // Empty lines before a request are ignored.
+    while (start < end && (*start == '\r' || *start == '\n'))
+    {
+        start++;
+    }
+
+    lf = http_find_head_end(buf, len, scanned, start);
+    if (lf == NULL)
+    {
+        return len > max ? -1 : 0;
+    }
+    header_len = lf + 1 - buf;
+    if (header_len > max)
+    {
+        return -1;
+    }
+
+    memset(req, 0, offsetof(struct http_request, headers));
+    if (http_parse_request_line(start, http_line_end(start, end, &next), req) < 0 ||
+        http_parse_headers(next, lf, end, req->headers, &req->nheaders) < 0 ||
+        http_parse_framing(req->headers, req->nheaders, req->minor_version, &f) < 0 ||
+        f.chunked)
+    {
+        return -1;
+    }
+    req->keep_alive = f.keep_alive;
+    req->body.data = buf + header_len;
+    req->body.len = f.content_length;
+
+    // Should the caller come back for the body, the header block need not be searched again.
+    *scanned = lf - buf;
+    return header_len;
+}
+
+/**
+ * @brief Looks for the next complete request at the start of buf.
+ *
+ * @param buf the unconsumed input.
+ * @param len
+ * @param scanned how far buf has already been searched for the end
+ * of the header block; 0 for a new request, updated on every call.
+ * @param max the largest request accepted, header block and body
+ * together.
+ * @param req filled in when a request is found.
+ * @return the number of bytes the request occupies, 0 if more input
+ * is needed, or -1 if the request is malformed, too large or uses a
+ * feature that is not supported (chunked bodies).
+ */
+ssize_t http_parse(const char *buf, size_t len, size_t *scanned, size_t max,
+                   struct http_request *req)
+{
+    ssize_t header_len;
+
+    header_len = http_parse_head(buf, len, scanned, max, req);
+    if (header_len <= 0)
+    {
+        return header_len;
+    }
+    if (req->body.len > max - header_len)
+    {
+        return -1;
+    }
+    if (len - header_len < req->body.len)
+    {
+        // Waiting for the body.
+        return 0;
+    }
+
+    *scanned = 0;
+    return header_len + req->body.len;
+}
+
+/**
+ * @brief Parses the status line and header block of a response at
+ * the start of buf, leaving the body to the caller.
+ *
+ * The body is as long as content_length says if have_length is set.
+ * Otherwise, unless it is chunked or the response cannot have one
+ * (1xx, 204, 304, or an answer to HEAD), it runs until the server
+ * closes the connection.
+ *
+ * @param buf
+ * @param len
+ * @param scanned as for http_parse().
+ * @param max the largest header block accepted.
+ * @param resp filled in when the header block is complete.
+ * @return the length of the header block, 0 if more input is needed,
+ * or -1 if the response is malformed or too large.
+ */
+ssize_t http_parse_response(const char *buf, size_t len, size_t *scanned, size_t max,
+                            struct http_response *resp)
+{
+    const char *end = buf + len;
+    const char *lf;
+    const char *line_end;
+    const char *next;
+    struct http_framing f;
+    size_t header_len;
+
+    lf = http_find_head_end(buf, len, scanned, buf);
+    if (lf == NULL)
+    {
+        return len > max ? -1 : 0;
+    }
+    header_len = lf + 1 - buf;
+    if (header_len > max)
+    {
+        return -1;
+    }
+
+    // "HTTP/1.1 200 OK": the reason phrase is not needed.
+    line_end = http_line_end(buf, end, &next);
+    if (line_end - buf < 12 || memcmp(buf, "HTTP/1.", 7) != 0 || (buf[7] != '0' && buf[7] != '1') ||
+        buf[8] != ' ' || buf[9] < '1' || buf[9] > '5' || buf[10] < '0' || buf[10] > '9' ||
+        buf[11] < '0' || buf[11] > '9' || (line_end - buf > 12 && buf[12] != ' '))
+    {
+        return -1;
+    }
+    resp->minor_version = buf[7] - '0';
+    resp->status = (buf[9] - '0') * 100 + (buf[10] - '0') * 10 + (buf[11] - '0');
+
+    resp->nheaders = 0;
+    if (http_parse_headers(next, lf, end, resp->headers, &resp->nheaders) < 0 ||
+        http_parse_framing(resp->headers, resp->nheaders, resp->minor_version, &f) < 0)
+    {
+        return -1;
+    }
+    resp->keep_alive = f.keep_alive;
+    resp->content_length = f.content_length;
+    resp->have_length = f.have_length && !f.chunked;
+    resp->chunked = f.chunked;
+
+    *scanned = 0;
+    return header_len;
+}
+
+/**
+ * @brief Looks up a header field by name, ignoring case.
+ *
+ * @param req
+ * @param name
+ * @return the first value with that name, or NULL if there is none.
+ */
+const struct http_string *http_header(const struct http_request *req, const char *name)
+{
+    int h;
+
+    for (h = 0; h < req->nheaders; h++)
+    {
+        if (http_is(&req->headers[h].name, name))
+        {
+            return &req->headers[h].value;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief How much the client wants a content coding, going by its
+ * Accept-Encoding header.
+ *
+ * A coding the header lists is weighted by its q-value; one it does
+ * not list takes the weight of "*" if that is present. Without the
+ * header, only the identity coding is assumed to be understood.
+ *
+ * @param req
+ * @param coding e.g. "gzip".
+ * @return the q-value in thousandths, 0 if the coding is not acceptable.
+ */
+int http_accepts(const struct http_request *req, const char *coding)
+{
+    const struct http_string *value = http_header(req, "Accept-Encoding");
+    const char *p, *end;
+    struct http_string item;
+    int q, wildcard = 0, digits;
+
+    if (value == NULL)
+    {
+        return 0;
+    }
+
+    p = value->data;
+    end = value->data + value->len;
+    while (p < end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+        {
+            p++;
+        }
+        item.data = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+        {
+            p++;
+        }
+        item.len = p - item.data;
+
+        // An optional ";q=0.5" after the coding; anything else is ignored.
+        q = 1000;
+        while (p < end && (*p == ' ' || *p == '\t'))
+        {
+            p++;
+        }
+        if (p < end && *p == ';')
+        {
+            for (p++; p < end && (*p == ' ' || *p == '\t'); p++)
+            {
+            }
+            if (end - p >= 2 && (p[0] | 0x20) == 'q' && p[1] == '=')
+            {
+                p += 2;
+                q = p < end && *p == '1' ? 1000 : 0;
+                for (p++; p < end && *p == '.'; p++)
+                {
+                }
+                for (digits = 100; p < end && *p >= '0' && *p <= '9'; p++, digits /= 10)
+                {
+                    if (q < 1000)
+                    {
+                        q += (*p - '0') * digits;
+                    }
+                }
+            }
+        }
+        while (p < end && *p != ',')
+        {
+            p++;
+        }
+
+        if (http_is(&item, coding))
+        {
+            return q;
+        }
+        if (item.len == 1 && item.data[0] == '*')
+        {
+            wildcard = q;
+        }
+    }
+    return wildcard;
+}
+
+static const char *http_reason(int status)
+{
+    switch (status)
+    {
+    case 200:
+        return "OK";
+    case 400:
+        return "Bad Request";
+    case 404:
+        return "Not Found";
+    case 405:
+        return "Method Not Allowed";
+    case 500:
+        return "Internal Server Error";
+    case 502:
+        return "Bad Gateway";
+    case 503:
+        return "Service Unavailable";
+    default:
+        return "Unknown";
+    }
+}
+
+/**
+ * @brief Queues the status line and header block of a response; the
+ * caller queues a body of content_length bytes after it.
+ *
+ * @param out
+ * @param status
+ * @param content_type
+ * @param encoding the Content-Encoding of the body, or NULL for none.
+ * @param vary nonzero if the body was chosen by the request's
+ * Accept-Encoding, even if it is not encoded.
+ * @param content_length
+ * @param keep_alive 0 to tell the client the connection will be closed.
+ * @return 0 on success, -1 if memory is exhausted or the header block
+ * does not fit.
+ */
+int http_respond_header(struct output *out, int status, const char *content_type,
+                        const char *encoding, int vary, size_t content_length, int keep_alive)
+{
+    char head[320];
+    int n;
+
+    n = snprintf(head, sizeof(head),
+                 "HTTP/1.1 %d %s\r\n"
+                 "Content-Type: %s\r\n"
+                 "Content-Length: %zu\r\n"
+                 "%s%s%s"
+                 "%s"
+                 "%s"
+                 "\r\n",
+                 status, http_reason(status), content_type, content_length,
+                 encoding != NULL ? "Content-Encoding: " : "",
+                 encoding != NULL ? encoding : "",
+                 encoding != NULL ? "\r\n" : "",
+                 vary ? "Vary: Accept-Encoding\r\n" : "",
+                 keep_alive ? "" : "Connection: close\r\n");
+    if (n < 0 || (size_t) n >= sizeof(head))
+    {
+        return -1;
+    }
+    return output_append_copy(out, head, n);
+}
+
+/**
+ * @brief Queues a complete plain text response.
+ *
+ * The header block is copied; the body is copied if it is small and
+ * otherwise referenced, as with framing_encode().
+ *
+ * @param out
+ * @param status
+ * @param body
+ * @param len
+ * @param keep_alive 0 to tell the client the connection will be closed.
+ * @return 0 on success, -1 if memory is exhausted.
+ */
+int http_respond(struct output *out, int status, const char *body, size_t len, int keep_alive)
+{
+    if (http_respond_header(out, status, "text/plain", NULL, 0, len, keep_alive) < 0)
+    {
+        return -1;
+    }
+    if (len == 0)
+    {
+        return 0;
+    }
+    if (len <= FRAMING_COPY_MAX)
+    {
+        return output_append_copy(out, body, len);
+    }
+    return output_append_ref(out, body, len, NULL, NULL);
+}
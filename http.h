@@ -0,0 +1,82 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "output.h"
+
+// Most header fields accepted in one request.
+#define HTTP_MAX_HEADERS 32
+
+/*
+    A piece of the request. It points into the connection's input
+    buffer rather than holding a copy, so it is only valid as long as
+    the request is, and it is not NUL-terminated.
+*/
+struct http_string
+{
+    const char *data;
+    size_t len;
+};
+
+struct http_header
+{
+    struct http_string name;
+    struct http_string value;
+};
+
+/*
+    A parsed request. Header values have their surrounding
+    whitespace removed; everything else is exactly as received.
+*/
+struct http_request
+{
+    struct http_string method;
+    struct http_string target;
+
+    // 0 for HTTP/1.0, 1 for HTTP/1.1.
+    int minor_version;
+
+    // Whether the connection stays open after the response.
+    int keep_alive;
+
+    struct http_string body;
+
+    int nheaders;
+    struct http_header headers[HTTP_MAX_HEADERS];
+};
+
+/*
+    A parsed response from an upstream server (see proxy.c). As with
+    requests, the headers point into the buffer it was parsed from.
+*/
+struct http_response
+{
+    int status;
+    int minor_version;
+    int keep_alive;
+
+    // The length of the body when have_length is set.
+    size_t content_length;
+    int have_length;
+    int chunked;
+
+    int nheaders;
+    struct http_header headers[HTTP_MAX_HEADERS];
+};
+
+void http_init(void);
+ssize_t http_parse(const char *buf, size_t len, size_t *scanned, size_t max,
+                   struct http_request *req);
+ssize_t http_parse_head(const char *buf, size_t len, size_t *scanned, size_t max,
+                        struct http_request *req);
+ssize_t http_parse_response(const char *buf, size_t len, size_t *scanned, size_t max,
+                            struct http_response *resp);
+const struct http_string *http_header(const struct http_request *req, const char *name);
+int http_accepts(const struct http_request *req, const char *coding);
+int http_respond_header(struct output *out, int status, const char *content_type,
+                        const char *encoding, int vary, size_t content_length, int keep_alive);
+int http_respond(struct output *out, int status, const char *body, size_t len, int keep_alive);
+
+#endif
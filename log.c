@@ -0,0 +1,273 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/*
+    Logging from the request path must never block. Instead of
+    calling printf() (which takes the stdio lock and may wait on a
+    slow stdout), each worker thread copies a small fixed-size record
+    into a ring buffer of its own. A single background thread empties
+    every ring, formats the records and writes them out in large
+    batches. When a ring is full the record is dropped and counted;
+    the worker never waits.
+*/
+
+// Records per thread ring. Must be a power of two.
+#define LOG_RING_SIZE 4096
+
+// Bytes formatted before the writer calls write().
+#define LOG_BATCH 65536
+
+// How long the writer sleeps when every ring is empty.
+#define LOG_IDLE_NS 1000000
+
+#define LOG_CACHE_LINE 64
+
+/*
+    A record is formatted later, on the writer thread, so it holds
+    the format string (which must be a constant containing a single
+    "%.*s") and a copy of the bytes to print.
+*/
+struct log_record
+{
+    const char *fmt;
+    uint32_t len;
+    char data[LOG_PAYLOAD];
+};
+
+/*
+    A single-producer, single-consumer ring. Only the owning worker
+    advances tail and only the writer advances head, so plain atomic
+    loads and stores are enough. They live on separate cache lines so
+    the two threads do not keep stealing the line from each other.
+*/
+struct log_ring
+{
+    unsigned long tail __attribute__((aligned(LOG_CACHE_LINE)));
+    unsigned long head_cache;
+    unsigned long dropped;
+
+    unsigned long head __attribute__((aligned(LOG_CACHE_LINE)));
+
+    struct log_ring *next;
+    struct log_record records[LOG_RING_SIZE];
+};
+
+// Every ring ever created, pushed on the front as threads start logging.
+static struct log_ring *rings;
+
+static __thread struct log_ring *my_ring;
+
+/**
+ * @brief Creates the calling thread's ring and makes it visible to the writer.
+ *
+ * @return the ring, or NULL if memory is exhausted.
+ */
+static struct log_ring *log_ring_create(void)
+{
+    struct log_ring *ring;
+
+    if (posix_memalign((void **) &ring, LOG_CACHE_LINE, sizeof(*ring)) != 0)
+    {
+        return NULL;
+    }
+    memset(ring, 0, offsetof(struct log_ring, records));
+
+    ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+        ;
+    }
+    return ring;
+}
+
+/**
+ * @brief Queues a log line without blocking.
+ *
+ * Only the record is copied here; formatting and the write happen on
+ * the writer thread. If the ring is full the line is dropped.
+ *
+ * @param fmt a constant format containing exactly one "%.*s".
+ * @param data the bytes to substitute for "%.*s".
+ * @param len
+ */
+void log_bytes(const char *fmt, const char *data, size_t len)
+{
+    struct log_ring *ring = my_ring;
+    struct log_record *rec;
+    unsigned long tail;
+
+    if (ring == NULL)
+    {
+        ring = my_ring = log_ring_create();
+        if (ring == NULL)
+        {
+            return;
+        }
+    }
+
+    tail = ring->tail;
+    if (tail - ring->head_cache == LOG_RING_SIZE)
+    {
+        // Looks full: check whether the writer has made progress.
+        ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail - ring->head_cache == LOG_RING_SIZE)
+        {
+            __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    if (len > LOG_PAYLOAD)
+    {
+        len = LOG_PAYLOAD;
+    }
+    rec = &ring->records[tail & (LOG_RING_SIZE - 1)];
+    rec->fmt = fmt;
+    rec->len = (uint32_t) len;
+    memcpy(rec->data, data, len);
+
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Writes out everything formatted so far.
+ *
+ * @param batch
+ * @param len
+ */
+static void log_write(const char *batch, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = write(STDOUT_FILENO, batch, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+        batch += n;
+        len -= n;
+    }
+}
+
+/**
+ * @brief The writer thread: drains every ring in turn, formatting
+ * into a large batch that is written with as few calls as possible.
+ *
+ * @param arg unused.
+ * @return never returns.
+ */
+static void *log_run(void *arg)
+{
+    static char batch[LOG_BATCH];
+    struct timespec idle = { 0, LOG_IDLE_NS };
+    unsigned long reported = 0, dropped;
+    unsigned long head, tail;
+    struct log_ring *ring;
+    struct log_record *rec;
+    size_t len = 0;
+    int n, busy;
+
+    (void) arg;
+
+    for (;;)
+    {
+        busy = 0;
+        for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+        {
+            head = ring->head;
+            tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+            for (; head != tail; head++)
+            {
+                rec = &ring->records[head & (LOG_RING_SIZE - 1)];
+                n = snprintf(batch + len, sizeof(batch) - len, rec->fmt, (int) rec->len, rec->data);
+                if (n < 0)
+                {
+                    continue;
+                }
+                if ((size_t) n >= sizeof(batch) - len)
+                {
+                    // Did not fit: write what we have and format again.
+                    log_write(batch, len);
+                    len = 0;
+                    n = snprintf(batch, sizeof(batch), rec->fmt, (int) rec->len, rec->data);
+                    if ((size_t) n >= sizeof(batch))
+                    {
+                        n = sizeof(batch) - 1;
+                    }
+                }
+                len += n;
+            }
+            if (head != ring->head)
+            {
+                __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+                busy = 1;
+            }
+        }
+
+        if (len > 0)
+        {
+            log_write(batch, len);
+            len = 0;
+        }
+
+        dropped = log_dropped();
+        if (dropped != reported)
+        {
+            fprintf(stderr, "WARNING log rings full, %lu lines dropped\n", dropped - reported);
+            reported = dropped;
+        }
+
+        if (!busy)
+        {
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts the background writer thread.
+ *
+ * @return 0 on success, -1 on failure with errno set.
+ */
+int log_start(void)
+{
+    pthread_t thread;
+
+    errno = pthread_create(&thread, NULL, log_run, NULL);
+    if (errno != 0)
+    {
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/**
+ * @brief The number of lines dropped so far because a ring was full.
+ */
+unsigned long log_dropped(void)
+{
+    struct log_ring *ring;
+    unsigned long total = 0;
+
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        total += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    return total;
+}
@@ -0,0 +1,13 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stddef.h>
+
+// The most message bytes kept per record; longer messages are truncated.
+#define LOG_PAYLOAD 240
+
+void log_bytes(const char *fmt, const char *data, size_t len);
+int log_start(void);
+unsigned long log_dropped(void);
+
+#endif
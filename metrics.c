@@ -0,0 +1,465 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "accept_queue.h"
+#include "log.h"
+#include "metrics.h"
+#include "proxy.h"
+
+/*
+    Where the time goes, as seen from inside the server: latency
+    histograms and counters kept by every thread for itself, and an
+    admin port that answers GET /metrics with all of them added up,
+    in the Prometheus text format.
+
+    Recording has to be cheap enough to leave on in production, so
+    each thread records into its own struct metrics (see metrics.h)
+    and nothing is shared until a scrape comes in. The admin thread
+    then walks the list of threads and adds up their histograms and
+    counters while they keep recording; a scrape may miss a count
+    that is being made, but never blocks or slows a worker.
+
+    Latencies are reported as summaries: the quantiles the HDR
+    histograms resolve to within 0.2%, the total and the count, plus
+    the largest value seen.
+*/
+
+// How long the admin thread waits on a slow scraper.
+#define METRICS_IO_TIMEOUT 2
+
+// The largest scrape request read.
+#define METRICS_REQUEST_MAX 4096
+
+// How long the admin thread pauses when accepting fails, e.g. out of descriptors.
+#define METRICS_ACCEPT_BACKOFF_NS (100 * 1000 * 1000)
+
+__thread struct metrics *metrics_thread;
+
+static struct
+{
+    // Serializes threads adding themselves; readers follow the links.
+    pthread_mutex_t lock;
+    struct metrics *head;
+} registry = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Where threads that cannot allocate their own metrics record, sharing them racily.
+static struct histogram fallback_histograms[METRIC_HISTOGRAMS];
+static struct metrics fallback = {
+    .histograms = { &fallback_histograms[0], &fallback_histograms[1], &fallback_histograms[2] }
+};
+static int fallback_linked;
+
+static const char *const histogram_names[METRIC_HISTOGRAMS] = {
+    "server_first_byte_seconds",
+    "server_handler_seconds",
+    "server_request_seconds",
+};
+
+static const char *const histogram_help[METRIC_HISTOGRAMS] = {
+    "Time from accepting a connection to writing the first byte of its first response.",
+    "Time spent running handlers.",
+    "Time from a complete request to its response being queued.",
+};
+
+static const char *const error_names[] = { "invalid", "timeout", "io", "upstream" };
+
+static void metrics_link(struct metrics *m)
+{
+    pthread_mutex_lock(&registry.lock);
+    m->next = registry.head;
+    __atomic_store_n(&registry.head, m, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&registry.lock);
+}
+
+/**
+ * @brief Sets up the calling thread's metrics and adds them to the
+ * ones scrapes add up.
+ *
+ * @return the thread's metrics; if memory is exhausted, a record
+ * shared by every thread in that situation.
+ */
+struct metrics *metrics_attach(void)
+{
+    struct metrics *m = calloc(1, sizeof(*m));
+    int i;
+
+    for (i = 0; m != NULL && i < METRIC_HISTOGRAMS; i++)
+    {
+        m->histograms[i] = histogram_create();
+        if (m->histograms[i] == NULL)
+        {
+            while (i-- > 0)
+            {
+                histogram_destroy(m->histograms[i]);
+            }
+            free(m);
+            m = NULL;
+        }
+    }
+
+    if (m != NULL)
+    {
+        metrics_link(m);
+    }
+    else
+    {
+        m = &fallback;
+        if (!__atomic_exchange_n(&fallback_linked, 1, __ATOMIC_RELAXED))
+        {
+            metrics_link(m);
+        }
+    }
+    metrics_thread = m;
+    return m;
+}
+
+static void metrics_counter(FILE *out, const char *name, const char *type, const char *help, unsigned long value)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %lu\n", name, help, name, type, name, value);
+}
+
+/**
+ * @brief Writes one latency histogram as a summary.
+ *
+ * @param out
+ * @param name
+ * @param help
+ * @param h
+ */
+static void metrics_summary(FILE *out, const char *name, const char *help, const struct histogram *h)
+{
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999, 0.9999 };
+    size_t i;
+
+    fprintf(out, "# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+    for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+    {
+        fprintf(out, "%s{quantile=\"%g\"} %.9f\n", name, quantiles[i],
+                histogram_percentile(h, quantiles[i] * 100) / 1e9);
+    }
+    fprintf(out, "%s_sum %.9f\n%s_count %llu\n", name, h->sum / 1e9, name, (unsigned long long) h->count);
+    fprintf(out, "# HELP %s_max The largest value seen.\n# TYPE %s_max gauge\n%s_max %.9f\n",
+            name, name, name, h->max / 1e9);
+}
+
+/**
+ * @brief Writes the proxy's per-backend counters, if it is running.
+ *
+ * @param out
+ */
+static void metrics_upstreams(FILE *out)
+{
+    static const struct
+    {
+        const char *name;
+        const char *type;
+        const char *help;
+    } series[] = {
+        { "server_upstream_requests_total", "counter", "Requests forwarded to the backend, including retries." },
+        { "server_upstream_pool_hits_total", "counter", "Requests sent over a pooled connection." },
+        { "server_upstream_connects_total", "counter", "Connections opened to the backend." },
+        { "server_upstream_wait_seconds_total", "counter", "Time from picking a connection until it took the request." },
+        { "server_upstream_failures_total", "counter", "Requests the backend failed." },
+        { "server_upstream_ejections_total", "counter", "Times the backend was taken out of rotation." },
+        { "server_upstream_outstanding", "gauge", "Requests the backend is working on." },
+        { "server_upstream_ejected", "gauge", "Whether the backend is out of rotation." },
+    };
+    struct proxy_backend_stats stats[PROXY_MAX_BACKENDS];
+    struct proxy_backend_stats *s;
+    size_t i;
+    int n, b;
+
+    n = proxy_snapshot(stats, PROXY_MAX_BACKENDS);
+    if (n == 0)
+    {
+        return;
+    }
+    for (i = 0; i < sizeof(series) / sizeof(series[0]); i++)
+    {
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", series[i].name, series[i].help, series[i].name, series[i].type);
+        for (b = 0; b < n; b++)
+        {
+            s = &stats[b];
+            fprintf(out, "%s{backend=\"%s\"} ", series[i].name, s->name);
+            switch (i)
+            {
+            case 0:
+                fprintf(out, "%lu\n", s->requests);
+                break;
+            case 1:
+                fprintf(out, "%lu\n", s->pool_hits);
+                break;
+            case 2:
+                fprintf(out, "%lu\n", s->connects);
+                break;
+            case 3:
+                fprintf(out, "%.3f\n", s->wait_ms / 1e3);
+                break;
+            case 4:
+                fprintf(out, "%lu\n", s->failures);
+                break;
+            case 5:
+                fprintf(out, "%lu\n", s->ejections);
+                break;
+            case 6:
+                fprintf(out, "%ld\n", s->outstanding);
+                break;
+            default:
+                fprintf(out, "%d\n", s->ejected);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Adds up every thread's metrics and writes them out.
+ *
+ * @param out
+ * @return 0 on success, -1 if memory is exhausted.
+ */
+static int metrics_render(FILE *out)
+{
+    struct histogram *merged[METRIC_HISTOGRAMS] = { NULL };
+    uint64_t counters[METRIC_COUNTERS] = { 0 };
+    struct accept_queue_stats queue;
+    struct metrics *m;
+    int i, status = 0;
+
+    for (i = 0; i < METRIC_HISTOGRAMS; i++)
+    {
+        merged[i] = histogram_create();
+        if (merged[i] == NULL)
+        {
+            status = -1;
+        }
+    }
+
+    for (m = __atomic_load_n(&registry.head, __ATOMIC_ACQUIRE); m != NULL && status == 0; m = m->next)
+    {
+        for (i = 0; i < METRIC_HISTOGRAMS; i++)
+        {
+            histogram_merge(merged[i], m->histograms[i]);
+        }
+        for (i = 0; i < METRIC_COUNTERS; i++)
+        {
+            counters[i] += __atomic_load_n(&m->counters[i], __ATOMIC_RELAXED);
+        }
+    }
+
+    if (status == 0)
+    {
+        metrics_counter(out, "server_connections_total", "counter", "Connections accepted.",
+                        counters[METRIC_ACCEPTED]);
+        // Each thread's counts are read at a slightly different time; never report a negative.
+        metrics_counter(out, "server_connections_active", "gauge", "Connections open now.",
+                        counters[METRIC_ACCEPTED] > counters[METRIC_CLOSED] ?
+                        counters[METRIC_ACCEPTED] - counters[METRIC_CLOSED] : 0);
+        metrics_counter(out, "server_received_bytes_total", "counter", "Bytes read from clients.",
+                        counters[METRIC_BYTES_IN]);
+        metrics_counter(out, "server_sent_bytes_total", "counter", "Bytes written to clients.",
+                        counters[METRIC_BYTES_OUT]);
+
+        fprintf(out, "# HELP server_errors_total Requests and connections that failed, by cause.\n"
+                     "# TYPE server_errors_total counter\n");
+        for (i = 0; i < METRIC_COUNTERS - METRIC_ERR_INVALID; i++)
+        {
+            fprintf(out, "server_errors_total{type=\"%s\"} %llu\n", error_names[i],
+                    (unsigned long long) counters[METRIC_ERR_INVALID + i]);
+        }
+
+        for (i = 0; i < METRIC_HISTOGRAMS; i++)
+        {
+            metrics_summary(out, histogram_names[i], histogram_help[i], merged[i]);
+        }
+
+        accept_queue_snapshot(&queue);
+        metrics_counter(out, "server_accept_queue_depth", "gauge",
+                        "Connections waiting to be accepted at the last sample.", queue.depth);
+        metrics_counter(out, "server_accept_queue_max_depth", "gauge",
+                        "The largest accept queue depth sampled.", queue.max_depth);
+        metrics_counter(out, "server_accept_queue_backlog", "gauge",
+                        "The accept queue size the kernel granted.", queue.backlog);
+        metrics_counter(out, "server_listen_overflows_total", "counter",
+                        "Handshakes completed into a full accept queue (TcpExt ListenOverflows).", queue.overflows);
+        metrics_counter(out, "server_listen_drops_total", "counter",
+                        "SYNs and handshakes dropped (TcpExt ListenDrops).", queue.drops);
+        metrics_counter(out, "server_log_dropped_total", "counter",
+                        "Log lines dropped because the log rings were full.", log_dropped());
+        metrics_upstreams(out);
+    }
+
+    for (i = 0; i < METRIC_HISTOGRAMS; i++)
+    {
+        histogram_destroy(merged[i]);
+    }
+    return status;
+}
+
+static int metrics_write_all(int fd, const char *data, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Answers one request on the admin port.
+ *
+ * @param fd the accepted connection, blocking.
+ */
+static void metrics_serve(int fd)
+{
+    static const char not_found[] =
+        "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    static const char unavailable[] =
+        "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    struct timeval timeout = { METRICS_IO_TIMEOUT, 0 };
+    char request[METRICS_REQUEST_MAX + 1];
+    char header[128];
+    size_t len = 0;
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out;
+    ssize_t n;
+    int header_len;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // Only the request line matters, but the client expects its whole request to be read.
+    while (len < METRICS_REQUEST_MAX)
+    {
+        n = read(fd, request + len, METRICS_REQUEST_MAX - len);
+        if (n <= 0)
+        {
+            return;
+        }
+        len += n;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL)
+        {
+            break;
+        }
+    }
+
+    if (strncmp(request, "GET /metrics ", 13) != 0 && strncmp(request, "GET /metrics?", 13) != 0)
+    {
+        metrics_write_all(fd, not_found, sizeof(not_found) - 1);
+        return;
+    }
+
+    out = open_memstream(&body, &body_len);
+    if (out == NULL || metrics_render(out) < 0 || fclose(out) != 0)
+    {
+        metrics_write_all(fd, unavailable, sizeof(unavailable) - 1);
+        free(body);
+        return;
+    }
+
+    header_len = snprintf(header, sizeof(header),
+                          "HTTP/1.1 200 OK\r\n"
+                          "Content-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: %zu\r\n"
+                          "Connection: close\r\n\r\n",
+                          body_len);
+    if (metrics_write_all(fd, header, header_len) == 0)
+    {
+        metrics_write_all(fd, body, body_len);
+    }
+    free(body);
+}
+
+/**
+ * @brief The admin thread: answers scrapes one at a time.
+ *
+ * @param arg the listening socket.
+ * @return never returns.
+ */
+static void *metrics_run(void *arg)
+{
+    struct timespec backoff = { 0, METRICS_ACCEPT_BACKOFF_NS };
+    int sockfd = (int) (intptr_t) arg;
+    int fd;
+
+    for (;;)
+    {
+        fd = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            // Failing again at once (EMFILE, ENFILE, ENOBUFS) would only spin.
+            if (errno != EINTR && errno != ECONNABORTED)
+            {
+                nanosleep(&backoff, NULL);
+            }
+            continue;
+        }
+        metrics_serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Opens the admin port and starts the thread that serves it.
+ *
+ * @param addr the address to listen on, loopback unless the metrics
+ * are meant to be reachable from elsewhere.
+ * @param port
+ * @return 0 on success, -1 on failure with errno set.
+ */
+int metrics_start(struct in_addr addr, int port)
+{
+    struct sockaddr_in sin;
+    pthread_t thread;
+    int one = 1;
+    int sockfd;
+
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd < 0)
+    {
+        return -1;
+    }
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr = addr;
+    sin.sin_port = htons(port);
+    if (bind(sockfd, (struct sockaddr *) &sin, sizeof(sin)) < 0 || listen(sockfd, 16) < 0)
+    {
+        close(sockfd);
+        return -1;
+    }
+
+    errno = pthread_create(&thread, NULL, metrics_run, (void *) (intptr_t) sockfd);
+    if (errno != 0)
+    {
+        close(sockfd);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
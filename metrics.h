@@ -0,0 +1,92 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "histogram.h"
+
+// Latencies, each kept as a histogram in nanoseconds.
+#define METRIC_FIRST_BYTE 0     // accepting a connection to writing its first response byte
+#define METRIC_HANDLER 1        // running a handler on a message
+#define METRIC_REQUEST 2        // a complete message to its response being queued
+#define METRIC_HISTOGRAMS 3
+
+// Counters.
+#define METRIC_ACCEPTED 0       // connections opened
+#define METRIC_CLOSED 1         // connections closed
+#define METRIC_BYTES_IN 2
+#define METRIC_BYTES_OUT 3
+#define METRIC_ERR_INVALID 4    // malformed or oversized messages
+#define METRIC_ERR_TIMEOUT 5    // connections closed by a timeout
+#define METRIC_ERR_IO 6         // connections that failed reading or writing
+#define METRIC_ERR_UPSTREAM 7   // proxied requests no backend answered
+#define METRIC_COUNTERS 8
+
+/*
+    One thread's metrics. Only that thread writes them, with plain
+    increments published by relaxed stores, so recording takes no
+    lock and shares no cache line with another thread; a scrape adds
+    every thread's up.
+*/
+struct metrics
+{
+    struct histogram *histograms[METRIC_HISTOGRAMS];
+    uint64_t counters[METRIC_COUNTERS];
+
+    // The next thread's, in the order they first recorded something.
+    struct metrics *next;
+};
+
+extern __thread struct metrics *metrics_thread;
+
+struct metrics *metrics_attach(void);
+int metrics_start(struct in_addr addr, int port);
+
+/**
+ * @brief This thread's metrics, set up on first use.
+ */
+static inline struct metrics *metrics_self(void)
+{
+    return metrics_thread != NULL ? metrics_thread : metrics_attach();
+}
+
+/**
+ * @brief Adds n to one of this thread's counters.
+ *
+ * @param counter a METRIC_* counter.
+ * @param n
+ */
+static inline void metrics_count(int counter, uint64_t n)
+{
+    struct metrics *m = metrics_self();
+
+    __atomic_store_n(&m->counters[counter], m->counters[counter] + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief The time now, for metrics_time().
+ *
+ * @return CLOCK_MONOTONIC in nanoseconds.
+ */
+static inline uint64_t metrics_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Records the time since start in one of this thread's histograms.
+ *
+ * @param histogram a METRIC_* histogram.
+ * @param start from metrics_now().
+ */
+static inline void metrics_time(int histogram, uint64_t start)
+{
+    histogram_record(metrics_self()->histograms[histogram], metrics_now() - start);
+}
+
+#endif
@@ -0,0 +1,85 @@
+#include <stddef.h>
+
+#include "mpsc.h"
+
+/**
+ * @brief Prepares an empty queue.
+ *
+ * @param queue
+ */
+void mpsc_init(struct mpsc_queue *queue)
+{
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+}
+
+/**
+ * @brief Appends a node. Safe to call from any thread.
+ *
+ * @param queue
+ * @param node
+ */
+void mpsc_push(struct mpsc_queue *queue, struct mpsc_node *node)
+{
+    struct mpsc_node *prev;
+
+    __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+
+    /*
+        Swapping the head claims our place in line; linking the
+        previous node to us publishes the node to the consumer. In
+        between, the consumer sees the queue end at prev.
+    */
+    prev = __atomic_exchange_n(&queue->head, node, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Removes the oldest node. Only the consumer may call this.
+ *
+ * @param queue
+ * @return the node, or NULL if the queue is empty or the next node's
+ * producer is still in the middle of mpsc_push(). In the latter case
+ * that producer has not returned yet, so whatever it does after the
+ * push (such as waking the consumer) is still to come.
+ */
+struct mpsc_node *mpsc_pop(struct mpsc_queue *queue)
+{
+    struct mpsc_node *tail = queue->tail;
+    struct mpsc_node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    struct mpsc_node *head;
+
+    if (tail == &queue->stub)
+    {
+        if (next == NULL)
+        {
+            return NULL;
+        }
+        queue->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next != NULL)
+    {
+        queue->tail = next;
+        return tail;
+    }
+
+    head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    if (tail != head)
+    {
+        return NULL;
+    }
+
+    // tail is the last node: put the stub behind it so it can be taken.
+    mpsc_push(queue, &queue->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL)
+    {
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
@@ -0,0 +1,32 @@
+#ifndef MPSC_H
+#define MPSC_H
+
+/*
+    An unbounded, intrusive, lock-free queue with many producers and
+    a single consumer (Vyukov's design). A push is one atomic exchange
+    and never waits; the consumer pops without any atomic
+    read-modify-write at all. Nodes are embedded in the items being
+    queued, so the queue allocates nothing.
+*/
+struct mpsc_node
+{
+    struct mpsc_node *next;
+};
+
+struct mpsc_queue
+{
+    // Where producers append; only touched with atomic operations.
+    struct mpsc_node *head __attribute__((aligned(64)));
+
+    // Where the consumer removes; private to the consumer.
+    struct mpsc_node *tail __attribute__((aligned(64)));
+
+    // Placeholder that keeps the queue from ever being empty of nodes.
+    struct mpsc_node stub;
+};
+
+void mpsc_init(struct mpsc_queue *queue);
+void mpsc_push(struct mpsc_queue *queue, struct mpsc_node *node);
+struct mpsc_node *mpsc_pop(struct mpsc_queue *queue);
+
+#endif
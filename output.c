@@ -0,0 +1,616 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#include "buffer.h"
+#include "output.h"
+
+/*
+    Segment structures are recycled through a per-thread free list,
+    the same way buffer blocks are, so building a response does not
+    call malloc() once the worker has warmed up.
+*/
+static __thread struct segment *free_segments;
+
+static struct segment *segment_alloc(void)
+{
+    struct segment *seg = free_segments;
+
+    if (seg != NULL)
+    {
+        free_segments = seg->next;
+    }
+    else
+    {
+        seg = malloc(sizeof(*seg));
+        if (seg == NULL)
+        {
+            return NULL;
+        }
+    }
+    memset(seg, 0, sizeof(*seg));
+    seg->fd = -1;
+    return seg;
+}
+
+static void segment_free(struct segment *seg)
+{
+    if (seg->release != NULL)
+    {
+        seg->release(seg->ctx);
+    }
+    buffer_block_free(seg->block, seg->cap);
+
+    seg->next = free_segments;
+    free_segments = seg;
+}
+
+/**
+ * @brief Disposes of a segment that has been written: frees it, or
+ * holds it back if the kernel may still be reading its memory.
+ *
+ * The last zerocopy send that used it may have completed while the
+ * rest of it was still waiting to go out (by copying, say), in which
+ * case no later notification would release it.
+ */
+static void output_retire(struct output *out, struct segment *seg)
+{
+    if (!seg->zc_pending || (int32_t) (seg->zc_seq - out->zc_done) < 0)
+    {
+        segment_free(seg);
+        return;
+    }
+
+    seg->next = NULL;
+    if (out->held_tail != NULL)
+    {
+        out->held_tail->next = seg;
+    }
+    else
+    {
+        out->held_head = seg;
+    }
+    out->held_tail = seg;
+}
+
+static void output_link(struct output *out, struct segment *seg)
+{
+    if (out->tail != NULL)
+    {
+        out->tail->next = seg;
+    }
+    else
+    {
+        out->head = seg;
+    }
+    out->tail = seg;
+    out->bytes += seg->len;
+}
+
+/**
+ * @brief Queues len bytes at data without copying them.
+ *
+ * The memory must stay valid until release is called (or, without
+ * a release callback, for as long as the connection lives, which is
+ * what constants rely on).
+ *
+ * @param out
+ * @param data
+ * @param len
+ * @param release called with ctx once the bytes are no longer needed; may be NULL.
+ * @param ctx
+ * @return 0 on success, -1 if memory is exhausted (release has then
+ * already been called).
+ */
+int output_append_ref(struct output *out, const char *data, size_t len,
+                      void (*release)(void *ctx), void *ctx)
+{
+    struct segment *seg = segment_alloc();
+
+    if (seg == NULL)
+    {
+        if (release != NULL)
+        {
+            release(ctx);
+        }
+        return -1;
+    }
+
+    seg->data = data;
+    seg->len = len;
+    seg->release = release;
+    seg->ctx = ctx;
+    output_link(out, seg);
+    return 0;
+}
+
+/**
+ * @brief Returns space for len bytes at the end of the output.
+ *
+ * Small pieces such as headers are packed into the pool block of
+ * the last segment while it has room; a new block is only taken
+ * when it does not. The bytes are not queued until output_commit().
+ *
+ * @param out
+ * @param len
+ * @return where to write the bytes, or NULL if memory is exhausted.
+ */
+char *output_reserve(struct output *out, size_t len)
+{
+    struct segment *tail = out->tail;
+    struct segment *seg;
+
+    if (tail != NULL && tail->block != NULL && tail->cap - tail->len >= len)
+    {
+        return tail->block + tail->len;
+    }
+
+    seg = segment_alloc();
+    if (seg == NULL)
+    {
+        return NULL;
+    }
+
+    seg->block = buffer_block_alloc(len > BUFFER_SMALL ? len : BUFFER_SMALL, &seg->cap);
+    if (seg->block == NULL)
+    {
+        segment_free(seg);
+        return NULL;
+    }
+    seg->data = seg->block;
+    output_link(out, seg);
+    return seg->block;
+}
+
+/**
+ * @brief Queues len bytes written into the space from output_reserve().
+ *
+ * @param out
+ * @param len
+ */
+void output_commit(struct output *out, size_t len)
+{
+    out->tail->len += len;
+    out->bytes += len;
+}
+
+/**
+ * @brief Copies len bytes into the output.
+ *
+ * @param out
+ * @param data
+ * @param len
+ * @return 0 on success, -1 if memory is exhausted.
+ */
+int output_append_copy(struct output *out, const char *data, size_t len)
+{
+    char *p = output_reserve(out, len);
+
+    if (p == NULL)
+    {
+        return -1;
+    }
+    memcpy(p, data, len);
+    output_commit(out, len);
+    return 0;
+}
+
+/**
+ * @brief Queues len bytes of an open file, starting at offset.
+ *
+ * The file must stay open, and its contents unchanged, until release
+ * is called.
+ *
+ * @param out
+ * @param fd
+ * @param offset
+ * @param len
+ * @param release called with ctx once the bytes have been sent; may be NULL.
+ * @param ctx
+ * @return 0 on success, -1 if memory is exhausted (release has then
+ * already been called).
+ */
+int output_append_file(struct output *out, int fd, off_t offset, size_t len,
+                       void (*release)(void *ctx), void *ctx)
+{
+    struct segment *seg = segment_alloc();
+
+    if (seg == NULL)
+    {
+        if (release != NULL)
+        {
+            release(ctx);
+        }
+        return -1;
+    }
+
+    seg->fd = fd;
+    seg->offset = offset;
+    seg->len = len;
+    seg->release = release;
+    seg->ctx = ctx;
+    output_link(out, seg);
+    return 0;
+}
+
+/**
+ * @brief Describes the pending bytes as an iovec array.
+ *
+ * Stops at the first file segment, which cannot be described by an
+ * iovec; output_flush() sends those separately.
+ *
+ * @param out
+ * @param iov
+ * @param max the size of iov.
+ * @return the number of entries filled in.
+ */
+int output_iov(const struct output *out, struct iovec *iov, int max)
+{
+    const struct segment *seg;
+    size_t off = out->head_off;
+    int n = 0;
+
+    for (seg = out->head; seg != NULL && n < max && seg->fd < 0; seg = seg->next)
+    {
+        if (seg->len == off)
+        {
+            off = 0;
+            continue;
+        }
+        iov[n].iov_base = (char *) seg->data + off;
+        iov[n].iov_len = seg->len - off;
+        n++;
+        off = 0;
+    }
+    return n;
+}
+
+/**
+ * @brief Drops n written bytes from the front, releasing every
+ * segment that has gone out completely.
+ *
+ * @param out
+ * @param n
+ */
+void output_advance(struct output *out, size_t n)
+{
+    struct segment *seg;
+    size_t left;
+
+    out->bytes -= n;
+    while (n > 0 || (out->head != NULL && out->head->len == out->head_off))
+    {
+        seg = out->head;
+        left = seg->len - out->head_off;
+        if (n < left)
+        {
+            out->head_off += n;
+            return;
+        }
+
+        n -= left;
+        out->head = seg->next;
+        out->head_off = 0;
+        if (out->head == NULL)
+        {
+            out->tail = NULL;
+        }
+        output_retire(out, seg);
+    }
+}
+
+/**
+ * @brief Sends the file segment at the head of the output.
+ *
+ * @param out
+ * @param fd the socket.
+ * @return the number of bytes sent, or -1 with errno set.
+ */
+static ssize_t output_sendfile(struct output *out, int fd)
+{
+    struct segment *seg = out->head;
+    off_t offset = seg->offset + out->head_off;
+    ssize_t n;
+
+    n = sendfile(fd, seg->fd, &offset, seg->len - out->head_off);
+    if (n == 0)
+    {
+        // The file is shorter than it was: the response cannot be completed.
+        errno = EIO;
+        return -1;
+    }
+    return n;
+}
+
+static size_t output_iov_len(const struct iovec *iov, int n)
+{
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+/**
+ * @brief Marks the segments holding the next n bytes as read by the
+ * kernel until the MSG_ZEROCOPY send that just took them completes.
+ *
+ * @param out
+ * @param n the bytes the send accepted.
+ */
+static void output_zerocopy_sent(struct output *out, size_t n)
+{
+    struct segment *seg;
+    size_t off = out->head_off;
+
+    for (seg = out->head; seg != NULL && n > 0; seg = seg->next)
+    {
+        if (seg->len > off)
+        {
+            seg->zc_pending = 1;
+            seg->zc_seq = out->zc_next;
+            n -= seg->len - off < n ? seg->len - off : n;
+        }
+        off = 0;
+    }
+
+    // Every successful MSG_ZEROCOPY send takes the next number, even a partial one.
+    out->zc_next++;
+}
+
+/**
+ * @brief Writes as much of the output as the socket accepts.
+ *
+ * All pending segments (up to OUTPUT_MAX_IOV) go out in a single
+ * sendmsg(), up to the next file segment, which is then sent with
+ * sendfile(). If the kernel takes only part of them, the position is
+ * remembered and the next call, typically on EPOLLOUT, resumes from
+ * there.
+ *
+ * @param out
+ * @param fd
+ * @return 1 when everything has been written, 0 if the socket is full
+ * and we must wait for EPOLLOUT, -1 on error.
+ */
+int output_flush(struct output *out, int fd)
+{
+    struct iovec iov[OUTPUT_MAX_IOV];
+    struct msghdr msg;
+    ssize_t n;
+
+    while (out->bytes > 0)
+    {
+        // Drop any empty segments so the head is the next byte to send.
+        output_advance(out, 0);
+
+        if (out->head->fd >= 0)
+        {
+            n = output_sendfile(out, fd);
+        }
+        else
+        {
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = output_iov(out, iov, OUTPUT_MAX_IOV);
+
+            // MSG_NOSIGNAL: report EPIPE instead of raising SIGPIPE.
+            if (out->zerocopy_min > 0 && output_iov_len(iov, msg.msg_iovlen) >= out->zerocopy_min)
+            {
+                n = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_ZEROCOPY);
+                if (n >= 0)
+                {
+                    output_zerocopy_sent(out, n);
+                    output_advance(out, n);
+                    continue;
+                }
+                if (errno == ENOBUFS)
+                {
+                    // Over the limit on pinned memory: copy this time.
+                    n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+                }
+            }
+            else
+            {
+                n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+            }
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            return -1;
+        }
+        output_advance(out, n);
+    }
+
+    // Release empty segments left at the head (e.g. zero-length bodies).
+    output_advance(out, 0);
+    return 1;
+}
+
+/**
+ * @brief Lets large writes to a socket use MSG_ZEROCOPY.
+ *
+ * Rather than copying the bytes into the socket buffer, the kernel
+ * then sends straight from our memory, and tells us on the socket's
+ * error queue once it no longer needs it. Setting that up costs more
+ * than copying a few kilobytes, so only sends of at least min bytes
+ * use it. Whoever watches the socket must call output_reap() when it
+ * reports EPOLLERR, which is how the kernel signals the error queue.
+ *
+ * @param out
+ * @param fd the socket.
+ * @param min the smallest send to use it for.
+ * @return 0 on success, -1 if the kernel does not support it (the
+ * output then keeps copying).
+ */
+int output_zerocopy(struct output *out, int fd, size_t min)
+{
+    int one = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0)
+    {
+        return -1;
+    }
+    out->zerocopy_min = min;
+    return 0;
+}
+
+/**
+ * @brief Handles EPOLLERR on a socket: releases the segments that
+ * finished MSG_ZEROCOPY sends were holding, and checks for a real
+ * error.
+ *
+ * TCP completes sends in order, so each notification, which covers a
+ * range of sequence numbers, means every send up to the end of the
+ * range is done. If the kernel reports that it had to copy the bytes
+ * after all (as it does over loopback), the socket stops using
+ * MSG_ZEROCOPY, which then only costs extra work.
+ *
+ * @param out
+ * @param fd the socket.
+ * @return 0 if only completions were pending, -1 if the socket has
+ * failed.
+ */
+int output_reap(struct output *out, int fd)
+{
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *err;
+    struct segment *seg;
+    uint32_t done;
+    socklen_t len;
+    int soerr = 0;
+
+    if (out->zc_next == 0)
+    {
+        // Never used MSG_ZEROCOPY, so the error is real.
+        return -1;
+    }
+
+    for (;;)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+            {
+                continue;
+            }
+            err = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0)
+            {
+                return -1;
+            }
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            {
+                out->zerocopy_min = 0;
+            }
+
+            // Sends ee_info to ee_data are done, and so is everything before them.
+            done = err->ee_data + 1;
+            if ((int32_t) (done - out->zc_done) > 0)
+            {
+                out->zc_done = done;
+            }
+            while (out->held_head != NULL && (int32_t) (out->held_head->zc_seq - out->zc_done) < 0)
+            {
+                seg = out->held_head;
+                out->held_head = seg->next;
+                if (out->held_head == NULL)
+                {
+                    out->held_tail = NULL;
+                }
+                segment_free(seg);
+            }
+        }
+    }
+
+    len = sizeof(soerr);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &soerr, &len) < 0 || soerr != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Drops everything still queued, e.g. when the connection closes.
+ *
+ * Held segments must no longer be in use by the kernel: the socket
+ * either never used MSG_ZEROCOPY or has been closed with
+ * output_close().
+ *
+ * @param out
+ */
+void output_clear(struct output *out)
+{
+    struct segment *seg = out->head;
+    struct segment *next;
+
+    while (seg != NULL)
+    {
+        next = seg->next;
+        segment_free(seg);
+        seg = next;
+    }
+    for (seg = out->held_head; seg != NULL; seg = next)
+    {
+        next = seg->next;
+        segment_free(seg);
+    }
+    memset(out, 0, sizeof(*out));
+}
+
+/**
+ * @brief Closes the socket and drops everything still queued.
+ *
+ * While MSG_ZEROCOPY sends are in flight the kernel keeps sending
+ * from our memory after an ordinary close(), and a block reused for
+ * another connection would put that connection's bytes on this one's
+ * wire. Such a socket is therefore reset instead (SO_LINGER with a
+ * zero timeout), which discards its send queue before close()
+ * returns. Only a connection being dropped can still have held
+ * segments, so nothing its peer was meant to get is lost.
+ *
+ * @param out
+ * @param fd the socket.
+ */
+void output_close(struct output *out, int fd)
+{
+    struct linger linger = { 1, 0 };
+
+    if (out->held_head != NULL)
+    {
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    }
+    close(fd);
+    output_clear(out);
+}
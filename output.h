@@ -0,0 +1,95 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// The most segments handed to the kernel in one writev()/sendmsg().
+#define OUTPUT_MAX_IOV 64
+
+/*
+    One piece of a response. A segment either refers to memory owned
+    by someone else (a constant, a cached body) or owns a block from
+    the buffer pool that bytes were written into. Either way it is
+    sent straight from where it lives; nothing is concatenated.
+
+    A segment can also stand for part of an open file, in which case
+    it has no data at all: the kernel sends it with sendfile() from
+    the page cache, without the bytes ever entering user space.
+*/
+struct segment
+{
+    struct segment *next;
+    const char *data;
+    size_t len;
+
+    // Set for segments that own a pool block.
+    char *block;
+    size_t cap;
+
+    // For file segments, the file and where in it to start; fd is -1 otherwise.
+    int fd;
+    off_t offset;
+
+    // Called once the segment has been sent or dropped, if set.
+    void (*release)(void *ctx);
+    void *ctx;
+
+    /*
+        Set once part of the segment has gone out with MSG_ZEROCOPY.
+        The kernel then reads the memory until the send with sequence
+        number zc_seq (the last that used it) is reported complete.
+    */
+    int zc_pending;
+    uint32_t zc_seq;
+};
+
+/*
+    The bytes waiting to be written to a connection, as a chain of
+    segments in the order they must go out.
+*/
+struct output
+{
+    struct segment *head;
+    struct segment *tail;
+
+    // How much of the head segment has already been written.
+    size_t head_off;
+
+    // Total bytes still to be written.
+    size_t bytes;
+
+    /*
+        MSG_ZEROCOPY (see output_zerocopy()): sends of at least
+        zerocopy_min bytes use it, 0 for none. zc_next is the sequence
+        number the kernel gives the next such send, and every send
+        before zc_done has been reported complete. Segments that have
+        been written but that the kernel may still be reading are held
+        back, oldest first, until it says it is done.
+    */
+    size_t zerocopy_min;
+    uint32_t zc_next;
+    uint32_t zc_done;
+    struct segment *held_head;
+    struct segment *held_tail;
+};
+
+int output_append_ref(struct output *out, const char *data, size_t len,
+                      void (*release)(void *ctx), void *ctx);
+char *output_reserve(struct output *out, size_t len);
+void output_commit(struct output *out, size_t len);
+int output_append_copy(struct output *out, const char *data, size_t len);
+int output_append_file(struct output *out, int fd, off_t offset, size_t len,
+                       void (*release)(void *ctx), void *ctx);
+
+int output_iov(const struct output *out, struct iovec *iov, int max);
+void output_advance(struct output *out, size_t n);
+int output_flush(struct output *out, int fd);
+int output_zerocopy(struct output *out, int fd, size_t min);
+int output_reap(struct output *out, int fd);
+void output_clear(struct output *out);
+void output_close(struct output *out, int fd);
+
+#endif
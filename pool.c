@@ -0,0 +1,444 @@
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdlib.h>
+
+#include "pool.h"
+#include "reactor.h"
+
+/*
+    A pool of threads for handlers that compute rather than wait.
+
+    Each pool thread owns a Chase-Lev deque: it pushes and takes
+    tasks at the bottom without contention, while idle threads steal
+    from the top. Reactors cannot push onto a deque they do not own,
+    so each pool thread also has an inbox (a lock-free MPSC queue)
+    that reactors submit to, round robin; the owner moves its inbox
+    into its deque, where the others can steal from it. A thread
+    handed a burst of slow tasks therefore keeps only its share.
+
+    Threads with nothing to do sleep on a semaphore and are woken by
+    whoever gives them work.
+*/
+
+#define POOL_CACHE_LINE 64
+
+// Attempts to steal from each of the other threads before sleeping.
+#define POOL_STEAL_ROUNDS 2
+
+struct deque
+{
+    long top __attribute__((aligned(POOL_CACHE_LINE)));
+    long bottom __attribute__((aligned(POOL_CACHE_LINE)));
+    struct task *tasks[POOL_DEQUE_SIZE];
+};
+
+struct pool_thread
+{
+    struct deque deque;
+    struct mpsc_queue inbox;
+
+    // Set while the thread is asleep or about to be.
+    int sleeping __attribute__((aligned(POOL_CACHE_LINE)));
+    sem_t wakeup;
+
+    struct pool *pool;
+    pthread_t thread;
+    unsigned int seed;
+};
+
+struct pool
+{
+    int nthreads;
+    struct pool_thread *threads;
+
+    // Set if the pool could not be started, telling the threads that were to exit.
+    int aborted;
+};
+
+// Where the calling reactor thread submits next.
+static __thread unsigned int next_thread;
+
+/**
+ * @brief Pushes a task at the bottom of the owner's deque.
+ *
+ * @param d
+ * @param task
+ * @return 0 on success, -1 if the deque is full.
+ */
+static int deque_push(struct deque *d, struct task *task)
+{
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+
+    if (b - t >= POOL_DEQUE_SIZE)
+    {
+        return -1;
+    }
+    __atomic_store_n(&d->tasks[b & (POOL_DEQUE_SIZE - 1)], task, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * @brief Takes the most recently pushed task; owner only.
+ *
+ * Only when a single task is left can the owner race with a thief,
+ * and the compare-and-swap on top decides who gets it.
+ *
+ * @param d
+ * @return the task, or NULL if the deque is empty.
+ */
+static struct task *deque_take(struct deque *d)
+{
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    long t;
+    struct task *task;
+
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    if (t > b)
+    {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    task = __atomic_load_n(&d->tasks[b & (POOL_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (t == b)
+    {
+        if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            task = NULL;
+        }
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+/**
+ * @brief Takes the oldest task from another thread's deque.
+ *
+ * @param d
+ * @return the task, or NULL if the deque is empty or another thread
+ * took it first.
+ */
+static struct task *deque_steal(struct deque *d)
+{
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    long b;
+    struct task *task;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+    {
+        return NULL;
+    }
+
+    task = __atomic_load_n(&d->tasks[t & (POOL_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    {
+        return NULL;
+    }
+    return task;
+}
+
+/**
+ * @brief Wakes a pool thread if it is asleep.
+ *
+ * @param pt
+ */
+static void pool_wake(struct pool_thread *pt)
+{
+    if (__atomic_exchange_n(&pt->sleeping, 0, __ATOMIC_SEQ_CST))
+    {
+        sem_post(&pt->wakeup);
+    }
+}
+
+/**
+ * @brief Wakes one sleeping thread other than pt so it can steal.
+ *
+ * @param pt
+ */
+static void pool_wake_thief(struct pool_thread *pt)
+{
+    struct pool *pool = pt->pool;
+    int i;
+
+    for (i = 0; i < pool->nthreads; i++)
+    {
+        if (&pool->threads[i] != pt && __atomic_load_n(&pool->threads[i].sleeping, __ATOMIC_RELAXED))
+        {
+            pool_wake(&pool->threads[i]);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Runs a task and hands it back to its reactor.
+ *
+ * @param task
+ */
+static void pool_run_task(struct task *task)
+{
+    task->run(task);
+    reactor_post(task->reactor, task);
+}
+
+/**
+ * @brief Moves the inbox into the deque.
+ *
+ * @param pt
+ * @return the number of tasks moved.
+ */
+static int pool_drain_inbox(struct pool_thread *pt)
+{
+    struct mpsc_node *node;
+    int moved = 0;
+
+    while ((node = mpsc_pop(&pt->inbox)) != NULL)
+    {
+        if (deque_push(&pt->deque, (struct task *) node) < 0)
+        {
+            pool_run_task((struct task *) node);
+            continue;
+        }
+        moved++;
+    }
+    return moved;
+}
+
+/**
+ * @brief Looks for a task in the other threads' deques, starting at
+ * a random one so thieves spread out.
+ *
+ * @param pt
+ * @return the task, or NULL if none was found.
+ */
+static struct task *pool_steal(struct pool_thread *pt)
+{
+    struct pool *pool = pt->pool;
+    struct task *task;
+    int start, i, round;
+
+    if (pool->nthreads < 2)
+    {
+        return NULL;
+    }
+
+    start = rand_r(&pt->seed) % pool->nthreads;
+    for (round = 0; round < POOL_STEAL_ROUNDS; round++)
+    {
+        for (i = 0; i < pool->nthreads; i++)
+        {
+            struct pool_thread *victim = &pool->threads[(start + i) % pool->nthreads];
+
+            if (victim == pt)
+            {
+                continue;
+            }
+            task = deque_steal(&victim->deque);
+            if (task != NULL)
+            {
+                return task;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Finds the next task for a pool thread: its own deque first,
+ * then its inbox, then the other threads.
+ *
+ * @param pt
+ * @return the task, or NULL if there is nothing to do anywhere.
+ */
+static struct task *pool_find_task(struct pool_thread *pt)
+{
+    struct task *task;
+
+    task = deque_take(&pt->deque);
+    if (task != NULL)
+    {
+        return task;
+    }
+
+    if (pool_drain_inbox(pt) > 1)
+    {
+        // More than we can run at once: let an idle thread share them.
+        pool_wake_thief(pt);
+    }
+    task = deque_take(&pt->deque);
+    if (task != NULL)
+    {
+        return task;
+    }
+
+    return pool_steal(pt);
+}
+
+/**
+ * @brief The body of a pool thread.
+ *
+ * @param arg the thread's struct pool_thread.
+ * @return only if the pool could not be started.
+ */
+static void *pool_thread_run(void *arg)
+{
+    struct pool_thread *pt = arg;
+    struct task *task;
+
+    // Wait until every thread has started, or the pool is given up.
+    while (sem_wait(&pt->wakeup) < 0 && errno == EINTR)
+    {
+    }
+    if (pt->pool->aborted)
+    {
+        return NULL;
+    }
+
+    for (;;)
+    {
+        task = pool_find_task(pt);
+        if (task != NULL)
+        {
+            pool_run_task(task);
+            continue;
+        }
+
+        /*
+            Announce that we are going to sleep, then look once more.
+            A submitter pushes first and checks the flag second, so
+            either we see its task here or it sees the flag and posts
+            the semaphore.
+        */
+        __atomic_store_n(&pt->sleeping, 1, __ATOMIC_SEQ_CST);
+        task = pool_find_task(pt);
+        if (task != NULL)
+        {
+            __atomic_store_n(&pt->sleeping, 0, __ATOMIC_SEQ_CST);
+            pool_run_task(task);
+            continue;
+        }
+        while (sem_wait(&pt->wakeup) < 0 && errno == EINTR)
+        {
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Frees a pool none of whose threads is running.
+ *
+ * @param pool
+ */
+static void pool_free(struct pool *pool)
+{
+    int i;
+
+    for (i = 0; i < pool->nthreads; i++)
+    {
+        sem_destroy(&pool->threads[i].wakeup);
+    }
+    free(pool->threads);
+    free(pool);
+}
+
+/**
+ * @brief Starts a pool of threads.
+ *
+ * The threads are held at a gate until all of them exist. If one
+ * cannot be created, the ones that were are let through only to
+ * exit, and are joined before the pool is freed, so nothing is left
+ * running on memory the caller never sees.
+ *
+ * @param threads
+ * @return the pool, or NULL on failure.
+ */
+struct pool *pool_create(int threads)
+{
+    struct pool *pool;
+    int started;
+    int err = 0;
+    int i;
+
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    if (posix_memalign((void **) &pool->threads, POOL_CACHE_LINE, threads * sizeof(*pool->threads)) != 0)
+    {
+        free(pool);
+        return NULL;
+    }
+
+    pool->nthreads = threads;
+    for (i = 0; i < threads; i++)
+    {
+        struct pool_thread *pt = &pool->threads[i];
+
+        pt->deque.top = 0;
+        pt->deque.bottom = 0;
+        mpsc_init(&pt->inbox);
+        pt->sleeping = 0;
+        sem_init(&pt->wakeup, 0, 0);
+        pt->pool = pool;
+        pt->seed = i + 1;
+    }
+
+    // Only start threads once every deque they might steal from exists.
+    for (started = 0; started < threads; started++)
+    {
+        err = pthread_create(&pool->threads[started].thread, NULL, pool_thread_run, &pool->threads[started]);
+        if (err != 0)
+        {
+            break;
+        }
+    }
+
+    // The semaphore that opens the gate also publishes aborted to each thread.
+    pool->aborted = started < threads;
+    for (i = 0; i < started; i++)
+    {
+        sem_post(&pool->threads[i].wakeup);
+        if (pool->aborted)
+        {
+            pthread_join(pool->threads[i].thread, NULL);
+        }
+        else
+        {
+            pthread_detach(pool->threads[i].thread);
+        }
+    }
+    if (pool->aborted)
+    {
+        pool_free(pool);
+        errno = err;
+        return NULL;
+    }
+    return pool;
+}
+
+/**
+ * @brief Hands a task to the pool. Called from reactor threads.
+ *
+ * task->reactor must be set: complete() is run there once the task
+ * has been run.
+ *
+ * @param pool
+ * @param task
+ */
+void pool_submit(struct pool *pool, struct task *task)
+{
+    struct pool_thread *pt = &pool->threads[next_thread++ % pool->nthreads];
+
+    mpsc_push(&pt->inbox, &task->node);
+    pool_wake(pt);
+}
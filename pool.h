@@ -0,0 +1,18 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "task.h"
+
+/*
+    Work-stealing deque size per pool thread. Must be a power of two;
+    tasks that do not fit are run straight away by the thread that
+    holds them.
+*/
+#define POOL_DEQUE_SIZE 4096
+
+struct pool;
+
+struct pool *pool_create(int threads);
+void pool_submit(struct pool *pool, struct task *task);
+
+#endif
@@ -0,0 +1,1266 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "buffer.h"
+#include "coroutine.h"
+#include "http.h"
+#include "metrics.h"
+#include "output.h"
+#include "proxy.h"
+#include "timer_wheel.h"
+
+/*
+    Reverse proxy mode: every HTTP request from a client is forwarded
+    to one of the upstream servers (backends), and its response
+    forwarded back.
+
+    Only the header blocks pass through our buffers, since they have
+    to be parsed to know where each message ends. Bodies are moved
+    between the two sockets with splice() through a pipe that belongs
+    to the connection: the kernel hands the pages from one socket to
+    the pipe and from the pipe to the other socket, so forwarded
+    bodies never enter user space. (Body bytes that arrived in the
+    same read as a header block are the exception; they are written
+    from the buffer.)
+
+    Connections to the backends are not tied to clients. Each worker
+    keeps a pool of idle keep-alive connections per backend, takes
+    one for every request and puts it back once the response has been
+    relayed, so a busy proxy rarely pays for a handshake. A pooled
+    connection the server has closed meanwhile shows up as a failure
+    before any response; a request that is still entirely in our
+    buffer is then sent again over a new connection.
+
+    The backend is picked per request, either the one with the fewest
+    requests outstanding across all workers, or by consistent hashing
+    of the request target so each backend sees a stable share of the
+    URLs (and keeps its caches warm) even as backends come and go.
+    Health is checked passively: a backend that fails several
+    requests in a row is left out for a while, then given another
+    chance. If every backend is out, they are all tried regardless.
+
+    Requests from one client are forwarded one at a time in the order
+    they arrive, so pipelined requests are answered in order.
+*/
+
+// The remaining length of a body that runs until the upstream closes.
+#define PROXY_UNTIL_EOF SIZE_MAX
+
+// A connection to a backend.
+struct upstream
+{
+    // Must stay first: the upstream socket, watched by the reactor.
+    struct event_source source;
+
+    struct backend *backend;
+
+    // The client it is serving, or NULL while pooled.
+    struct proxy *proxy;
+
+    // Links it into its worker's pool, and since when it has been there.
+    struct upstream *next;
+    uint64_t idle_since;
+};
+
+/*
+    A backend, shared by every worker. Its counters and health are
+    updated with atomics.
+*/
+struct backend
+{
+    char name[64];
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+
+    // Consecutive failures, and the reactor clock time its ejection ends.
+    int failures;
+    uint64_t ejected_until;
+
+    struct proxy_backend_stats stats;
+};
+
+// A point on the consistent hash ring.
+struct ring_point
+{
+    uint32_t hash;
+    int backend;
+};
+
+struct proxy
+{
+    // Must stay first: the client socket, watched by the reactor.
+    struct event_source source;
+
+    struct reactor *reactor;
+    const struct config *config;
+
+    // The connection serving the current request, if any.
+    struct upstream *up;
+
+    // Request bytes from the client, and response header blocks for it.
+    struct buffer in;
+    struct output out;
+    int eof;
+
+    // Response bytes from the upstream, and request header blocks for it.
+    struct buffer up_in;
+    struct output up_out;
+    int up_eof;
+
+    /*
+        The pipe bodies go through, created when the first body needs
+        it. piped is how much it holds, remaining how much of the body
+        being forwarded has yet to be taken from its sender.
+    */
+    int pipe[2];
+    size_t piped;
+    size_t remaining;
+
+    /*
+        The request being forwarded. Its first request_len bytes, the
+        header block and as much of the body as came with it, stay in
+        the input buffer until the response arrives, so the request
+        can be sent again if it is all there (replayable).
+    */
+    size_t request_len;
+    int replayable;
+    int retried;
+
+    // The backend it went to, and whether over a pooled connection.
+    int backend;
+    int reused;
+
+    int keep_alive;
+    int head;
+    size_t scanned;
+    uint32_t hash;
+    uint64_t wait_start;
+
+    // When the request's header block was complete, and when the connection was accepted (metrics_now()).
+    uint64_t start;
+    uint64_t opened;
+
+    // Set while waiting for the client's next request.
+    int idle;
+
+    uint64_t deadline;
+    struct timer timer;
+
+    // proxy_serve() keeps its state in the fields above.
+    struct coroutine co;
+    int status;
+    int failed;
+};
+
+static struct backend backends[PROXY_MAX_BACKENDS];
+static int nbackends;
+static struct ring_point ring[PROXY_MAX_BACKENDS * PROXY_RING_REPLICAS];
+static int nring;
+
+// Each worker's idle connections, per backend, most recently used first.
+static __thread struct upstream *pool[PROXY_MAX_BACKENDS];
+static __thread int pooled[PROXY_MAX_BACKENDS];
+
+// Where each worker starts looking for the least loaded backend, so ties are spread.
+static __thread unsigned int next_backend;
+
+// Filled in by the parser; only valid until the coroutine next suspends.
+static __thread struct http_request request;
+static __thread struct http_response response;
+
+static void proxy_on_event(struct reactor *reactor, struct event_source *source, uint32_t events);
+static void proxy_on_upstream_event(struct reactor *reactor, struct event_source *source, uint32_t events);
+static void proxy_on_timeout(struct timer *timer);
+static void proxy_schedule(struct proxy *p);
+
+static uint32_t proxy_hash(const char *data, size_t len)
+{
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        h ^= (unsigned char) data[i];
+        h *= 16777619u;
+    }
+    // FNV mixes its last bytes poorly; finish with a few more rounds of mixing.
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
+
+static int proxy_ring_compare(const void *a, const void *b)
+{
+    const struct ring_point *x = a;
+    const struct ring_point *y = b;
+
+    return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+/**
+ * @brief Resolves one backend's address.
+ *
+ * @param b
+ * @param target "host:port".
+ * @param len
+ * @return 0 on success, -1 if it cannot be resolved.
+ */
+static int proxy_resolve(struct backend *b, const char *target, size_t len)
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+    char host[256];
+    const char *colon;
+
+    if (len >= sizeof(b->name))
+    {
+        return -1;
+    }
+    memcpy(b->name, target, len);
+    b->name[len] = '\0';
+    b->stats.name = b->name;
+
+    colon = strrchr(b->name, ':');
+    if (colon == NULL || colon == b->name || (size_t) (colon - b->name) >= sizeof(host))
+    {
+        return -1;
+    }
+    memcpy(host, b->name, colon - b->name);
+    host[colon - b->name] = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0)
+    {
+        return -1;
+    }
+    memcpy(&b->addr, res->ai_addr, res->ai_addrlen);
+    b->addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+/**
+ * @brief Resolves the backends' addresses and builds the hash ring.
+ *
+ * @param targets "host:port", or several separated by commas.
+ * @return 0 on success, -1 if one cannot be resolved or there are too many.
+ */
+int proxy_init(const char *targets)
+{
+    const char *p = targets;
+    const char *comma;
+    char point[80];
+    int i, r, n;
+
+    for (;;)
+    {
+        comma = strchr(p, ',');
+        if (nbackends == PROXY_MAX_BACKENDS ||
+            proxy_resolve(&backends[nbackends], p, comma != NULL ? (size_t) (comma - p) : strlen(p)) < 0)
+        {
+            return -1;
+        }
+        nbackends++;
+        if (comma == NULL)
+        {
+            break;
+        }
+        p = comma + 1;
+    }
+
+    for (i = 0; i < nbackends; i++)
+    {
+        for (r = 0; r < PROXY_RING_REPLICAS; r++)
+        {
+            n = snprintf(point, sizeof(point), "%s#%d", backends[i].name, r);
+            ring[nring].hash = proxy_hash(point, n);
+            ring[nring].backend = i;
+            nring++;
+        }
+    }
+    qsort(ring, nring, sizeof(ring[0]), proxy_ring_compare);
+    return 0;
+}
+
+/**
+ * @brief Copies every backend's counters.
+ *
+ * @param stats
+ * @param max the size of stats.
+ * @return the number of backends filled in.
+ */
+int proxy_snapshot(struct proxy_backend_stats *stats, int max)
+{
+    struct proxy_backend_stats *s;
+    struct timespec ts;
+    uint64_t now;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    for (i = 0; i < nbackends && i < max; i++)
+    {
+        s = &backends[i].stats;
+        stats[i].name = s->name;
+        stats[i].requests = __atomic_load_n(&s->requests, __ATOMIC_RELAXED);
+        stats[i].pool_hits = __atomic_load_n(&s->pool_hits, __ATOMIC_RELAXED);
+        stats[i].connects = __atomic_load_n(&s->connects, __ATOMIC_RELAXED);
+        stats[i].wait_ms = __atomic_load_n(&s->wait_ms, __ATOMIC_RELAXED);
+        stats[i].failures = __atomic_load_n(&s->failures, __ATOMIC_RELAXED);
+        stats[i].ejections = __atomic_load_n(&s->ejections, __ATOMIC_RELAXED);
+        stats[i].outstanding = __atomic_load_n(&s->outstanding, __ATOMIC_RELAXED);
+        stats[i].ejected = __atomic_load_n(&backends[i].ejected_until, __ATOMIC_RELAXED) > now;
+    }
+    return i;
+}
+
+/**
+ * @brief Wraps an accepted client socket and registers it with the
+ * reactor.
+ *
+ * @param reactor
+ * @param fd
+ * @param config
+ * @return the proxy connection, or NULL if it could not be set up
+ * (in which case fd has been closed).
+ */
+struct proxy *proxy_open(struct reactor *reactor, int fd, const struct config *config)
+{
+    struct proxy *p;
+
+    p = calloc(1, sizeof(*p));
+    if (p == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    p->source.fd = fd;
+    p->source.on_event = proxy_on_event;
+    p->reactor = reactor;
+    p->config = config;
+    p->pipe[0] = -1;
+    p->pipe[1] = -1;
+    timer_init(&p->timer, proxy_on_timeout, p);
+
+    if (reactor_add(reactor, &p->source, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) < 0)
+    {
+        close(fd);
+        free(p);
+        return NULL;
+    }
+
+    reactor->connections++;
+    p->opened = metrics_now();
+    metrics_count(METRIC_ACCEPTED, 1);
+    proxy_schedule(p);
+    return p;
+}
+
+/**
+ * @brief Counts a request a backend failed, and ejects it after too
+ * many in a row.
+ *
+ * @param p
+ * @param b
+ */
+static void proxy_failed(struct proxy *p, struct backend *b)
+{
+    __atomic_add_fetch(&b->stats.failures, 1, __ATOMIC_RELAXED);
+    if (__atomic_add_fetch(&b->failures, 1, __ATOMIC_RELAXED) != PROXY_EJECT_FAILURES)
+    {
+        return;
+    }
+    // Only the worker that reached the limit ejects it; the count restarts for the next chance.
+    __atomic_store_n(&b->failures, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->ejected_until, p->reactor->now + PROXY_EJECT_MS, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&b->stats.ejections, 1, __ATOMIC_RELAXED);
+    fprintf(stderr, "WARNING upstream %s ejected after %d failures, for %d ms\n",
+            b->name, PROXY_EJECT_FAILURES, PROXY_EJECT_MS);
+}
+
+/**
+ * @brief Picks the backend for a request.
+ *
+ * @param p
+ * @param avoid a backend not to pick if there is another, or -1.
+ * @return its index.
+ */
+static int proxy_pick(struct proxy *p, int avoid)
+{
+    uint64_t now = p->reactor->now;
+    long least = 0;
+    long outstanding;
+    int panic, best, i, b, lo, hi, mid;
+
+    // With every backend out (or the only other one to avoid), ejections are ignored.
+    panic = 1;
+    for (i = 0; i < nbackends && panic; i++)
+    {
+        panic = i == avoid || __atomic_load_n(&backends[i].ejected_until, __ATOMIC_RELAXED) > now;
+    }
+
+    if (p->config->balance == BALANCE_HASH)
+    {
+        // The first point clockwise from the request's hash, wrapping around.
+        lo = 0;
+        hi = nring;
+        while (lo < hi)
+        {
+            mid = lo + (hi - lo) / 2;
+            if (ring[mid].hash < p->hash)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        for (i = 0; i < nring; i++)
+        {
+            b = ring[(lo + i) % nring].backend;
+            if (panic || (b != avoid && __atomic_load_n(&backends[b].ejected_until, __ATOMIC_RELAXED) <= now))
+            {
+                return b;
+            }
+        }
+        return ring[lo % nring].backend;
+    }
+
+    best = -1;
+    for (i = 0; i < nbackends; i++)
+    {
+        b = (next_backend + i) % nbackends;
+        if (!panic && (b == avoid || __atomic_load_n(&backends[b].ejected_until, __ATOMIC_RELAXED) > now))
+        {
+            continue;
+        }
+        outstanding = __atomic_load_n(&backends[b].stats.outstanding, __ATOMIC_RELAXED);
+        if (best < 0 || outstanding < least)
+        {
+            best = b;
+            least = outstanding;
+        }
+    }
+    next_backend++;
+    return best;
+}
+
+/**
+ * @brief Closes a connection to a backend.
+ *
+ * @param reactor
+ * @param up
+ */
+static void proxy_upstream_close(struct reactor *reactor, struct upstream *up)
+{
+    // close() also removes the descriptor from the epoll set.
+    close(up->source.fd);
+    up->source.fd = -1;
+    reactor_free(reactor, &up->source);
+}
+
+/**
+ * @brief Takes a pooled connection out of its pool.
+ *
+ * @param up
+ */
+static void proxy_pool_remove(struct upstream *up)
+{
+    int b = up->backend - backends;
+    struct upstream **link = &pool[b];
+
+    while (*link != up)
+    {
+        link = &(*link)->next;
+    }
+    *link = up->next;
+    pooled[b]--;
+}
+
+/**
+ * @brief Opens a non-blocking connection to a backend.
+ *
+ * The connection completes in the background; writing the request
+ * waits for it like for any full socket buffer.
+ *
+ * @param p
+ * @param b
+ * @return the connection, or NULL if none can be started.
+ */
+static struct upstream *proxy_connect(struct proxy *p, struct backend *b)
+{
+    struct upstream *up;
+    int one = 1;
+    int fd;
+
+    __atomic_add_fetch(&b->stats.connects, 1, __ATOMIC_RELAXED);
+    fd = socket(b->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr *) &b->addr, b->addrlen) < 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    up = calloc(1, sizeof(*up));
+    if (up == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    up->source.fd = fd;
+    up->source.on_event = proxy_on_upstream_event;
+    up->backend = b;
+    if (reactor_add(p->reactor, &up->source, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) < 0)
+    {
+        close(fd);
+        free(up);
+        return NULL;
+    }
+    return up;
+}
+
+/**
+ * @brief Gets a connection for the request about to be forwarded:
+ * the most recently used one in the pool of the backend picked, or a
+ * new one.
+ *
+ * @param p
+ * @param avoid a backend not to use if there is another, or -1.
+ * @return 0 on success, -1 if no connection can be started (counted
+ * against the backend).
+ */
+static int proxy_checkout(struct proxy *p, int avoid)
+{
+    int b = proxy_pick(p, avoid);
+    struct backend *backend = &backends[b];
+    struct upstream *up = pool[b];
+
+    __atomic_add_fetch(&backend->stats.requests, 1, __ATOMIC_RELAXED);
+    p->backend = b;
+    p->wait_start = p->reactor->now;
+
+    /*
+        The pool is in order of last use, so once one connection has
+        been idle too long, so have all below it.
+    */
+    if (up != NULL && p->reactor->now - up->idle_since > PROXY_POOL_IDLE_MS)
+    {
+        while (up != NULL)
+        {
+            pool[b] = up->next;
+            proxy_upstream_close(p->reactor, up);
+            up = pool[b];
+        }
+        pooled[b] = 0;
+    }
+
+    if (up != NULL)
+    {
+        pool[b] = up->next;
+        pooled[b]--;
+        __atomic_add_fetch(&backend->stats.pool_hits, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        up = proxy_connect(p, backend);
+        if (up == NULL)
+        {
+            proxy_failed(p, backend);
+            return -1;
+        }
+    }
+
+    up->proxy = p;
+    up->next = NULL;
+    p->up = up;
+    p->reused = up->idle_since != 0;
+    __atomic_add_fetch(&backend->stats.outstanding, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * @brief Is done with the connection to the backend: puts it back in
+ * the pool if it can serve another request, or closes it.
+ *
+ * @param p
+ * @param reuse whether the exchange on it ended cleanly.
+ */
+static void proxy_release(struct proxy *p, int reuse)
+{
+    struct upstream *up = p->up;
+    int b;
+
+    if (up == NULL)
+    {
+        return;
+    }
+    b = up->backend - backends;
+    __atomic_sub_fetch(&up->backend->stats.outstanding, 1, __ATOMIC_RELAXED);
+
+    // Closing, or out of step with us, are reasons not to reuse it either.
+    if (reuse && !p->up_eof && buffer_len(&p->up_in) == 0 && pooled[b] < PROXY_POOL_MAX)
+    {
+        up->proxy = NULL;
+        up->idle_since = p->reactor->now;
+        up->next = pool[b];
+        pool[b] = up;
+        pooled[b]++;
+    }
+    else
+    {
+        proxy_upstream_close(p->reactor, up);
+    }
+    p->up = NULL;
+
+    buffer_release(&p->up_in);
+    output_clear(&p->up_out);
+    p->up_eof = 0;
+}
+
+/**
+ * @brief Closes the client connection and everything that goes with it.
+ *
+ * @param p
+ */
+static void proxy_close(struct proxy *p)
+{
+    struct reactor *reactor = p->reactor;
+
+    proxy_release(p, 0);
+    close(p->source.fd);
+    reactor->connections--;
+    metrics_count(METRIC_CLOSED, 1);
+    reactor_timer_cancel(reactor, &p->timer);
+    buffer_release(&p->in);
+    output_clear(&p->out);
+    if (p->pipe[0] >= 0)
+    {
+        close(p->pipe[0]);
+        close(p->pipe[1]);
+    }
+
+    // The reactor skips any events for it still to come in this batch.
+    p->source.fd = -1;
+    reactor_free(reactor, &p->source);
+}
+
+/**
+ * @brief Reads what a socket has into a buffer.
+ *
+ * @param fd
+ * @param buf
+ * @param limit how large the buffer may grow.
+ * @param eof set when the peer has closed its end.
+ * @return 0 on success, -1 if the socket failed.
+ */
+static int proxy_fill(int fd, struct buffer *buf, size_t limit, int *eof)
+{
+    ssize_t n;
+
+    while (!*eof && buffer_reserve(buf, 1, limit) == 0)
+    {
+        n = read(fd, buf->data + buf->end, buf->cap - buf->end);
+        if (n == 0)
+        {
+            *eof = 1;
+            break;
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        buf->end += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Waits for the header block of the client's next request.
+ *
+ * @param p
+ * @return its length, 0 if more input is needed, -1 if the request
+ * is malformed or too large, -2 if the client has gone.
+ */
+static ssize_t proxy_read_request(struct proxy *p)
+{
+    size_t before = buffer_len(&p->in);
+    ssize_t n;
+
+    if (proxy_fill(p->source.fd, &p->in, p->config->max_frame, &p->eof) < 0)
+    {
+        metrics_count(METRIC_ERR_IO, 1);
+        return -2;
+    }
+    metrics_count(METRIC_BYTES_IN, buffer_len(&p->in) - before);
+    n = http_parse_head(p->in.data + p->in.start, buffer_len(&p->in), &p->scanned,
+                        p->config->max_frame, &request);
+    if (n == 0 && p->eof)
+    {
+        return -2;
+    }
+    return n;
+}
+
+/**
+ * @brief Reads what the upstream has sent so far and queues any
+ * interim (1xx) responses at its front for the client.
+ *
+ * @param p
+ * @return the length of the final response's header block, 0 if it
+ * has not all arrived, -1 if the upstream failed or sent something
+ * invalid.
+ */
+static ssize_t proxy_read_interim(struct proxy *p)
+{
+    ssize_t n;
+
+    if (proxy_fill(p->up->source.fd, &p->up_in, PROXY_HEAD_MAX, &p->up_eof) < 0)
+    {
+        return -1;
+    }
+    for (;;)
+    {
+        n = http_parse_response(p->up_in.data + p->up_in.start, buffer_len(&p->up_in), &p->scanned,
+                                PROXY_HEAD_MAX, &response);
+        if (n <= 0 || response.status >= 200 || response.status == 101)
+        {
+            return n;
+        }
+        if (output_append_copy(&p->out, p->up_in.data + p->up_in.start, n) < 0)
+        {
+            return -1;
+        }
+        buffer_consume(&p->up_in, n);
+    }
+}
+
+/**
+ * @brief Waits for the header block of the upstream's response.
+ *
+ * Interim (1xx) responses ahead of it are queued for the client.
+ *
+ * @param p
+ * @return its length, 0 if more input is needed, -1 if the upstream
+ * failed or sent something invalid.
+ */
+static ssize_t proxy_read_response(struct proxy *p)
+{
+    ssize_t n = proxy_read_interim(p);
+
+    if (n == 0 && p->up_eof)
+    {
+        return -1;
+    }
+    return n;
+}
+
+/**
+ * @brief Queues the bytes at the front of a buffer that belong to
+ * the body being forwarded, after its header block.
+ *
+ * @param p
+ * @param from the buffer the header block was parsed from.
+ * @param header_len
+ * @param to
+ * @return 0 on success, -1 if memory is exhausted.
+ */
+static int proxy_forward_head(struct proxy *p, struct buffer *from, size_t header_len, struct output *to)
+{
+    size_t body = buffer_len(from) - header_len;
+
+    if (body > p->remaining)
+    {
+        body = p->remaining;
+    }
+    if (output_append_copy(to, from->data + from->start, header_len + body) < 0)
+    {
+        return -1;
+    }
+    buffer_consume(from, header_len + body);
+    if (p->remaining != PROXY_UNTIL_EOF)
+    {
+        p->remaining -= body;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes what is queued for the client, counting it.
+ *
+ * @param p
+ * @return as output_flush().
+ */
+static int proxy_flush(struct proxy *p)
+{
+    size_t queued = p->out.bytes;
+    int status = output_flush(&p->out, p->source.fd);
+
+    if (queued > p->out.bytes)
+    {
+        metrics_count(METRIC_BYTES_OUT, queued - p->out.bytes);
+        if (p->opened != 0)
+        {
+            metrics_time(METRIC_FIRST_BYTE, p->opened);
+            p->opened = 0;
+        }
+    }
+    return status;
+}
+
+/**
+ * @brief Moves the rest of a body from one socket to the other
+ * through the pipe.
+ *
+ * @param p
+ * @param from
+ * @param to
+ * @return 1 once the whole body has been passed on, 0 if a socket
+ * is not ready, -1 if one failed or the sender closed too early.
+ */
+static int proxy_splice(struct proxy *p, int from, int to)
+{
+    size_t want;
+    ssize_t n;
+    int progress;
+
+    if (p->pipe[0] < 0 && (p->remaining > 0 && pipe2(p->pipe, O_NONBLOCK | O_CLOEXEC) < 0))
+    {
+        p->pipe[0] = -1;
+        return -1;
+    }
+
+    while (p->remaining > 0 || p->piped > 0)
+    {
+        progress = 0;
+        if (p->remaining > 0 && p->piped < PROXY_PIPE_SIZE)
+        {
+            want = PROXY_PIPE_SIZE - p->piped;
+            if (want > p->remaining)
+            {
+                want = p->remaining;
+            }
+            n = splice(from, NULL, p->pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0)
+            {
+                if (from == p->source.fd)
+                {
+                    metrics_count(METRIC_BYTES_IN, n);
+                }
+                p->piped += n;
+                if (p->remaining != PROXY_UNTIL_EOF)
+                {
+                    p->remaining -= n;
+                }
+                progress = 1;
+            }
+            else if (n == 0)
+            {
+                // The sender closed: the end of a body that runs until then, or a truncated one.
+                if (p->remaining != PROXY_UNTIL_EOF)
+                {
+                    return -1;
+                }
+                p->remaining = 0;
+                p->up_eof = 1;
+                progress = 1;
+            }
+            else if (errno != EAGAIN && errno != EINTR)
+            {
+                return -1;
+            }
+        }
+        if (p->piped > 0)
+        {
+            n = splice(p->pipe[0], NULL, to, NULL, p->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0)
+            {
+                if (to == p->source.fd)
+                {
+                    metrics_count(METRIC_BYTES_OUT, n);
+                }
+                p->piped -= n;
+                progress = 1;
+            }
+            else if (n < 0 && errno != EAGAIN && errno != EINTR)
+            {
+                return -1;
+            }
+        }
+        if (!progress)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Passes the rest of the request body from the client to the
+ * upstream.
+ *
+ * Meanwhile interim responses are passed on to the client as they
+ * come. A client that sent "Expect: 100-continue" waits for the
+ * upstream's 100 (Continue) before it sends the body, so that one
+ * must reach it now rather than with the final response. A final
+ * response that arrives early is left for proxy_read_response().
+ *
+ * @param p
+ * @return as proxy_splice().
+ */
+static int proxy_send_body(struct proxy *p)
+{
+    int status = proxy_splice(p, p->source.fd, p->up->source.fd);
+
+    if (status != 0)
+    {
+        return status;
+    }
+    if (proxy_read_interim(p) < 0 || (p->out.bytes > 0 && proxy_flush(p) < 0))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief The coroutine that forwards a client's requests and the
+ * upstream's responses, one exchange at a time.
+ *
+ * @param p
+ * @return CO_WAITING when it cannot go on for now, CO_DONE once the
+ * connection should be closed, CO_ERROR if it failed.
+ */
+static int proxy_serve(struct proxy *p)
+{
+    static const char bad_request[] = "Bad Request\n";
+    static const char bad_gateway[] = "Bad Gateway\n";
+    struct backend *b;
+    size_t body;
+
+    CO_BEGIN(&p->co);
+    for (;;)
+    {
+        p->idle = 1;
+        CO_AWAIT(&p->co, (p->status = proxy_read_request(p)) != 0);
+        p->idle = 0;
+        if (p->status == -2)
+        {
+            CO_EXIT(&p->co, CO_DONE);
+        }
+        if (p->status < 0)
+        {
+            metrics_count(METRIC_ERR_INVALID, 1);
+            if (http_respond(&p->out, 400, bad_request, sizeof(bad_request) - 1, 0) < 0)
+            {
+                CO_EXIT(&p->co, CO_ERROR);
+            }
+            break;
+        }
+        p->scanned = 0;
+        p->start = metrics_now();
+        p->keep_alive = request.keep_alive;
+        p->head = request.method.len == 4 && memcmp(request.method.data, "HEAD", 4) == 0;
+        p->hash = proxy_hash(request.target.data, request.target.len);
+
+        // The request's header block, and as much of its body as came with it.
+        body = buffer_len(&p->in) - p->status;
+        if (body > request.body.len)
+        {
+            body = request.body.len;
+        }
+        p->request_len = p->status + body;
+        p->remaining = request.body.len - body;
+        p->replayable = p->remaining == 0;
+        p->retried = 0;
+        p->backend = -1;
+
+        /*
+            One attempt, or two: a request that fails before any of the
+            response arrives is sent again, to another backend if there
+            is one, provided nothing has been taken from the client
+            since (a connection that could not even be opened took
+            nothing).
+        */
+        for (;;)
+        {
+            p->status = proxy_checkout(p, p->backend);
+            if (p->status == 0 &&
+                output_append_copy(&p->up_out, p->in.data + p->in.start, p->request_len) < 0)
+            {
+                CO_EXIT(&p->co, CO_ERROR);
+            }
+            if (p->status == 0)
+            {
+                CO_AWAIT(&p->co, (p->status = output_flush(&p->up_out, p->up->source.fd)) != 0);
+            }
+            if (p->status > 0)
+            {
+                b = p->up->backend;
+                __atomic_add_fetch(&b->stats.wait_ms, p->reactor->now - p->wait_start, __ATOMIC_RELAXED);
+
+                // The rest of the body, straight from the client's socket.
+                CO_AWAIT(&p->co, (p->status = proxy_send_body(p)) != 0);
+                if (p->status < 0)
+                {
+                    CO_EXIT(&p->co, CO_ERROR);
+                }
+                CO_AWAIT(&p->co, (p->status = proxy_read_response(p)) != 0);
+            }
+            if (p->status > 0)
+            {
+                break;
+            }
+
+            // A pooled connection the server had already closed is not the backend failing.
+            if (p->up != NULL && !p->reused)
+            {
+                proxy_failed(p, p->up->backend);
+            }
+            if (p->retried || (p->up != NULL && (!p->replayable || buffer_len(&p->up_in) > 0)))
+            {
+                break;
+            }
+            proxy_release(p, 0);
+            p->retried = 1;
+            p->scanned = 0;
+        }
+        if (p->status <= 0)
+        {
+            p->keep_alive = 0;
+            break;
+        }
+
+        // The request has been answered, so it will not be sent again.
+        buffer_consume(&p->in, p->request_len);
+        b = p->up->backend;
+        if (response.status >= 502 && response.status <= 504)
+        {
+            proxy_failed(p, b);
+        }
+        else if (__atomic_load_n(&b->failures, __ATOMIC_RELAXED) != 0)
+        {
+            __atomic_store_n(&b->failures, 0, __ATOMIC_RELAXED);
+        }
+
+        if (response.chunked || response.status == 101)
+        {
+            // Chunked bodies and protocol switches are not supported.
+            p->keep_alive = 0;
+            break;
+        }
+        p->scanned = 0;
+        if (p->head || response.status == 204 || response.status == 304)
+        {
+            p->remaining = 0;
+        }
+        else if (response.have_length)
+        {
+            p->remaining = response.content_length;
+        }
+        else
+        {
+            p->remaining = PROXY_UNTIL_EOF;
+            p->keep_alive = 0;
+        }
+        if (!response.keep_alive)
+        {
+            p->up_eof = 1;
+        }
+
+        if (proxy_forward_head(p, &p->up_in, p->status, &p->out) < 0)
+        {
+            CO_EXIT(&p->co, CO_ERROR);
+        }
+        metrics_time(METRIC_REQUEST, p->start);
+        CO_AWAIT(&p->co, (p->status = proxy_flush(p)) != 0);
+        if (p->status < 0)
+        {
+            CO_EXIT(&p->co, CO_ERROR);
+        }
+
+        // The rest of the response body, straight from the upstream's socket.
+        CO_AWAIT(&p->co, (p->status = proxy_splice(p, p->up->source.fd, p->source.fd)) != 0);
+        if (p->status < 0)
+        {
+            CO_EXIT(&p->co, CO_ERROR);
+        }
+
+        proxy_release(p, 1);
+        if (!p->keep_alive)
+        {
+            CO_EXIT(&p->co, CO_DONE);
+        }
+    }
+
+    /*
+        Reached when the request was invalid, or no backend could be
+        reached or answered properly. The client gets an error
+        response, and the connection is closed after it since what is
+        left of the request cannot be told apart from the next one.
+    */
+    if (p->out.bytes == 0)
+    {
+        metrics_count(METRIC_ERR_UPSTREAM, 1);
+        if (http_respond(&p->out, 502, bad_gateway, sizeof(bad_gateway) - 1, 0) < 0)
+        {
+            CO_EXIT(&p->co, CO_ERROR);
+        }
+    }
+    proxy_release(p, 0);
+    CO_AWAIT(&p->co, (p->status = proxy_flush(p)) != 0);
+    CO_END(&p->co);
+}
+
+/**
+ * @brief Runs the coroutine, and closes the connection when it is done.
+ *
+ * @param p
+ */
+static void proxy_run(struct proxy *p)
+{
+    int status = proxy_serve(p);
+
+    if (status != CO_WAITING)
+    {
+        proxy_close(p);
+        return;
+    }
+    proxy_schedule(p);
+}
+
+/**
+ * @brief Called by the reactor whenever the client socket changes state.
+ *
+ * @param reactor
+ * @param source
+ * @param events
+ */
+static void proxy_on_event(struct reactor *reactor, struct event_source *source, uint32_t events)
+{
+    struct proxy *p = (struct proxy *) source;
+
+    (void) reactor;
+
+    if (events & (EPOLLERR | EPOLLHUP))
+    {
+        proxy_close(p);
+        return;
+    }
+    proxy_run(p);
+}
+
+/**
+ * @brief Called by the reactor whenever an upstream socket changes
+ * state. Errors on one in use surface in the coroutine's next read
+ * or write.
+ *
+ * @param reactor
+ * @param source
+ * @param events
+ */
+static void proxy_on_upstream_event(struct reactor *reactor, struct event_source *source, uint32_t events)
+{
+    struct upstream *up = (struct upstream *) source;
+    char c;
+
+    if (up->proxy != NULL)
+    {
+        proxy_run(up->proxy);
+        return;
+    }
+
+    /*
+        Pooled. The server closing it, as servers do with idle
+        connections, or sending something unasked, ends it; a
+        readiness left over from its last response does not.
+    */
+    if ((events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) ||
+        ((events & EPOLLIN) && (recv(up->source.fd, &c, 1, MSG_PEEK) >= 0 || errno != EAGAIN)))
+    {
+        proxy_pool_remove(up);
+        proxy_upstream_close(reactor, up);
+    }
+}
+
+/**
+ * @brief Picks the timeout that applies now, as connection.c does.
+ *
+ * Waiting for the client's next request is bound by the idle
+ * timeout, a client not reading its response by the write timeout,
+ * and anything else (a request arriving, the upstream answering) by
+ * the read timeout. The timer is only re-armed lazily.
+ *
+ * @param p
+ */
+static void proxy_schedule(struct proxy *p)
+{
+    struct reactor *reactor = p->reactor;
+    int timeout;
+
+    if (p->out.bytes > 0)
+    {
+        timeout = p->config->write_timeout;
+    }
+    else if (p->idle && buffer_len(&p->in) == 0)
+    {
+        timeout = p->config->idle_timeout;
+    }
+    else
+    {
+        timeout = p->config->read_timeout;
+    }
+
+    if (timeout == 0)
+    {
+        p->deadline = 0;
+        reactor_timer_cancel(reactor, &p->timer);
+        return;
+    }
+
+    p->deadline = reactor->now + timeout;
+    if (!timer_armed(&p->timer) || p->deadline < p->timer.expires * REACTOR_TICK_MS)
+    {
+        reactor_timer_arm(reactor, &p->timer, p->deadline);
+    }
+}
+
+static void proxy_on_timeout(struct timer *timer)
+{
+    struct proxy *p = timer->data;
+    struct reactor *reactor = p->reactor;
+
+    if (p->deadline > reactor->now)
+    {
+        // There has been activity since the timer was armed.
+        reactor_timer_arm(reactor, timer, p->deadline);
+        return;
+    }
+    metrics_count(METRIC_ERR_TIMEOUT, 1);
+    proxy_close(p);
+}
@@ -0,0 +1,73 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "config.h"
+#include "reactor.h"
+
+/*
+    How many body bytes are put into a connection's pipe before they
+    are taken out again; the pipe's default capacity.
+*/
+#define PROXY_PIPE_SIZE (64 * 1024)
+
+// The largest response header block accepted from an upstream.
+#define PROXY_HEAD_MAX (16 * 1024)
+
+// The most upstream servers requests can be spread over.
+#define PROXY_MAX_BACKENDS 64
+
+// Points each backend gets on the consistent hash ring.
+#define PROXY_RING_REPLICAS 160
+
+// Idle connections each worker keeps open per backend.
+#define PROXY_POOL_MAX 32
+
+// Pooled connections idle for longer are not reused; servers close them around then.
+#define PROXY_POOL_IDLE_MS 4000
+
+// Failures in a row after which a backend is taken out of rotation...
+#define PROXY_EJECT_FAILURES 5
+
+// ...and for how long.
+#define PROXY_EJECT_MS 10000
+
+/*
+    What happened with one backend so far, summed over all workers.
+    Pool hit rate is pool_hits / requests; mean wait time, from
+    picking a connection until it has taken the request's header
+    block, is wait_ms / requests.
+*/
+struct proxy_backend_stats
+{
+    // "host:port" as given on the command line.
+    const char *name;
+
+    // Requests forwarded to it, including retries.
+    unsigned long requests;
+
+    // Requests sent over a pooled connection rather than a new one.
+    unsigned long pool_hits;
+
+    // Connections opened to it.
+    unsigned long connects;
+
+    unsigned long wait_ms;
+
+    // Requests it failed (no connection or answer, or a 502/503/504), and times it was ejected for that.
+    unsigned long failures;
+    unsigned long ejections;
+
+    // Requests it is working on now.
+    long outstanding;
+
+    // Whether it is currently out of rotation.
+    int ejected;
+};
+
+struct proxy;
+
+int proxy_init(const char *targets);
+struct proxy *proxy_open(struct reactor *reactor, int fd, const struct config *config);
+int proxy_snapshot(struct proxy_backend_stats *stats, int max);
+
+#endif
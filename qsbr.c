@@ -0,0 +1,182 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "qsbr.h"
+
+/*
+    A global epoch counts retirements. Each registered thread
+    publishes the epoch it last saw while online, or 0 while it is
+    offline. Something retired at epoch E can be released once every
+    thread is either offline or has seen an epoch of at least E, since
+    any pointer a thread had picked up before E it has let go of by
+    then.
+*/
+
+#define QSBR_CACHE_LINE 64
+
+struct qsbr_thread
+{
+    // The epoch this thread last saw, 0 while offline.
+    unsigned long seen __attribute__((aligned(QSBR_CACHE_LINE)));
+
+    struct qsbr_thread *next;
+};
+
+struct qsbr_retired
+{
+    struct qsbr_retired *next;
+    unsigned long epoch;
+    void (*fn)(void *ptr);
+    void *ptr;
+};
+
+// Starts at 1 so that 0 can mean offline.
+static unsigned long epoch = 1;
+
+// Every registered thread, pushed on the front.
+static struct qsbr_thread *threads;
+
+// Retired memory waiting for its grace period, oldest last.
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct qsbr_retired *retired;
+
+static __thread struct qsbr_thread *me;
+
+/**
+ * @brief Makes the calling thread a reader. It starts out online.
+ */
+void qsbr_register(void)
+{
+    struct qsbr_thread *t;
+
+    if (me != NULL)
+    {
+        return;
+    }
+    if (posix_memalign((void **) &t, QSBR_CACHE_LINE, sizeof(*t)) != 0)
+    {
+        abort();
+    }
+    t->seen = __atomic_load_n(&epoch, __ATOMIC_ACQUIRE);
+    t->next = __atomic_load_n(&threads, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&threads, &t->next, t, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+    }
+    me = t;
+}
+
+/**
+ * @brief Declares that the calling thread holds no shared pointers
+ * and will not pick any up until qsbr_online(), e.g. before it
+ * blocks in the kernel.
+ */
+void qsbr_offline(void)
+{
+    if (me != NULL)
+    {
+        __atomic_store_n(&me->seen, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * @brief Declares that the calling thread is about to read shared
+ * structures again.
+ */
+void qsbr_online(void)
+{
+    if (me != NULL)
+    {
+        // Publish before any read of shared data can happen.
+        __atomic_store_n(&me->seen, __atomic_load_n(&epoch, __ATOMIC_ACQUIRE), __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * @brief Whether every reader has been quiescent since epoch e.
+ */
+static int qsbr_passed(unsigned long e)
+{
+    struct qsbr_thread *t;
+    unsigned long seen;
+
+    for (t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next)
+    {
+        seen = __atomic_load_n(&t->seen, __ATOMIC_ACQUIRE);
+        if (seen != 0 && seen < e)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Calls fn(ptr) once no reader can still be using ptr.
+ *
+ * ptr must already be unreachable for readers that start looking
+ * from now on. fn runs on whichever thread next reclaims.
+ *
+ * @param fn
+ * @param ptr
+ */
+void qsbr_retire(void (*fn)(void *ptr), void *ptr)
+{
+    struct qsbr_retired *r = malloc(sizeof(*r));
+
+    if (r == NULL)
+    {
+        // Better to leak than to free under a reader.
+        return;
+    }
+    r->fn = fn;
+    r->ptr = ptr;
+    r->epoch = __atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&retired_lock);
+    r->next = retired;
+    retired = r;
+    pthread_mutex_unlock(&retired_lock);
+
+    qsbr_reclaim();
+}
+
+/**
+ * @brief Releases whatever has been retired long enough.
+ */
+void qsbr_reclaim(void)
+{
+    struct qsbr_retired **p;
+    struct qsbr_retired *r;
+    struct qsbr_retired *done = NULL;
+
+    if (__atomic_load_n(&retired, __ATOMIC_RELAXED) == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&retired_lock);
+    for (p = &retired; *p != NULL;)
+    {
+        r = *p;
+        if (qsbr_passed(r->epoch))
+        {
+            *p = r->next;
+            r->next = done;
+            done = r;
+        }
+        else
+        {
+            p = &r->next;
+        }
+    }
+    pthread_mutex_unlock(&retired_lock);
+
+    while (done != NULL)
+    {
+        r = done;
+        done = r->next;
+        r->fn(r->ptr);
+        free(r);
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef QSBR_H
+#define QSBR_H
+
+/*
+    Quiescent-state-based reclamation: lets threads read shared
+    structures without locks or reference counts, while whoever
+    removes something from them learns when the last reader can no
+    longer be looking at it.
+
+    Reader threads register once. Whenever a thread holds no pointers
+    obtained from a shared structure (between batches of events, and
+    while it sleeps in the kernel) it is quiescent. Memory retired
+    with qsbr_retire() is released once every registered thread has
+    been quiescent since it was retired.
+*/
+
+void qsbr_register(void);
+void qsbr_offline(void);
+void qsbr_online(void);
+void qsbr_retire(void (*fn)(void *ptr), void *ptr);
+void qsbr_reclaim(void);
+
+#endif
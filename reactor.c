@@ -0,0 +1,369 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "qsbr.h"
+#include "reactor.h"
+
+// The number of events fetched from the kernel per epoll_wait() call.
+#define REACTOR_MAX_EVENTS 256
+
+/**
+ * @brief Reads the monotonic clock in milliseconds.
+ */
+static uint64_t reactor_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Starts or stops the periodic tick of the timerfd.
+ *
+ * @param reactor
+ * @param on
+ */
+static void reactor_tick(struct reactor *reactor, int on)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    if (on)
+    {
+        its.it_value.tv_nsec = REACTOR_TICK_MS * 1000000L;
+        its.it_interval.tv_nsec = REACTOR_TICK_MS * 1000000L;
+    }
+    timerfd_settime(reactor->timer_source.fd, 0, &its, NULL);
+    reactor->ticking = on;
+}
+
+/**
+ * @brief Called on every tick of the timerfd: runs the timers that
+ * have expired, and stops the tick once none are left.
+ *
+ * @param reactor
+ * @param source
+ * @param events
+ */
+static void reactor_on_tick(struct reactor *reactor, struct event_source *source, uint32_t events)
+{
+    uint64_t expirations;
+
+    (void) events;
+
+    // Reading the expiration count re-arms the level-triggered event.
+    while (read(source->fd, &expirations, sizeof(expirations)) < 0 && errno == EINTR)
+    {
+    }
+
+    timer_wheel_advance(&reactor->timers, reactor->now / REACTOR_TICK_MS);
+    if (reactor->timers.count == 0 && reactor->ticking)
+    {
+        reactor_tick(reactor, 0);
+    }
+}
+
+/**
+ * @brief Called when the pool has posted completed tasks: runs their
+ * completion callbacks on this thread.
+ *
+ * @param reactor
+ * @param source
+ * @param events
+ */
+static void reactor_on_completion(struct reactor *reactor, struct event_source *source, uint32_t events)
+{
+    struct mpsc_node *node;
+    uint64_t count;
+
+    (void) events;
+
+    while (read(source->fd, &count, sizeof(count)) < 0 && errno == EINTR)
+    {
+    }
+
+    /*
+        Clear the flag before emptying the queue: a task posted from
+        now on either is seen below or writes the eventfd again.
+    */
+    __atomic_store_n(&reactor->completion_pending, 0, __ATOMIC_SEQ_CST);
+    while ((node = mpsc_pop(&reactor->completions)) != NULL)
+    {
+        struct task *task = (struct task *) node;
+
+        task->complete(task);
+    }
+}
+
+/**
+ * @brief Creates the epoll instance that backs the reactor.
+ *
+ * @param reactor
+ * @return 0 on success, -1 on failure with errno set.
+ */
+int reactor_init(struct reactor *reactor)
+{
+    memset(reactor, 0, sizeof(*reactor));
+    reactor->timer_source.fd = -1;
+    reactor->completion_source.fd = -1;
+    mpsc_init(&reactor->completions);
+
+    /*
+        epoll_create1() returns a file descriptor referring to a new
+        epoll instance. EPOLL_CLOEXEC makes sure the descriptor is not
+        leaked into child processes.
+    */
+    reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epfd < 0)
+    {
+        return -1;
+    }
+
+    reactor->timer_source.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    reactor->timer_source.on_event = reactor_on_tick;
+    if (reactor->timer_source.fd < 0 || reactor_add(reactor, &reactor->timer_source, EPOLLIN) < 0)
+    {
+        reactor_close(reactor);
+        return -1;
+    }
+
+    reactor->completion_source.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    reactor->completion_source.on_event = reactor_on_completion;
+    if (reactor->completion_source.fd < 0 || reactor_add(reactor, &reactor->completion_source, EPOLLIN) < 0)
+    {
+        reactor_close(reactor);
+        return -1;
+    }
+
+    // Event handlers may read structures shared between workers.
+    qsbr_register();
+
+    reactor->now = reactor_clock();
+    timer_wheel_init(&reactor->timers, reactor->now / REACTOR_TICK_MS);
+    reactor->running = 1;
+    return 0;
+}
+
+/**
+ * @brief Registers a file descriptor with the reactor.
+ *
+ * The events mask is passed to epoll unchanged, so callers choose
+ * between edge-triggered (EPOLLET) and level-triggered operation.
+ *
+ * @param reactor
+ * @param source
+ * @param events
+ * @return 0 on success, -1 on failure with errno set.
+ */
+int reactor_add(struct reactor *reactor, struct event_source *source, uint32_t events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = source;
+    return epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, source->fd, &ev);
+}
+
+/**
+ * @brief Changes the events a registered file descriptor is watched for.
+ *
+ * @param reactor
+ * @param source
+ * @param events
+ * @return 0 on success, -1 on failure with errno set.
+ */
+int reactor_mod(struct reactor *reactor, struct event_source *source, uint32_t events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = source;
+    return epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, source->fd, &ev);
+}
+
+/**
+ * @brief Removes a file descriptor from the reactor.
+ *
+ * Closing a descriptor removes it from epoll implicitly, so this is
+ * only needed when the descriptor stays open after deregistration.
+ *
+ * @param reactor
+ * @param source
+ */
+void reactor_del(struct reactor *reactor, struct event_source *source)
+{
+    epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, source->fd, NULL);
+}
+
+/**
+ * @brief Waits for events and dispatches them until reactor_stop() is called.
+ *
+ * @param reactor
+ */
+void reactor_run(struct reactor *reactor)
+{
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    int n, i;
+
+    while (reactor->running)
+    {
+        /*
+            epoll_wait() blocks until at least one registered descriptor
+            is ready, then fills in up to REACTOR_MAX_EVENTS entries.
+            A timeout of -1 means wait forever. While waiting the
+            thread holds no pointers into shared structures, so it does
+            not hold up their reclamation (see qsbr.c).
+        */
+        qsbr_offline();
+        n = epoll_wait(reactor->epfd, events, REACTOR_MAX_EVENTS, -1);
+        qsbr_online();
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("ERROR on epoll_wait");
+            return;
+        }
+        reactor->now = reactor_clock();
+
+        for (i = 0; i < n; i++)
+        {
+            struct event_source *source = events[i].data.ptr;
+
+            // Closed by an earlier event (or timer) in this batch.
+            if (source->fd < 0)
+            {
+                continue;
+            }
+            source->on_event(reactor, source, events[i].events);
+        }
+
+        while (reactor->free_list != NULL)
+        {
+            struct event_source *source = reactor->free_list;
+
+            reactor->free_list = source->next_free;
+            free(source);
+        }
+
+        // Release shared memory that no thread can be using any more.
+        qsbr_reclaim();
+    }
+}
+
+/**
+ * @brief Asks reactor_run() to return after the current batch of events.
+ *
+ * @param reactor
+ */
+void reactor_stop(struct reactor *reactor)
+{
+    reactor->running = 0;
+}
+
+/**
+ * @brief Arms a timer to fire once the reactor's clock reaches when.
+ *
+ * The timer fires on the first tick at or after when, so it may run
+ * up to REACTOR_TICK_MS late but never early. Re-arming an armed
+ * timer moves it.
+ *
+ * @param reactor
+ * @param timer
+ * @param when a time on the reactor's clock (reactor->now), in milliseconds.
+ */
+void reactor_timer_arm(struct reactor *reactor, struct timer *timer, uint64_t when)
+{
+    timer_arm(&reactor->timers, timer, (when + REACTOR_TICK_MS - 1) / REACTOR_TICK_MS);
+    if (!reactor->ticking)
+    {
+        reactor_tick(reactor, 1);
+    }
+}
+
+/**
+ * @brief Disarms a timer; harmless if it is not armed.
+ *
+ * The tick is left running and stops by itself on the next one.
+ *
+ * @param reactor
+ * @param timer
+ */
+void reactor_timer_cancel(struct reactor *reactor, struct timer *timer)
+{
+    timer_cancel(&reactor->timers, timer);
+}
+
+/**
+ * @brief Hands a task the pool has run back to its reactor. Called
+ * from pool threads.
+ *
+ * @param reactor
+ * @param task
+ */
+void reactor_post(struct reactor *reactor, struct task *task)
+{
+    static const uint64_t one = 1;
+
+    mpsc_push(&reactor->completions, &task->node);
+    if (__atomic_exchange_n(&reactor->completion_pending, 1, __ATOMIC_SEQ_CST) == 0)
+    {
+        while (write(reactor->completion_source.fd, &one, sizeof(one)) < 0 && errno == EINTR)
+        {
+        }
+    }
+}
+
+/**
+ * @brief Frees a malloc()ed source once the current batch of events
+ * has been dispatched.
+ *
+ * Events for the source may still be waiting in the batch (an earlier
+ * event, a timer or a completion may have closed it), so it cannot
+ * be freed on the spot. The caller must already have closed its
+ * descriptor; the source's fd is set to -1 so those events are
+ * skipped.
+ *
+ * @param reactor
+ * @param source
+ */
+void reactor_free(struct reactor *reactor, struct event_source *source)
+{
+    source->fd = -1;
+    source->next_free = reactor->free_list;
+    reactor->free_list = source;
+}
+
+/**
+ * @brief Releases the epoll instance, the timerfd and the eventfd.
+ *
+ * @param reactor
+ */
+void reactor_close(struct reactor *reactor)
+{
+    if (reactor->completion_source.fd >= 0)
+    {
+        close(reactor->completion_source.fd);
+        reactor->completion_source.fd = -1;
+    }
+    if (reactor->timer_source.fd >= 0)
+    {
+        close(reactor->timer_source.fd);
+        reactor->timer_source.fd = -1;
+    }
+    if (reactor->epfd >= 0)
+    {
+        close(reactor->epfd);
+        reactor->epfd = -1;
+    }
+}
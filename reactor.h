@@ -0,0 +1,92 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#include "mpsc.h"
+#include "task.h"
+#include "timer_wheel.h"
+
+// Resolution of the reactor's timers, in milliseconds.
+#define REACTOR_TICK_MS 10
+
+struct reactor;
+struct pool;
+struct filecache;
+
+/*
+    Every file descriptor registered with the reactor is described
+    by an event_source. A pointer to it is stored in the epoll_event,
+    so when epoll reports activity on the descriptor the reactor can
+    call straight back into the code that owns it without a lookup.
+
+    Owners embed an event_source as the first member of their own
+    structure (a listener, a connection, ...) and cast back to it
+    inside on_event.
+*/
+struct event_source
+{
+    int fd;
+    void (*on_event)(struct reactor *reactor, struct event_source *source, uint32_t events);
+
+    // Links sources waiting to be freed (see reactor_free()).
+    struct event_source *next_free;
+};
+
+struct reactor
+{
+    // The epoll instance returned by epoll_create1().
+    int epfd;
+
+    // Cleared by reactor_stop() to make reactor_run() return.
+    volatile int running;
+
+    // Number of client connections currently owned by this reactor.
+    unsigned long connections;
+
+    // The monotonic clock in milliseconds, read once per batch of events.
+    uint64_t now;
+
+    /*
+        Timers of everything this reactor owns. A single timerfd
+        ticks every REACTOR_TICK_MS while any of them is armed and the
+        wheel is advanced on each tick, so the number of timers has no
+        effect on the number of system calls.
+    */
+    struct timer_wheel timers;
+    struct event_source timer_source;
+    int ticking;
+
+    // The thread pool handlers are offloaded to, NULL to run them inline.
+    struct pool *pool;
+
+    // Open files served from --root, NULL without one.
+    struct filecache *files;
+
+    /*
+        Tasks the pool has finished, posted from pool threads. The
+        eventfd is only written when the reactor may be asleep, that
+        is when nothing was pending since it last emptied the queue.
+    */
+    struct mpsc_queue completions;
+    struct event_source completion_source;
+    int completion_pending;
+
+    // Sources closed during the current batch of events.
+    struct event_source *free_list;
+};
+
+int reactor_init(struct reactor *reactor);
+int reactor_add(struct reactor *reactor, struct event_source *source, uint32_t events);
+int reactor_mod(struct reactor *reactor, struct event_source *source, uint32_t events);
+void reactor_del(struct reactor *reactor, struct event_source *source);
+void reactor_run(struct reactor *reactor);
+void reactor_stop(struct reactor *reactor);
+void reactor_timer_arm(struct reactor *reactor, struct timer *timer, uint64_t when);
+void reactor_timer_cancel(struct reactor *reactor, struct timer *timer);
+void reactor_post(struct reactor *reactor, struct task *task);
+void reactor_free(struct reactor *reactor, struct event_source *source);
+void reactor_close(struct reactor *reactor);
+
+#endif
@@ -0,0 +1,440 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "qsbr.h"
+#include "respcache.h"
+
+/*
+    Small files are requested far more often than they change, and
+    for them the cost of a response is the system calls rather than
+    the bytes. This cache, shared by every worker, keeps such
+    responses fully formed in memory: one block holding the headers
+    and the body, sent with one write.
+
+    Lookups take no lock. Entries are immutable once published and
+    are linked into the hash chains with release stores, so a reader
+    either sees a complete entry or does not see it. Removal happens
+    under a lock, and the memory is only released once every worker
+    has passed through a quiescent state (see qsbr.c), so a reader
+    that found an entry just before it was removed can still take a
+    reference to it. Queued responses hold such a reference until the
+    entry has been sent.
+
+    The cache holds at most its byte budget. Eviction uses the CLOCK
+    approximation of LRU: a hit only sets a flag in the entry (and
+    only if it is not already set, so hot entries do not bounce
+    between caches), and the hand sweeping the entries evicts the
+    first one whose flag is clear, clearing flags as it goes.
+*/
+
+static struct
+{
+    // Serializes insertions and removals; lookups never take it.
+    pthread_mutex_t lock;
+
+    size_t budget;
+    size_t bytes;
+
+    // Bumped by every invalidation; see respcache_version().
+    unsigned long version;
+
+    // The next entry the CLOCK hand looks at, NULL when empty.
+    struct resp_entry *hand;
+
+    struct resp_entry *buckets[RESPCACHE_BUCKETS];
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static size_t respcache_hash(const char *path, size_t len)
+{
+    size_t h = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        h ^= (unsigned char) path[i];
+        h *= 1099511628211ULL;
+    }
+    return h & (RESPCACHE_BUCKETS - 1);
+}
+
+static int respcache_matches(const struct resp_entry *e, const char *path, size_t len, const char *encoding)
+{
+    if (e->path_len != len || memcmp(e->path, path, len) != 0)
+    {
+        return 0;
+    }
+    if (e->encoding == NULL || encoding == NULL)
+    {
+        return e->encoding == encoding;
+    }
+    return strcmp(e->encoding, encoding) == 0;
+}
+
+/**
+ * @brief Sets the byte budget. Call before the workers start; 0
+ * disables the cache.
+ *
+ * @param budget
+ */
+void respcache_init(size_t budget)
+{
+    cache.budget = budget;
+}
+
+/**
+ * @brief Drops a reference; the entry is freed with the last one.
+ *
+ * Matches the release callback of output segments.
+ *
+ * @param entry
+ */
+void respcache_release(void *entry)
+{
+    struct resp_entry *e = entry;
+
+    if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(e);
+    }
+}
+
+/**
+ * @brief Looks up a cached response. Takes no lock.
+ *
+ * @param path relative to the document root.
+ * @param len
+ * @param encoding the Content-Encoding wanted, NULL for none.
+ * @return a reference to the entry, to be dropped with
+ * respcache_release(), or NULL on a miss.
+ */
+struct resp_entry *respcache_get(const char *path, size_t len, const char *encoding)
+{
+    struct resp_entry *e;
+
+    e = __atomic_load_n(&cache.buckets[respcache_hash(path, len)], __ATOMIC_ACQUIRE);
+    for (; e != NULL; e = __atomic_load_n(&e->hash_next, __ATOMIC_ACQUIRE))
+    {
+        if (respcache_matches(e, path, len, encoding))
+        {
+            if (!__atomic_load_n(&e->referenced, __ATOMIC_RELAXED))
+            {
+                __atomic_store_n(&e->referenced, 1, __ATOMIC_RELAXED);
+            }
+            __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Unlinks an entry and hands the cache's reference to QSBR.
+ * Called with the lock held.
+ *
+ * @param e
+ */
+static void respcache_remove(struct resp_entry *e)
+{
+    struct resp_entry **p = &cache.buckets[respcache_hash(e->path, e->path_len)];
+
+    while (*p != e)
+    {
+        p = &(*p)->hash_next;
+    }
+    __atomic_store_n(p, e->hash_next, __ATOMIC_RELEASE);
+
+    if (e->clock_next == e)
+    {
+        cache.hand = NULL;
+    }
+    else
+    {
+        if (cache.hand == e)
+        {
+            cache.hand = e->clock_next;
+        }
+        e->clock_prev->clock_next = e->clock_next;
+        e->clock_next->clock_prev = e->clock_prev;
+    }
+    cache.bytes -= e->len;
+
+    // Readers may have found it a moment ago; they keep it alive until they are done.
+    qsbr_retire(respcache_release, e);
+}
+
+/**
+ * @brief Evicts entries until need more bytes fit. Called with the
+ * lock held.
+ *
+ * @param need
+ */
+static void respcache_make_room(size_t need)
+{
+    struct resp_entry *e;
+
+    while (cache.bytes + need > cache.budget && cache.hand != NULL)
+    {
+        e = cache.hand;
+        if (__atomic_load_n(&e->referenced, __ATOMIC_RELAXED))
+        {
+            // Used since the hand last passed: give it another round.
+            __atomic_store_n(&e->referenced, 0, __ATOMIC_RELAXED);
+            cache.hand = e->clock_next;
+            continue;
+        }
+        respcache_remove(e);
+    }
+}
+
+/**
+ * @brief Allocates an entry for a body of the given size and fills
+ * in everything but the body.
+ *
+ * @return the entry, holding one reference, or NULL if memory is
+ * exhausted.
+ */
+static struct resp_entry *respcache_alloc(const char *path, size_t len, const char *encoding,
+                                          const char *content_type, size_t size)
+{
+    struct resp_entry *e;
+    char header[320];
+    int header_len;
+
+    header_len = snprintf(header, sizeof(header),
+                          "HTTP/1.1 200 OK\r\n"
+                          "Content-Type: %s\r\n"
+                          "Content-Length: %zu\r\n"
+                          "%s%s%s"
+                          "%s"
+                          "\r\n",
+                          content_type, size,
+                          encoding != NULL ? "Content-Encoding: " : "",
+                          encoding != NULL ? encoding : "",
+                          encoding != NULL ? "\r\n" : "",
+                          compress_worthwhile(content_type) ? "Vary: Accept-Encoding\r\n" : "");
+    if (header_len < 0 || (size_t) header_len >= sizeof(header))
+    {
+        return NULL;
+    }
+
+    e = malloc(sizeof(*e) + len + 1 + header_len + size);
+    if (e == NULL)
+    {
+        return NULL;
+    }
+    memcpy(e->path, path, len);
+    e->path[len] = '\0';
+    e->path_len = len;
+    e->encoding = encoding;
+    e->data = e->path + len + 1;
+    e->header_len = header_len;
+    e->len = header_len + size;
+    e->referenced = 0;
+    e->refs = 1;
+    memcpy((char *) e->data, header, header_len);
+    return e;
+}
+
+/**
+ * @brief Publishes a complete entry, unless another one for the same
+ * key got there first or the file may have changed since version.
+ *
+ * @param e holding the caller's reference.
+ * @param version what respcache_version() returned before the body
+ * was read.
+ * @return a reference to the entry to use, which may not be e (in
+ * which case e has been freed) and may not have been cached.
+ */
+static struct resp_entry *respcache_publish(struct resp_entry *e, unsigned long version)
+{
+    struct resp_entry *existing;
+    struct resp_entry **bucket;
+
+    pthread_mutex_lock(&cache.lock);
+
+    bucket = &cache.buckets[respcache_hash(e->path, e->path_len)];
+    for (existing = *bucket; existing != NULL; existing = existing->hash_next)
+    {
+        if (respcache_matches(existing, e->path, e->path_len, e->encoding))
+        {
+            __atomic_add_fetch(&existing->refs, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&cache.lock);
+            free(e);
+            return existing;
+        }
+    }
+
+    if (e->len > cache.budget || version != cache.version)
+    {
+        pthread_mutex_unlock(&cache.lock);
+        return e;
+    }
+    respcache_make_room(e->len);
+
+    // The entry is complete before the release store makes it reachable.
+    e->refs = 2;
+    e->hash_next = *bucket;
+    __atomic_store_n(bucket, e, __ATOMIC_RELEASE);
+
+    if (cache.hand == NULL)
+    {
+        e->clock_prev = e;
+        e->clock_next = e;
+        cache.hand = e;
+    }
+    else
+    {
+        // Just behind the hand, so it gets a full round before being looked at.
+        e->clock_next = cache.hand;
+        e->clock_prev = cache.hand->clock_prev;
+        cache.hand->clock_prev->clock_next = e;
+        cache.hand->clock_prev = e;
+    }
+    cache.bytes += e->len;
+
+    pthread_mutex_unlock(&cache.lock);
+    return e;
+}
+
+/**
+ * @brief Counts invalidations, so that a response built from a file
+ * is not cached if the file may have changed while it was being read.
+ */
+unsigned long respcache_version(void)
+{
+    return __atomic_load_n(&cache.version, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Reads a file into a new entry and publishes it.
+ *
+ * @param path relative to the document root.
+ * @param len
+ * @param encoding the Content-Encoding of the file's contents, NULL
+ * for none. Must be a string constant.
+ * @param content_type
+ * @param fd the open file.
+ * @param size its size.
+ * @return a reference to the entry (an existing one, if another
+ * worker was first), or NULL if the file is too large for the cache
+ * or cannot be read. The entry may not have been cached if it does
+ * not fit the budget, but is usable either way.
+ */
+struct resp_entry *respcache_put(const char *path, size_t len, const char *encoding,
+                                 const char *content_type, int fd, size_t size)
+{
+    unsigned long version = respcache_version();
+    struct resp_entry *e;
+    size_t got = 0;
+    ssize_t n;
+
+    if (size > RESPCACHE_BODY_MAX || cache.budget == 0)
+    {
+        return NULL;
+    }
+
+    e = respcache_alloc(path, len, encoding, content_type, size);
+    if (e == NULL)
+    {
+        return NULL;
+    }
+    while (got < size)
+    {
+        n = pread(fd, (char *) e->data + e->header_len + got, size - got, got);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            free(e);
+            return NULL;
+        }
+        got += n;
+    }
+    return respcache_publish(e, version);
+}
+
+/**
+ * @brief Publishes a response whose body is already in memory, such
+ * as one compressed on the fly.
+ *
+ * Unlike respcache_put() the size is not limited, beyond having to
+ * fit the budget; the caller decides what is worth keeping.
+ *
+ * @param path relative to the document root.
+ * @param len
+ * @param encoding the Content-Encoding of the body, NULL for none.
+ * Must be a string constant.
+ * @param content_type
+ * @param body copied into the entry.
+ * @param size
+ * @param version what respcache_version() returned before the file
+ * the body was made from was read.
+ * @return a reference to the entry, as with respcache_put(), or NULL
+ * if the cache is disabled or memory is exhausted.
+ */
+struct resp_entry *respcache_put_data(const char *path, size_t len, const char *encoding,
+                                      const char *content_type, const char *body, size_t size,
+                                      unsigned long version)
+{
+    struct resp_entry *e;
+
+    if (cache.budget == 0)
+    {
+        return NULL;
+    }
+
+    e = respcache_alloc(path, len, encoding, content_type, size);
+    if (e == NULL)
+    {
+        return NULL;
+    }
+    memcpy((char *) e->data + e->header_len, body, size);
+    return respcache_publish(e, version);
+}
+
+/**
+ * @brief Drops every cached response for a path, in all encodings,
+ * e.g. because the file changed.
+ *
+ * @param path relative to the document root.
+ * @param len
+ */
+void respcache_invalidate(const char *path, size_t len)
+{
+    struct resp_entry *e;
+    struct resp_entry *next;
+    size_t b = respcache_hash(path, len);
+
+    pthread_mutex_lock(&cache.lock);
+    __atomic_store_n(&cache.version, cache.version + 1, __ATOMIC_RELEASE);
+    for (e = cache.buckets[b]; e != NULL; e = next)
+    {
+        next = e->hash_next;
+        if (e->path_len == len && memcmp(e->path, path, len) == 0)
+        {
+            respcache_remove(e);
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * @brief Drops every cached response.
+ */
+void respcache_clear(void)
+{
+    pthread_mutex_lock(&cache.lock);
+    __atomic_store_n(&cache.version, cache.version + 1, __ATOMIC_RELEASE);
+    while (cache.hand != NULL)
+    {
+        respcache_remove(cache.hand);
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
@@ -0,0 +1,58 @@
+#ifndef RESPCACHE_H
+#define RESPCACHE_H
+
+#include <stddef.h>
+
+// Hash buckets in the cache. Must be a power of two.
+#define RESPCACHE_BUCKETS 4096
+
+// Files with larger bodies are not cached; they are sent with sendfile().
+#define RESPCACHE_BODY_MAX (32 * 1024)
+
+/*
+    A complete response to a GET: the status line and header block
+    followed by the body, in one contiguous block, so a hit is sent
+    with a single write. A HEAD is answered with just the first
+    header_len bytes. Entries never change once published.
+*/
+struct resp_entry
+{
+    // Chains entries in the same bucket; read by lookups without a lock.
+    struct resp_entry *hash_next;
+
+    // The circular list swept by the CLOCK hand; only touched under the lock.
+    struct resp_entry *clock_prev;
+    struct resp_entry *clock_next;
+
+    // Set on every hit, cleared by the CLOCK hand.
+    int referenced;
+
+    // The cache's reference plus one per queued response.
+    int refs;
+
+    // The response.
+    const char *data;
+    size_t len;
+    size_t header_len;
+
+    // Content-Encoding of the body, NULL for none; part of the key.
+    const char *encoding;
+
+    // The path relative to the document root; the other part of the key.
+    size_t path_len;
+    char path[];
+};
+
+void respcache_init(size_t budget);
+struct resp_entry *respcache_get(const char *path, size_t len, const char *encoding);
+struct resp_entry *respcache_put(const char *path, size_t len, const char *encoding,
+                                 const char *content_type, int fd, size_t size);
+struct resp_entry *respcache_put_data(const char *path, size_t len, const char *encoding,
+                                      const char *content_type, const char *body, size_t size,
+                                      unsigned long version);
+unsigned long respcache_version(void);
+void respcache_invalidate(const char *path, size_t len);
+void respcache_clear(void);
+void respcache_release(void *entry);
+
+#endif
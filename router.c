@@ -0,0 +1,688 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "router.h"
+
+/*
+    Maps a method and a path to the value of the route that matches
+    them, e.g. a handler.
+
+    Routes are patterns such as "/users/:id/posts", where ":name"
+    matches one path segment, and a last segment of "*name" the rest
+    of the path; both capture what they match. They are kept in a radix
+    trie per method: each node is labelled with a run of bytes that
+    the paths below it share, so a lookup compares every byte of the
+    path once, without backtracking through common prefixes, and the
+    trie has as many nodes as the routes have branch points rather
+    than bytes. A static continuation is preferred over a capture, a
+    segment capture over a rest capture, and a lookup backs up to try
+    the next if the preferred one leads nowhere.
+
+    Most routes have no captures, and for them the trie is not
+    needed: once every route has been added, router_build() puts them
+    in a perfect hash table ("hash and displace"). Routes are hashed
+    into buckets of a few each, and every bucket, largest first, is
+    given the seed for a second hash under which its routes land in
+    slots no other route has taken. A lookup hashes the path twice and
+    compares it with the one route in its slot.
+*/
+
+struct route_node
+{
+    /*
+        The static bytes leading here from the parent, or for a
+        capture node the capture's name.
+    */
+    char *label;
+    size_t len;
+
+    // Children with static labels, no two starting with the same byte; first holds those bytes.
+    struct route_node **children;
+    char *first;
+    int nchildren;
+
+    // The children that capture a segment and the rest of the path.
+    struct route_node *param;
+    struct route_node *rest;
+
+    // The value of the route ending here, or -1.
+    int value;
+};
+
+// A route without captures.
+struct route_entry
+{
+    int method;
+    char *path;
+    size_t len;
+    int value;
+};
+
+static uint32_t router_hash(uint32_t seed, int method, const char *path, size_t len)
+{
+    uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+    size_t i;
+
+    h = (h ^ (uint32_t) method) * 16777619u;
+    for (i = 0; i < len; i++)
+    {
+        h ^= (unsigned char) path[i];
+        h *= 16777619u;
+    }
+    // FNV leaves its last bytes poorly mixed into the low bits used as an index.
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    return h;
+}
+
+static uint32_t router_pow2(uint32_t n)
+{
+    uint32_t p = 1;
+
+    while (p < n)
+    {
+        p <<= 1;
+    }
+    return p;
+}
+
+static struct route_node *router_node_new(const char *label, size_t len)
+{
+    struct route_node *node = calloc(1, sizeof(*node));
+
+    if (node == NULL)
+    {
+        return NULL;
+    }
+    node->label = malloc(len + 1);
+    if (node->label == NULL)
+    {
+        free(node);
+        return NULL;
+    }
+    memcpy(node->label, label, len);
+    node->label[len] = '\0';
+    node->len = len;
+    node->value = -1;
+    return node;
+}
+
+static void router_node_free(struct route_node *node)
+{
+    int i;
+
+    if (node == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < node->nchildren; i++)
+    {
+        router_node_free(node->children[i]);
+    }
+    router_node_free(node->param);
+    router_node_free(node->rest);
+    free(node->children);
+    free(node->first);
+    free(node->label);
+    free(node);
+}
+
+static int router_node_append(struct route_node *node, struct route_node *child)
+{
+    struct route_node **children;
+    char *first;
+
+    children = realloc(node->children, (node->nchildren + 1) * sizeof(*children));
+    if (children == NULL)
+    {
+        return -1;
+    }
+    node->children = children;
+    first = realloc(node->first, node->nchildren + 1);
+    if (first == NULL)
+    {
+        return -1;
+    }
+    node->first = first;
+
+    node->children[node->nchildren] = child;
+    node->first[node->nchildren] = child->label[0];
+    node->nchildren++;
+    return 0;
+}
+
+/**
+ * @brief Finds or makes the node a run of static bytes leads to from
+ * a node, splitting a child whose label only partly matches.
+ *
+ * @param node
+ * @param s
+ * @param len
+ * @return the node, or NULL if memory is exhausted.
+ */
+static struct route_node *router_insert(struct route_node *node, const char *s, size_t len)
+{
+    struct route_node *child;
+    struct route_node *split;
+    size_t common;
+    int i;
+
+    while (len > 0)
+    {
+        child = NULL;
+        for (i = 0; i < node->nchildren; i++)
+        {
+            if (node->first[i] == s[0])
+            {
+                child = node->children[i];
+                break;
+            }
+        }
+        if (child == NULL)
+        {
+            child = router_node_new(s, len);
+            if (child == NULL || router_node_append(node, child) < 0)
+            {
+                router_node_free(child);
+                return NULL;
+            }
+            return child;
+        }
+
+        common = 1;
+        while (common < child->len && common < len && child->label[common] == s[common])
+        {
+            common++;
+        }
+        if (common < child->len)
+        {
+            // The new route leaves the label part way: the rest of it moves down a level.
+            split = router_node_new(child->label + common, child->len - common);
+            if (split == NULL)
+            {
+                return NULL;
+            }
+            split->children = child->children;
+            split->first = child->first;
+            split->nchildren = child->nchildren;
+            split->param = child->param;
+            split->rest = child->rest;
+            split->value = child->value;
+
+            child->children = NULL;
+            child->first = NULL;
+            child->nchildren = 0;
+            child->param = NULL;
+            child->rest = NULL;
+            child->value = -1;
+            child->len = common;
+            child->label[common] = '\0';
+            if (router_node_append(child, split) < 0)
+            {
+                return NULL;
+            }
+        }
+        node = child;
+        s += common;
+        len -= common;
+    }
+    return node;
+}
+
+/**
+ * @brief Looks a path up below a node whose label has been matched.
+ *
+ * @param node
+ * @param path what is left of the path.
+ * @param len
+ * @param match collects the captures.
+ * @return the route's value, or -1 if none matches.
+ */
+static int router_lookup(const struct route_node *node, const char *path, size_t len, struct route_match *match)
+{
+    const struct route_node *child;
+    struct route_param *param;
+    const char *slash;
+    size_t seg;
+    int value;
+    int i;
+
+    if (len == 0)
+    {
+        return node->value;
+    }
+
+    for (i = 0; i < node->nchildren; i++)
+    {
+        if (node->first[i] == path[0])
+        {
+            child = node->children[i];
+            if (child->len <= len && memcmp(child->label, path, child->len) == 0)
+            {
+                value = router_lookup(child, path + child->len, len - child->len, match);
+                if (value >= 0)
+                {
+                    return value;
+                }
+            }
+            break;
+        }
+    }
+
+    if (match->nparams == ROUTER_PARAMS_MAX)
+    {
+        return -1;
+    }
+    param = &match->params[match->nparams];
+
+    if (node->param != NULL && path[0] != '/')
+    {
+        slash = memchr(path, '/', len);
+        seg = slash != NULL ? (size_t) (slash - path) : len;
+        param->name = node->param->label;
+        param->name_len = node->param->len;
+        param->value = path;
+        param->len = seg;
+        match->nparams++;
+        value = router_lookup(node->param, path + seg, len - seg, match);
+        if (value >= 0)
+        {
+            return value;
+        }
+        match->nparams--;
+    }
+
+    if (node->rest != NULL)
+    {
+        param->name = node->rest->label;
+        param->name_len = node->rest->len;
+        param->value = path;
+        param->len = len;
+        match->nparams++;
+        return node->rest->value;
+    }
+    return -1;
+}
+
+/**
+ * @brief Finds a method's index.
+ *
+ * @param router
+ * @param method
+ * @param len
+ * @return the index, or -1 if no route has that method.
+ */
+static int router_method(const struct router *router, const char *method, size_t len)
+{
+    int i;
+
+    for (i = 0; i < router->nmethods; i++)
+    {
+        if (strlen(router->methods[i]) == len && memcmp(router->methods[i], method, len) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Prepares an empty router.
+ *
+ * @param router
+ */
+void router_init(struct router *router)
+{
+    memset(router, 0, sizeof(*router));
+}
+
+/**
+ * @brief Adds a route. Routes are all added before router_build(),
+ * and the router is only read after it, so any number of threads
+ * can match against it.
+ *
+ * @param router
+ * @param method e.g. "GET".
+ * @param pattern a path in which whole segments may be ":name",
+ * matching any one segment, and the last may be "*name", matching
+ * the rest of the path.
+ * @param value what router_match() returns for it; at least 0.
+ * @return 0 on success, -1 if the pattern is invalid, has the same
+ * captures as another with different names, too many methods are in
+ * use, or memory is exhausted.
+ */
+int router_add(struct router *router, const char *method, const char *pattern, int value)
+{
+    struct route_table *fixed = &router->fixed;
+    struct route_entry *entries;
+    struct route_node **slot;
+    struct route_node *node;
+    const char *p = pattern;
+    size_t len;
+    int nparams = 0;
+    int m;
+
+    if (router->built || value < 0 || strlen(method) > ROUTER_METHOD_MAX)
+    {
+        return -1;
+    }
+    m = router_method(router, method, strlen(method));
+    if (m < 0)
+    {
+        if (router->nmethods == ROUTER_METHODS)
+        {
+            return -1;
+        }
+        m = router->nmethods++;
+        strcpy(router->methods[m], method);
+    }
+
+    if (strpbrk(pattern, ":*") == NULL)
+    {
+        if (fixed->nentries == fixed->cap)
+        {
+            entries = realloc(fixed->entries, (fixed->cap * 2 + 16) * sizeof(*entries));
+            if (entries == NULL)
+            {
+                return -1;
+            }
+            fixed->entries = entries;
+            fixed->cap = fixed->cap * 2 + 16;
+        }
+        fixed->entries[fixed->nentries].path = strdup(pattern);
+        if (fixed->entries[fixed->nentries].path == NULL)
+        {
+            return -1;
+        }
+        fixed->entries[fixed->nentries].method = m;
+        fixed->entries[fixed->nentries].len = strlen(pattern);
+        fixed->entries[fixed->nentries].value = value;
+        fixed->nentries++;
+        return 0;
+    }
+
+    if (router->trees[m] == NULL)
+    {
+        router->trees[m] = router_node_new("", 0);
+        if (router->trees[m] == NULL)
+        {
+            return -1;
+        }
+    }
+    node = router->trees[m];
+
+    while (*p != '\0')
+    {
+        if (*p == ':' || *p == '*')
+        {
+            // A capture is a whole segment, has a name, and a rest capture comes last.
+            len = strcspn(p + 1, "/:*");
+            if ((p != pattern && p[-1] != '/') || len == 0 ||
+                (p[1 + len] != '\0' && (*p == '*' || p[1 + len] != '/')) ||
+                ++nparams > ROUTER_PARAMS_MAX)
+            {
+                return -1;
+            }
+            slot = *p == ':' ? &node->param : &node->rest;
+            if (*slot == NULL)
+            {
+                *slot = router_node_new(p + 1, len);
+                if (*slot == NULL)
+                {
+                    return -1;
+                }
+            }
+            else if ((*slot)->len != len || memcmp((*slot)->label, p + 1, len) != 0)
+            {
+                return -1;
+            }
+            node = *slot;
+            p += 1 + len;
+            continue;
+        }
+
+        len = strcspn(p, ":*");
+        node = router_insert(node, p, len);
+        if (node == NULL)
+        {
+            return -1;
+        }
+        p += len;
+    }
+
+    if (node->value >= 0)
+    {
+        // The same route twice.
+        return -1;
+    }
+    node->value = value;
+    return 0;
+}
+
+/**
+ * @brief Finds a seed under which every route in a bucket lands in a
+ * free slot of its own, and takes those slots.
+ *
+ * @param fixed
+ * @param members the routes in the bucket.
+ * @param n how many there are.
+ * @param slot room for n slot numbers.
+ * @return the seed.
+ */
+static uint32_t router_place(struct route_table *fixed, const int *members, int n, uint32_t *slot)
+{
+    const struct route_entry *e;
+    uint32_t seed;
+    int i, j;
+
+    for (seed = 1;; seed++)
+    {
+        for (i = 0; i < n; i++)
+        {
+            e = &fixed->entries[members[i]];
+            slot[i] = router_hash(seed, e->method, e->path, e->len) & (fixed->nslots - 1);
+            if (fixed->slots[slot[i]] >= 0)
+            {
+                break;
+            }
+            for (j = 0; j < i && slot[j] != slot[i]; j++)
+            {
+                continue;
+            }
+            if (j < i)
+            {
+                break;
+            }
+        }
+        if (i == n)
+        {
+            break;
+        }
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        fixed->slots[slot[i]] = members[i];
+    }
+    return seed;
+}
+
+/**
+ * @brief Builds the perfect hash table of the routes without
+ * captures; after this the router can be used.
+ *
+ * @param router
+ * @return 0 on success, -1 if a route was added twice or memory is
+ * exhausted.
+ */
+int router_build(struct router *router)
+{
+    struct route_table *fixed = &router->fixed;
+    const struct route_entry *e;
+    const struct route_entry *f;
+    int *start = NULL;
+    int *members = NULL;
+    uint32_t *slot = NULL;
+    uint32_t b;
+    int i, j, n, size, largest;
+
+    router->built = 1;
+    n = fixed->nentries;
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    // Buckets of two routes on average, and slots at most four fifths full.
+    fixed->nseeds = router_pow2((n + 1) / 2);
+    fixed->nslots = router_pow2(n + n / 4 + 1);
+    fixed->seeds = calloc(fixed->nseeds, sizeof(*fixed->seeds));
+    fixed->slots = malloc(fixed->nslots * sizeof(*fixed->slots));
+    start = calloc(fixed->nseeds + 1, sizeof(*start));
+    members = malloc(n * sizeof(*members));
+    slot = malloc(n * sizeof(*slot));
+    if (fixed->seeds == NULL || fixed->slots == NULL || start == NULL || members == NULL || slot == NULL)
+    {
+        free(start);
+        free(members);
+        free(slot);
+        return -1;
+    }
+    memset(fixed->slots, 0xff, fixed->nslots * sizeof(*fixed->slots));
+
+    // Group the routes by bucket: members[start[b]] up to members[start[b + 1]].
+    for (i = 0; i < n; i++)
+    {
+        e = &fixed->entries[i];
+        start[(router_hash(0, e->method, e->path, e->len) & (fixed->nseeds - 1)) + 1]++;
+    }
+    for (b = 0; b < fixed->nseeds; b++)
+    {
+        start[b + 1] += start[b];
+    }
+    for (i = n - 1; i >= 0; i--)
+    {
+        e = &fixed->entries[i];
+        b = router_hash(0, e->method, e->path, e->len) & (fixed->nseeds - 1);
+        members[--start[b + 1]] = i;
+    }
+    // Filling from the ends left each bucket's start one place to the right.
+    for (b = 0; b < fixed->nseeds; b++)
+    {
+        start[b] = start[b + 1];
+    }
+    start[fixed->nseeds] = n;
+
+    largest = 0;
+    for (b = 0; b < fixed->nseeds; b++)
+    {
+        size = start[b + 1] - start[b];
+        largest = size > largest ? size : largest;
+
+        // Routes in the same bucket hash alike under every seed, so duplicates show up here.
+        for (i = start[b]; i < start[b + 1]; i++)
+        {
+            e = &fixed->entries[members[i]];
+            for (j = start[b]; j < i; j++)
+            {
+                f = &fixed->entries[members[j]];
+                if (e->method == f->method && e->len == f->len && memcmp(e->path, f->path, e->len) == 0)
+                {
+                    free(start);
+                    free(members);
+                    free(slot);
+                    return -1;
+                }
+            }
+        }
+    }
+
+    // The largest buckets are the hardest to place, so they go while most slots are free.
+    for (size = largest; size > 0; size--)
+    {
+        for (b = 0; b < fixed->nseeds; b++)
+        {
+            if (start[b + 1] - start[b] == size)
+            {
+                fixed->seeds[b] = router_place(fixed, members + start[b], size, slot);
+            }
+        }
+    }
+
+    free(start);
+    free(members);
+    free(slot);
+    return 0;
+}
+
+/**
+ * @brief Finds the route for a request.
+ *
+ * @param router
+ * @param method
+ * @param method_len
+ * @param path without the query string.
+ * @param path_len
+ * @param match filled in with the captures.
+ * @return the route's value, or -1 if none matches.
+ */
+int router_match(const struct router *router, const char *method, size_t method_len,
+                 const char *path, size_t path_len, struct route_match *match)
+{
+    const struct route_table *fixed = &router->fixed;
+    const struct route_entry *e;
+    uint32_t b;
+    int32_t i;
+    int m;
+
+    match->nparams = 0;
+    m = router_method(router, method, method_len);
+    if (m < 0)
+    {
+        return -1;
+    }
+
+    if (fixed->nentries > 0)
+    {
+        b = router_hash(0, m, path, path_len) & (fixed->nseeds - 1);
+        i = fixed->slots[router_hash(fixed->seeds[b], m, path, path_len) & (fixed->nslots - 1)];
+        if (i >= 0)
+        {
+            e = &fixed->entries[i];
+            if (e->method == m && e->len == path_len && memcmp(e->path, path, path_len) == 0)
+            {
+                return e->value;
+            }
+        }
+    }
+
+    if (router->trees[m] == NULL)
+    {
+        return -1;
+    }
+    return router_lookup(router->trees[m], path, path_len, match);
+}
+
+/**
+ * @brief Frees everything the router holds.
+ *
+ * @param router
+ */
+void router_destroy(struct router *router)
+{
+    int i;
+
+    for (i = 0; i < router->nmethods; i++)
+    {
+        router_node_free(router->trees[i]);
+    }
+    for (i = 0; i < router->fixed.nentries; i++)
+    {
+        free(router->fixed.entries[i].path);
+    }
+    free(router->fixed.entries);
+    free(router->fixed.slots);
+    free(router->fixed.seeds);
+    router_init(router);
+}
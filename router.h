@@ -0,0 +1,74 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Methods one router can tell apart.
+#define ROUTER_METHODS 8
+
+// Longest method name, e.g. "OPTIONS".
+#define ROUTER_METHOD_MAX 15
+
+// Most :param and *param captures one route may have.
+#define ROUTER_PARAMS_MAX 8
+
+/*
+    One captured path segment (or rest of the path, for *param). It
+    points into the path that was matched and into the pattern the
+    route was added with, and is not NUL-terminated.
+*/
+struct route_param
+{
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t len;
+};
+
+struct route_match
+{
+    int nparams;
+    struct route_param params[ROUTER_PARAMS_MAX];
+};
+
+struct route_node;
+struct route_entry;
+
+/*
+    The routes without captures, in a perfect hash table: every route
+    has a slot of its own, found with two hashes and one comparison.
+*/
+struct route_table
+{
+    struct route_entry *entries;
+    int nentries;
+    int cap;
+
+    // Indexes into entries, -1 for none; per-bucket seeds for the second hash.
+    int32_t *slots;
+    uint32_t *seeds;
+    uint32_t nslots;
+    uint32_t nseeds;
+};
+
+struct router
+{
+    int nmethods;
+    char methods[ROUTER_METHODS][ROUTER_METHOD_MAX + 1];
+
+    // One radix trie per method.
+    struct route_node *trees[ROUTER_METHODS];
+
+    struct route_table fixed;
+    int built;
+};
+
+void router_init(struct router *router);
+int router_add(struct router *router, const char *method, const char *pattern, int value);
+int router_build(struct router *router);
+int router_match(const struct router *router, const char *method, size_t method_len,
+                 const char *path, size_t path_len, struct route_match *match);
+void router_destroy(struct router *router);
+
+#endif
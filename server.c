@@ -1,9 +1,74 @@
+/*
+    Build:
+        cc -O2 -pthread -o server server.c accept_queue.c config.c log.c reactor.c timer_wheel.c mpsc.c pool.c handler.c coroutine.c buffer.c arena.c output.c connection.c framing.c http.c filecache.c histogram.c metrics.c qsbr.c respcache.c compress.c proxy.c router.c uring.c -lz
+    For zstd as well as gzip, add -DHAVE_ZSTD and -lzstd.
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+#include "accept_queue.h"
+#include "compress.h"
+#include "config.h"
+#include "connection.h"
+#include "filecache.h"
+#include "handler.h"
+#include "http.h"
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
+#include "proxy.h"
+#include "reactor.h"
+#include "respcache.h"
+#include "uring.h"
+
+/*
+    The listening socket is registered with the reactor like any
+    other descriptor. When it becomes readable there are connections
+    waiting in the accept queue.
+*/
+struct listener
+{
+    struct event_source source;
+
+    const struct config *config;
+
+    // Most connections accepted per wakeup, 0 for no limit.
+    int accept_batch;
+
+    // A descriptor kept in reserve so we can shed load at EMFILE.
+    int spare_fd;
+};
+
+int shed_connection(struct listener *listener);
+
+/*
+    A worker is one thread with its own listening socket and its own
+    event loop. Workers share nothing, so they never contend with
+    each other for locks or cache lines.
+*/
+struct worker
+{
+    int id;
+    pthread_t thread;
+    const struct config *config;
+
+    // Shared by all workers; NULL when handlers run inline.
+    struct pool *pool;
+};
+
 /**
  * @brief This function is called when a system call fails. 
  * It displays a message about the error on stderr and then 
@@ -17,54 +82,139 @@ void error(char *msg)
     exit(1);
 }
 
-int main(int argc, char *argv[])
+/**
+ * @brief Accepts the connections waiting on the listening socket.
+ *
+ * accept4() hands back sockets that are already non-blocking and
+ * close-on-exec, so a new connection costs one system call instead
+ * of three. At most accept_batch connections are taken per wakeup so
+ * a connection storm cannot starve clients that are already being
+ * served; the listener is level-triggered, so epoll reports it again
+ * on the next round if connections are still queued.
+ *
+ * @param reactor
+ * @param source
+ * @param events
+ */
+void listener_on_event(struct reactor *reactor, struct event_source *source, uint32_t events)
+{
+    struct listener *listener = (struct listener *) source;
+    int newsockfd;
+    int accepted;
+
+    (void) events;
+
+    for (accepted = 0; listener->accept_batch == 0 || accepted < listener->accept_batch; accepted++)
+    {
+        /*
+            The client address is not used, so NULL is passed instead
+            of a sockaddr_in and its length.
+        */
+        newsockfd = accept4(source->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newsockfd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if ((errno == EMFILE || errno == ENFILE) && shed_connection(listener) == 0)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("ERROR on accept");
+            }
+            return;
+        }
+
+        if (listener->config->proxy != NULL)
+        {
+            proxy_open(reactor, newsockfd, listener->config);
+        }
+        else
+        {
+            connection_open(reactor, newsockfd, listener->config);
+        }
+    }
+}
+
+/**
+ * @brief Turns away one queued connection when we are out of file
+ * descriptors.
+ *
+ * Because the listener is level-triggered, leaving the connection in
+ * the queue would make epoll report it again immediately and spin
+ * the worker. Instead the reserved descriptor is given up, the
+ * connection is accepted and closed straight away, and the
+ * descriptor is reserved again.
+ *
+ * @param listener
+ * @return 0 if a connection was shed, -1 if there was no spare
+ * descriptor to make room with.
+ */
+int shed_connection(struct listener *listener)
+{
+    int fd;
+
+    if (listener->spare_fd < 0)
+    {
+        return -1;
+    }
+    close(listener->spare_fd);
+
+    fd = accept(listener->source.fd, NULL, NULL);
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    listener->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return fd >= 0 ? 0 : -1;
+}
+
+/**
+ * @brief Raises the open file limit to the hard limit so that one
+ * process can hold tens of thousands of client sockets.
+ */
+void raise_fd_limit(void)
 {
-    /*  
-        sockfd and newsockfd are file descriptors.
-        These two variables store the values returned
-        by the socket system call and the accept system call 
-    */ 
-    int sockfd, newsockfd;
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+/**
+ * @brief Creates, binds and starts listening on a socket for the
+ * configured port.
+ *
+ * @param config
+ * @return the listening socket, in non-blocking mode.
+ */
+int open_listener(const struct config *config)
+{
+    // sockfd stores the value returned by the socket system call.
+    int sockfd;
     
     // portNumber stores the port number on which the server accepts connections.
     int portNumber;
 
-    /* 
-        clilength stores the size of the address of the client.
-        this is needed for the accept system call.
-    */
-    int clilength;
-
-    // The server reads characters from the socket connection into this buffer. 
-    char buffer[256];
-
     /*
         sockaddr_in is a structure containing an internet address.
         
         This struct is defined in <netinet/in.h>
         
-        serv_addr will contain the address of the client which 
-        connects to the server.
+        serv_addr will contain the address on which the server
+        accepts connections.
     */
-    struct sockaddr_in serv_addr, cli_addr;
-    
-    /* 
-        This is the return value for read() and write() calls
-        i.e. it contains the number of characters read or written
-    */
-    int n;
+    struct sockaddr_in serv_addr;
 
-    /*
-      The user needs to pass in the port number on which 
-      the server will accept connections as an argument.
-      
-      This code displays an error message if the user fails to do this.
-    */
-    if (argc < 2)
-    {
-        fprintf(stderr, "ERROR, no port provided\n");
-        exit(1);
-    }
+    // The value passed to setsockopt() to switch an option on.
+    int on = 1;
 
     /* 
        The socket() system call creates a new socket.
@@ -98,11 +248,8 @@ int main(int argc, char *argv[])
     /*
         The port number on which the server will listen
         for connections.
-
-        This uses atoi() to convert this from a string
-        of digits to an integer.
     */
-    portNumber = atoi(argv[1]);
+    portNumber = config->port;
 
     /*
         serv_addr is a structure of type struct sockaddr_in.
@@ -134,6 +281,18 @@ int main(int argc, char *argv[])
     */
     serv_addr.sin_port = htons(portNumber);
 
+    /*
+        With several workers, each one opens its own listening
+        socket on the same port. SO_REUSEPORT lets them all bind it,
+        and the kernel then spreads incoming connections across the
+        sockets, so every worker has a private accept queue.
+    */
+    if (config->workers > 1 &&
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+    {
+        error("ERROR setting SO_REUSEPORT");
+    }
+
     /*
         The bind system call binds a socket to an address.
         
@@ -159,75 +318,265 @@ int main(int argc, char *argv[])
         number of connections that can be waiting while the 
         process is handling a particular connection.
 
-        The second arg should be set to 5, the max size
-        permitted by most systems.
+        The kernel caps the backlog at net.core.somaxconn, which
+        is 4096 on current systems, and a burst of connections
+        larger than the backlog is dropped or stalls in connect().
+        The backlog therefore defaults to somaxconn and can be set
+        with --backlog (see config.c).
+    */
+    if (listen(sockfd, config->backlog) < 0)
+    {
+        error("ERROR on listen");
+    }
 
-        If the first argument is a valid socket, this call
-        cannot fail, and so the code doesn't check for errors.
+    // Let the sampler report on this listener's accept queue.
+    accept_queue_watch(sockfd);
+
+    /*
+        The listening socket is switched to non-blocking mode so that
+        accept() returns EAGAIN instead of blocking once the accept
+        queue is empty.
     */
-    listen(sockfd, 5);
+    if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK) < 0)
+    {
+        error("ERROR setting O_NONBLOCK");
+    }
+
+    return sockfd;
+}
+
+/**
+ * @brief Runs one worker: its own listening socket and its own
+ * event loop, sharing nothing with the other workers.
+ *
+ * @param arg the worker's struct worker.
+ * @return NULL
+ */
+void *worker_run(void *arg)
+{
+    struct worker *worker = arg;
+    int sockfd;
 
     /*
-        The accept() system call causes the process to block
-        until a client connects to the server. Thus, it wakes
-        up the process when a connection from a client has been
-        successfully established. It returns a new file descriptor,
-        and all communication on this connection should be done
-        using the new file descriptor.
+        The reactor owns the listening socket and every client
+        socket, and tells us which of them are ready to be serviced.
+    */
+    struct reactor reactor;
+    struct listener listener;
+
+    sockfd = open_listener(worker->config);
+
+    /*
+        With --engine=uring the accept/read/write sequence is run
+        through io_uring instead (see uring.c). If the kernel does not
+        support it we fall back to the epoll reactor below.
+    */
+    if (worker->config->engine == ENGINE_URING)
+    {
+        uring_run(sockfd, worker->config);
+        perror("ERROR running io_uring engine, falling back to epoll");
+    }
+
+    if (reactor_init(&reactor) < 0)
+    {
+        error("ERROR creating epoll instance");
+    }
+    reactor.pool = worker->pool;
+
+    if (worker->config->root != NULL)
+    {
+        reactor.files = filecache_create(&reactor, worker->config->root, worker->config->file_cache);
+        if (reactor.files == NULL)
+        {
+            error("ERROR opening document root");
+        }
+    }
+
+    listener.source.fd = sockfd;
+    listener.source.on_event = listener_on_event;
+    listener.config = worker->config;
+    listener.accept_batch = worker->config->accept_batch;
+    listener.spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (reactor_add(&reactor, &listener.source, EPOLLIN) < 0)
+    {
+        error("ERROR registering listener");
+    }
+
+    /*
+        From here on the reactor drives everything: new connections
+        are accepted by listener_on_event() and each client is served
+        by its connection (see connection.c) as its socket becomes
+        readable or writable. One thread serves every client of
+        this worker.
+    */
+    reactor_run(&reactor);
+
+    reactor_close(&reactor);
+    close(listener.spare_fd);
+    close(sockfd);
+    return NULL;
+}
+
+/**
+ * @brief Pins a worker thread to one CPU so its connections, caches
+ * and event loop stay on that core.
+ *
+ * @param worker
+ */
+void pin_worker(struct worker *worker)
+{
+    cpu_set_t cpus;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (ncpus < 1)
+    {
+        return;
+    }
+
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->id % ncpus, &cpus);
+    errno = pthread_setaffinity_np(worker->thread, sizeof(cpus), &cpus);
+    if (errno != 0)
+    {
+        perror("ERROR pinning worker");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    // Settings taken from the command line.
+    struct config config;
 
-        The second arg is a reference pointer to the address of the
-        client on the other end of the connection.
+    // One entry per worker thread.
+    struct worker *workers;
+    struct pool *pool = NULL;
+    int i;
 
-        The last arg is the size of the stucture.
+    /*
+        The port number and any options are read from the
+        command line (see config.c).
     */
-    clilength = sizeof(cli_addr);
-    newsockfd = accept(sockfd, (struct sockaddr*) &cli_addr, &clilength);
-    if (newsockfd < 0)
+    config_parse(&config, argc, argv);
+
+    /*
+        Writing to a socket whose peer has gone away raises SIGPIPE,
+        which would kill the whole server. Ignoring it makes write()
+        fail with EPIPE instead, which only closes that connection.
+    */
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+
+    // Let the HTTP parser use the vector instructions this CPU has.
+    http_init();
+
+    // HTTP requests are dispatched on method and path (see handler.c).
+    if (handler_init() < 0)
     {
-        error("ERROR on acccept");
+        error("ERROR building the route table");
     }
 
+    /*
+        Small files are kept in memory as complete responses, shared
+        by all workers (see respcache.c), in compressed form too for
+        clients that accept it (see compress.c).
+    */
+    respcache_init(config.response_cache);
+    compress_init(config.compress_cache);
 
     /*
-        NOTE: We would only get to this point after a client
-        has successfully connected to our server.
+        With --proxy, requests are forwarded to upstream servers
+        instead of being answered here (see proxy.c).
+    */
+    if (config.proxy != NULL && proxy_init(config.proxy) < 0)
+    {
+        error("ERROR resolving proxy upstreams");
+    }
 
-        This code initializes the buffer using the bzero() 
-        function, and then reads from the socket.
+    /*
+        Messages are logged through per-thread ring buffers that a
+        background thread writes out, so logging never blocks a
+        worker (see log.c).
     */
-    bzero(buffer[256]);
+    if (log_start() < 0)
+    {
+        error("ERROR starting log writer");
+    }
 
     /*
-        NOTE: the read() call uses the new file descriptor
-        returned by the socket(). Also note, that the read()
-        will block until there is something for it to read in
-        the socket, i.e. after the client has executed a write().
+        A background thread periodically samples how full the accept
+        queues are and warns when the kernel has had to turn
+        connections away (see accept_queue.c).
+    */
+    if (accept_queue_start_sampler(config.sample_interval) < 0)
+    {
+        error("ERROR starting accept queue sampler");
+    }
 
-        It will read either the total number of characters in the
-        socket or 255, whichever is less, and return the number
-        of characters read.
+    /*
+        With --admin-port, a background thread serves latency
+        histograms and counters, added up over every thread, to
+        Prometheus (see metrics.c).
     */
-    n = read(newsockfd, buffer, 255);
-    if (n < 0)
+    if (config.admin_port > 0 && metrics_start(config.admin_addr, config.admin_port) < 0)
     {
-        error("ERROR reading from socket");
+        error("ERROR starting admin listener");
     }
-    printf("Here is the message: %s\n", buffer);
 
     /*
-        Once a connection has been established, both ends can both
-        read and write to the connection. Naturally, everything
-        written by the client will be read by the server, and everything
-        written by the server will be read by the client.
+        With --pool, handlers run on a separate set of threads that
+        every worker hands messages to (see pool.c), so a slow handler
+        never holds up a worker's event loop.
+    */
+    if (config.pool_threads > 0)
+    {
+        pool = pool_create(config.pool_threads);
+        if (pool == NULL)
+        {
+            error("ERROR starting thread pool");
+        }
+    }
 
-        The last argument of write() is the size of the message.
+    /*
+        With a single worker (the default) the main thread does all
+        the work. Otherwise every worker gets a thread of its own,
+        pinned to a core, and the main thread just waits for them.
     */
-    n = write(newsockfd, "I got your message", 18);
-    if (n < 0)
+    workers = calloc(config.workers, sizeof(*workers));
+    if (workers == NULL)
     {
-        error("ERROR writing socket");
+        error("ERROR allocating workers");
+    }
+
+    for (i = 0; i < config.workers; i++)
+    {
+        workers[i].id = i;
+        workers[i].config = &config;
+        workers[i].pool = pool;
+    }
+
+    if (config.workers == 1)
+    {
+        worker_run(&workers[0]);
+        free(workers);
+        return 0;
+    }
+
+    for (i = 0; i < config.workers; i++)
+    {
+        errno = pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+        if (errno != 0)
+        {
+            error("ERROR creating worker thread");
+        }
+        pin_worker(&workers[i]);
+    }
+
+    for (i = 0; i < config.workers; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
     }
 
     // terminate the program.
+    free(workers);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,27 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include "mpsc.h"
+
+struct reactor;
+
+/*
+    A unit of work handed from a reactor to the thread pool. run() is
+    called on a pool thread; the task is then posted back to the
+    reactor it came from, which calls complete() on its own thread.
+    Owners embed a task as the first member of their own structure
+    and cast back to it in the callbacks.
+*/
+struct task
+{
+    // Must stay first: links the task into pool and reactor queues.
+    struct mpsc_node node;
+
+    void (*run)(struct task *task);
+    void (*complete)(struct task *task);
+
+    // The reactor complete() runs on.
+    struct reactor *reactor;
+};
+
+#endif
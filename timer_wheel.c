@@ -0,0 +1,184 @@
+#include <string.h>
+
+#include "timer_wheel.h"
+
+/**
+ * @brief Prepares an empty wheel whose current tick is now.
+ *
+ * @param wheel
+ * @param now
+ */
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now)
+{
+    int level, slot;
+
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now;
+    for (level = 0; level < TIMER_LEVELS; level++)
+    {
+        for (slot = 0; slot < TIMER_SLOTS; slot++)
+        {
+            wheel->slots[level][slot].next = &wheel->slots[level][slot];
+            wheel->slots[level][slot].prev = &wheel->slots[level][slot];
+        }
+    }
+}
+
+/**
+ * @brief Prepares a timer that is not armed.
+ *
+ * @param timer
+ * @param fn called when the timer expires.
+ * @param data passed along for fn to use.
+ */
+void timer_init(struct timer *timer, timer_fn fn, void *data)
+{
+    memset(timer, 0, sizeof(*timer));
+    timer->fn = fn;
+    timer->data = data;
+}
+
+/**
+ * @brief Links a timer into the slot matching its expiry.
+ *
+ * The level is the first whose range covers the distance to the
+ * expiry; within it, the slot is picked by the expiry's bits for
+ * that level.
+ *
+ * @param wheel
+ * @param timer
+ */
+static void timer_place(struct timer_wheel *wheel, struct timer *timer)
+{
+    uint64_t delta = timer->expires - wheel->now;
+    struct timer *head;
+    int level = 0;
+
+    while (level < TIMER_LEVELS - 1 && delta >= (1ULL << (TIMER_SLOT_BITS * (level + 1))))
+    {
+        level++;
+    }
+    if (level == TIMER_LEVELS - 1 && delta >= (1ULL << (TIMER_SLOT_BITS * TIMER_LEVELS)))
+    {
+        timer->expires = wheel->now + (1ULL << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1;
+    }
+
+    head = &wheel->slots[level][(timer->expires >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1)];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void timer_unlink(struct timer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+/**
+ * @brief Arms (or re-arms) a timer to fire at the given tick.
+ *
+ * A tick that has already passed fires on the next one.
+ *
+ * @param wheel
+ * @param timer
+ * @param expires
+ */
+void timer_arm(struct timer_wheel *wheel, struct timer *timer, uint64_t expires)
+{
+    if (timer_armed(timer))
+    {
+        timer_unlink(timer);
+        wheel->count--;
+    }
+
+    timer->expires = expires > wheel->now ? expires : wheel->now + 1;
+    timer_place(wheel, timer);
+    wheel->count++;
+}
+
+/**
+ * @brief Disarms a timer; harmless if it is not armed.
+ *
+ * @param wheel
+ * @param timer
+ */
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer)
+{
+    if (timer_armed(timer))
+    {
+        timer_unlink(timer);
+        wheel->count--;
+    }
+}
+
+/**
+ * @brief Moves every timer in a slot of a coarse level down to the
+ * level that now matches its distance.
+ *
+ * @param wheel
+ * @param level
+ */
+static void timer_cascade(struct timer_wheel *wheel, int level)
+{
+    struct timer *head = &wheel->slots[level][(wheel->now >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1)];
+    struct timer *timer;
+
+    while (head->next != head)
+    {
+        timer = head->next;
+        timer_unlink(timer);
+        timer_place(wheel, timer);
+    }
+}
+
+/**
+ * @brief Processes every tick up to now, running the timers that expire.
+ *
+ * A timer's callback may re-arm or cancel any timer, including itself.
+ *
+ * @param wheel
+ * @param now
+ */
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now)
+{
+    struct timer *head;
+    struct timer *timer;
+    int level;
+
+    while (wheel->now < now)
+    {
+        wheel->now++;
+
+        /*
+            Each time a level wraps around, the next slot of the level
+            above holds the timers that now fall within range.
+        */
+        for (level = 1; level < TIMER_LEVELS; level++)
+        {
+            if ((wheel->now & ((1ULL << (TIMER_SLOT_BITS * level)) - 1)) != 0)
+            {
+                break;
+            }
+            timer_cascade(wheel, level);
+        }
+
+        head = &wheel->slots[0][wheel->now & (TIMER_SLOTS - 1)];
+        while (head->next != head)
+        {
+            timer = head->next;
+            timer_unlink(timer);
+            wheel->count--;
+            timer->fn(timer);
+        }
+
+        if (wheel->count == 0)
+        {
+            // Nothing left to expire; skip straight to the present.
+            wheel->now = now;
+        }
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+/*
+    A hierarchical timing wheel: TIMER_LEVELS wheels of TIMER_SLOTS
+    slots each. A timer due within TIMER_SLOTS ticks sits in the
+    slot for its exact tick on level 0; one due further out sits on
+    a coarser level and is moved down (cascaded) as its time
+    approaches. Arming and cancelling are O(1) list operations no
+    matter how many timers exist, which is what lets every
+    connection carry its own timeout.
+
+    With 10 ms ticks, four levels of 64 slots reach about 46 hours;
+    anything later is clamped to that.
+*/
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 4
+
+struct timer;
+
+typedef void (*timer_fn)(struct timer *timer);
+
+/*
+    A timer is embedded in whatever it times out. It is linked
+    directly into the wheel's slot lists, so the wheel allocates
+    nothing.
+*/
+struct timer
+{
+    struct timer *next;
+    struct timer *prev;
+
+    // The tick the timer is due at.
+    uint64_t expires;
+
+    timer_fn fn;
+    void *data;
+};
+
+struct timer_wheel
+{
+    // The last tick that has been processed.
+    uint64_t now;
+
+    // Number of armed timers.
+    unsigned long count;
+
+    // Each slot is a circular list headed by a sentinel.
+    struct timer slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now);
+void timer_init(struct timer *timer, timer_fn fn, void *data);
+void timer_arm(struct timer_wheel *wheel, struct timer *timer, uint64_t expires);
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer);
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now);
+
+/**
+ * @brief Whether the timer is currently in a wheel.
+ */
+static inline int timer_armed(const struct timer *timer)
+{
+    return timer->next != NULL;
+}
+
+#endif
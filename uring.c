@@ -0,0 +1,1134 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "arena.h"
+#include "buffer.h"
+#include "config.h"
+#include "connection.h"
+#include "framing.h"
+#include "handler.h"
+#include "http.h"
+#include "log.h"
+#include "metrics.h"
+#include "output.h"
+#include "uring.h"
+
+/*
+    The io_uring engine talks to the kernel through two rings shared
+    with it in memory: we write requests (SQEs) into the submission
+    queue and the kernel posts results (CQEs) into the completion
+    queue. Many requests are handed over with a single
+    io_uring_enter() call, which is where the syscall savings over
+    accept()/read()/write() come from.
+*/
+#define URING_ENTRIES 4096
+
+// Provided buffers the kernel picks from when a recv completes.
+#define URING_BUF_GROUP 0
+#define URING_BUF_COUNT 1024
+#define URING_BUF_SIZE BUFFER_SMALL
+
+// Reply segments sent per sendmsg; replies are only a few segments long.
+#define URING_MAX_IOV 8
+
+// How long to wait before accepting again when out of descriptors with none to spare.
+#define URING_ACCEPT_BACKOFF_NS (100 * 1000 * 1000)
+
+/*
+    The low bits of user_data say which operation completed. The
+    rest is the connection pointer (malloc() memory is at least
+    8-byte aligned, so those bits are always free).
+*/
+#define URING_OP_ACCEPT 0
+#define URING_OP_RECV 1
+#define URING_OP_SEND 2
+#define URING_OP_CLOSE 3
+#define URING_OP_BACKOFF 4
+#define URING_OP_TIMEOUT 5
+#define URING_OP_MASK 7
+
+struct uring_conn
+{
+    int fd;
+
+    // When it was accepted (metrics_now()), 0 once its first reply has been sent.
+    uint64_t opened;
+
+    // When the partly received message began (metrics_now()), 0 if none has.
+    uint64_t message_start;
+
+    /*
+        How long the recv or send in flight may take before it is
+        cancelled (see uring_link_timeout()). The kernel reads it when
+        the operation is submitted.
+    */
+    struct __kernel_timespec timeout;
+
+    // Set once the last reply is queued: close when it has gone out.
+    int closing;
+
+    // Splits the input into messages.
+    struct framer framer;
+
+    // Input carried over when a message spans several recvs.
+    struct buffer in;
+
+    /*
+        The reply, and the message header describing it to the
+        kernel. Both must stay put until the send has completed.
+    */
+    struct output out;
+    struct msghdr msg;
+    struct iovec iov[URING_MAX_IOV];
+
+    // Every live connection is listed, so they can all be closed if the ring fails.
+    struct uring_conn *prev;
+    struct uring_conn *next;
+
+    // The operation waiting for room in the submission queue, if any (see uring_get_sqe()).
+    struct uring_conn *deferred_next;
+    int deferred_op;
+};
+
+struct uring
+{
+    int fd;
+    const struct config *config;
+
+    // The listening socket, and a descriptor kept in reserve to shed load at EMFILE.
+    int sockfd;
+    int spare_fd;
+
+    // The pause before the accept is armed again when shedding fails.
+    struct __kernel_timespec backoff;
+
+    // The rings as mapped, for unmapping them.
+    char *sq_ptr;
+    size_t sq_size;
+    size_t sqes_size;
+
+    // Submission queue, mapped from the kernel.
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail;
+
+    // Completion queue, mapped from the kernel.
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Provided buffer ring used by recv.
+    struct io_uring_buf_ring *buf_ring;
+    char *bufs;
+
+    // Live connections, and those whose next operation did not fit in the submission queue.
+    struct uring_conn *conns;
+    struct uring_conn *deferred_head;
+    struct uring_conn *deferred_tail;
+
+    // The URING_OP_ (accept or backoff) that had no room in the submission queue either, or -1.
+    int accept_deferred;
+
+    // Scratch memory for the request being handled; requests are handled one at a time.
+    struct arena arena;
+};
+
+/*
+    glibc does not wrap the io_uring system calls, so they are
+    invoked directly.
+*/
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * @brief Creates the ring and maps the submission and completion
+ * queues into our address space.
+ *
+ * @param ring
+ * @return 0 on success, -1 on failure with errno set.
+ */
+static int uring_init(struct uring *ring)
+{
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    char *sq_ptr, *cq_ptr;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    ring->buf_ring = MAP_FAILED;
+    ring->spare_fd = -1;
+    ring->accept_deferred = -1;
+
+    /*
+        Only this thread ever submits, and completions are only needed
+        when we ask for them, which lets the kernel skip some locking
+        and inter-processor interrupts. Older kernels reject these
+        flags, in which case we retry without them.
+    */
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    ring->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (ring->fd < 0 && errno == EINVAL)
+    {
+        memset(&p, 0, sizeof(p));
+        ring->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    }
+    if (ring->fd < 0)
+    {
+        return -1;
+    }
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        // Every kernel with provided buffer rings also has this.
+        errno = ENOSYS;
+        return -1;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > sq_size)
+    {
+        sq_size = cq_size;
+    }
+
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+    {
+        return -1;
+    }
+    ring->sq_ptr = sq_ptr;
+    ring->sq_size = sq_size;
+    cq_ptr = sq_ptr;
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        return -1;
+    }
+
+    ring->sq_head = (unsigned *) (sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq_ptr + p.sq_off.array);
+    ring->sq_local_tail = *ring->sq_tail;
+
+    ring->cq_head = (unsigned *) (cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq_ptr + p.cq_off.cqes);
+    return 0;
+}
+
+/**
+ * @brief Undoes as much of uring_init() and uring_setup_buffers() as
+ * was done, keeping errno.
+ *
+ * @param ring
+ */
+static void uring_destroy(struct uring *ring)
+{
+    int saved = errno;
+
+    if (ring->fd >= 0)
+    {
+        // Closing the ring also drops the provided buffer registration.
+        close(ring->fd);
+    }
+    if (ring->sqes != NULL)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->sq_ptr != NULL)
+    {
+        munmap(ring->sq_ptr, ring->sq_size);
+    }
+    if (ring->buf_ring != MAP_FAILED)
+    {
+        munmap(ring->buf_ring, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+    }
+    if (ring->spare_fd >= 0)
+    {
+        close(ring->spare_fd);
+    }
+    free(ring->bufs);
+    arena_release(&ring->arena);
+    errno = saved;
+}
+
+/**
+ * @brief Registers a ring of buffers the kernel can fill on recv.
+ *
+ * With provided buffers a recv does not pin a buffer while it waits
+ * for data: the kernel takes one from the ring only when bytes
+ * arrive, so thousands of idle connections share URING_BUF_COUNT
+ * buffers.
+ *
+ * @param ring
+ * @return 0 on success, -1 on failure with errno set.
+ */
+static int uring_setup_buffers(struct uring *ring)
+{
+    struct io_uring_buf_reg reg;
+    size_t ring_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    int i;
+
+    ring->buf_ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    ring->bufs = malloc((size_t) URING_BUF_COUNT * URING_BUF_SIZE);
+    if (ring->bufs == NULL)
+    {
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) ring->buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < URING_BUF_COUNT; i++)
+    {
+        struct io_uring_buf *buf = &ring->buf_ring->bufs[i];
+
+        buf->addr = (uint64_t) (uintptr_t) (ring->bufs + (size_t) i * URING_BUF_SIZE);
+        buf->len = URING_BUF_SIZE;
+        buf->bid = i;
+    }
+    __atomic_store_n(&ring->buf_ring->tail, URING_BUF_COUNT, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * @brief Hands a provided buffer back to the kernel once we are done with it.
+ *
+ * @param ring
+ * @param bid
+ */
+static void uring_recycle_buffer(struct uring *ring, unsigned bid)
+{
+    unsigned short tail = ring->buf_ring->tail;
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[tail & (URING_BUF_COUNT - 1)];
+
+    buf->addr = (uint64_t) (uintptr_t) (ring->bufs + (size_t) bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&ring->buf_ring->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Passes every queued SQE to the kernel and optionally waits
+ * for completions, all in one system call.
+ *
+ * SQEs are counted from the kernel's head rather than from the last
+ * tail we published, so any that an earlier call failed to submit
+ * are handed over again.
+ *
+ * @param ring
+ * @param wait_nr the number of completions to wait for.
+ * @return 0 on success, -1 on failure with errno set: EBUSY or EAGAIN
+ * if the kernel could not take the SQEs yet because its completion
+ * queue is full or it is short of memory.
+ */
+static int uring_submit(struct uring *ring, unsigned wait_nr)
+{
+    unsigned to_submit;
+    int rc;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    do
+    {
+        rc = sys_io_uring_enter(ring->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    } while (rc < 0 && errno == EINTR);
+    return rc < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Says whether the submission queue lacks room for an
+ * operation and the timeout that may be linked to it.
+ *
+ * @param ring
+ */
+static int uring_sq_full(struct uring *ring)
+{
+    return ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > URING_ENTRIES - 2;
+}
+
+/**
+ * @brief Takes the next SQE, zeroed, without checking for room.
+ *
+ * @param ring
+ */
+static struct io_uring_sqe *uring_take_sqe(struct uring *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned index;
+
+    index = ring->sq_local_tail & *ring->sq_mask;
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/**
+ * @brief Returns a zeroed SQE to fill in for an operation on conn (or
+ * on the listening socket, if conn is NULL).
+ *
+ * If the queue is full and the kernel will not take any of it, which
+ * happens when its completion queue is full too, the SQEs in it must
+ * not be overwritten. The operation is then set aside, to be prepared
+ * by uring_requeue() once there is room.
+ *
+ * @param ring
+ * @param conn
+ * @param op the URING_OP_ to set aside.
+ * @return the SQE, or NULL if the operation has been set aside.
+ */
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring, struct uring_conn *conn, int op)
+{
+    if (uring_sq_full(ring) && (uring_submit(ring, 0) < 0 || uring_sq_full(ring)))
+    {
+        if (conn == NULL)
+        {
+            ring->accept_deferred = op;
+            return NULL;
+        }
+        conn->deferred_op = op;
+        conn->deferred_next = NULL;
+        if (ring->deferred_tail != NULL)
+        {
+            ring->deferred_tail->deferred_next = conn;
+        }
+        else
+        {
+            ring->deferred_head = conn;
+        }
+        ring->deferred_tail = conn;
+        return NULL;
+    }
+    return uring_take_sqe(ring);
+}
+
+/**
+ * @brief Cancels the operation in sqe if it has not completed within
+ * ns nanoseconds, the way the epoll reactor's timers close idle and
+ * stalled connections. The operation then completes with -ECANCELED.
+ *
+ * uring_get_sqe() always leaves room for the timeout, which must
+ * directly follow the operation in the queue.
+ *
+ * @param ring
+ * @param conn
+ * @param sqe the operation, just filled in.
+ * @param ns 0 for no limit.
+ */
+static void uring_link_timeout(struct uring *ring, struct uring_conn *conn, struct io_uring_sqe *sqe, uint64_t ns)
+{
+    if (ns == 0)
+    {
+        return;
+    }
+    conn->timeout.tv_sec = ns / 1000000000;
+    conn->timeout.tv_nsec = ns % 1000000000;
+
+    sqe->flags |= IOSQE_IO_LINK;
+    sqe = uring_take_sqe(ring);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (uint64_t) (uintptr_t) &conn->timeout;
+    sqe->len = 1;
+    sqe->user_data = URING_OP_TIMEOUT;
+}
+
+static void uring_prep_accept(struct uring *ring)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, NULL, URING_OP_ACCEPT);
+
+    if (sqe == NULL)
+    {
+        return;
+    }
+
+    /*
+        A multishot accept stays armed: the kernel posts one CQE per
+        accepted connection until it is cancelled or fails, so no new
+        SQE is needed for each client.
+    */
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ring->sockfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = URING_OP_ACCEPT;
+}
+
+static void uring_prep_backoff(struct uring *ring)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, NULL, URING_OP_BACKOFF);
+
+    if (sqe == NULL)
+    {
+        return;
+    }
+
+    // Completes with -ETIME once the time is up; the accept is armed again then.
+    ring->backoff.tv_sec = 0;
+    ring->backoff.tv_nsec = URING_ACCEPT_BACKOFF_NS;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t) (uintptr_t) &ring->backoff;
+    sqe->len = 1;
+    sqe->user_data = URING_OP_BACKOFF;
+}
+
+static void uring_prep_recv(struct uring *ring, struct uring_conn *conn)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, conn, URING_OP_RECV);
+    uint64_t deadline, now;
+
+    if (sqe == NULL)
+    {
+        return;
+    }
+
+    // No buffer is passed: the kernel picks one from the group.
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->len = URING_BUF_SIZE;
+    sqe->user_data = (uint64_t) (uintptr_t) conn | URING_OP_RECV;
+
+    /*
+        Between messages the idle timeout applies; inside one, the
+        read timeout, which runs from the message's first byte.
+    */
+    if (conn->message_start == 0)
+    {
+        uring_link_timeout(ring, conn, sqe, (uint64_t) ring->config->idle_timeout * 1000000);
+    }
+    else if (ring->config->read_timeout > 0)
+    {
+        deadline = conn->message_start + (uint64_t) ring->config->read_timeout * 1000000;
+        now = metrics_now();
+        uring_link_timeout(ring, conn, sqe, deadline > now ? deadline - now : 1);
+    }
+}
+
+static void uring_prep_send(struct uring *ring, struct uring_conn *conn)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, conn, URING_OP_SEND);
+
+    if (sqe == NULL)
+    {
+        return;
+    }
+
+    memset(&conn->msg, 0, sizeof(conn->msg));
+    conn->msg.msg_iov = conn->iov;
+    conn->msg.msg_iovlen = output_iov(&conn->out, conn->iov, URING_MAX_IOV);
+
+    // MSG_WAITALL makes the kernel retry short sends itself.
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t) (uintptr_t) &conn->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = (uint64_t) (uintptr_t) conn | URING_OP_SEND;
+
+    // A client not reading its replies falls under the write timeout.
+    uring_link_timeout(ring, conn, sqe, (uint64_t) ring->config->write_timeout * 1000000);
+}
+
+static void uring_prep_close(struct uring *ring, struct uring_conn *conn)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, conn, URING_OP_CLOSE);
+
+    if (sqe == NULL)
+    {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = conn->fd;
+    sqe->user_data = (uint64_t) (uintptr_t) conn | URING_OP_CLOSE;
+
+    // The descriptor now belongs to the SQE (see uring_teardown()).
+    conn->fd = -1;
+}
+
+/**
+ * @brief Prepares the operations set aside while the submission
+ * queue was full, oldest first, as far as there is room now.
+ *
+ * @param ring
+ */
+static void uring_requeue(struct uring *ring)
+{
+    struct uring_conn *conn;
+
+    if (ring->accept_deferred == URING_OP_ACCEPT)
+    {
+        ring->accept_deferred = -1;
+        uring_prep_accept(ring);
+    }
+    else if (ring->accept_deferred == URING_OP_BACKOFF)
+    {
+        ring->accept_deferred = -1;
+        uring_prep_backoff(ring);
+    }
+    while (ring->deferred_head != NULL && !uring_sq_full(ring))
+    {
+        conn = ring->deferred_head;
+        ring->deferred_head = conn->deferred_next;
+        if (ring->deferred_head == NULL)
+        {
+            ring->deferred_tail = NULL;
+        }
+        switch (conn->deferred_op)
+        {
+        case URING_OP_RECV:
+            uring_prep_recv(ring, conn);
+            break;
+        case URING_OP_SEND:
+            uring_prep_send(ring, conn);
+            break;
+        case URING_OP_CLOSE:
+            uring_prep_close(ring, conn);
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Releases a connection once its socket has been closed.
+ *
+ * @param ring
+ * @param conn
+ */
+static void uring_conn_free(struct uring *ring, struct uring_conn *conn)
+{
+    if (conn->prev != NULL)
+    {
+        conn->prev->next = conn->next;
+    }
+    else
+    {
+        ring->conns = conn->next;
+    }
+    if (conn->next != NULL)
+    {
+        conn->next->prev = conn->prev;
+    }
+    buffer_release(&conn->in);
+    output_clear(&conn->out);
+    free(conn);
+}
+
+/**
+ * @brief Gives up on the ring after a fatal error: closes every
+ * connection and releases everything uring_run() set up, keeping
+ * errno.
+ *
+ * Closing the ring also cancels the multishot accept and whatever
+ * else is in flight, so the listening socket can go back to epoll.
+ * Closes still sitting in the submission queue never reached the
+ * kernel, so their descriptors are closed here as well.
+ *
+ * @param ring
+ */
+static void uring_teardown(struct uring *ring)
+{
+    struct io_uring_sqe *sqe;
+    struct uring_conn *conn;
+    unsigned i;
+    int saved = errno;
+
+    for (i = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE); i != ring->sq_local_tail; i++)
+    {
+        sqe = &ring->sqes[ring->sq_array[i & *ring->sq_mask]];
+        if (sqe->opcode == IORING_OP_CLOSE)
+        {
+            close(sqe->fd);
+        }
+    }
+    for (conn = ring->conns; conn != NULL; conn = conn->next)
+    {
+        if (conn->fd >= 0)
+        {
+            close(conn->fd);
+        }
+    }
+
+    // Only once the kernel is done with them can the connections be freed.
+    uring_destroy(ring);
+    while (ring->conns != NULL)
+    {
+        metrics_count(METRIC_CLOSED, 1);
+        uring_conn_free(ring, ring->conns);
+    }
+    errno = saved;
+}
+
+/**
+ * @brief Turns away one queued connection when we are out of file
+ * descriptors, as shed_connection() does for the epoll listener.
+ *
+ * The reserved descriptor is given up, the connection is accepted
+ * and closed straight away, and the descriptor is reserved again.
+ *
+ * @param ring
+ * @return 0 if a connection was shed, -1 if none was waiting or
+ * there was no spare descriptor to make room with.
+ */
+static int uring_shed(struct uring *ring)
+{
+    int fd;
+
+    if (ring->spare_fd < 0)
+    {
+        return -1;
+    }
+    close(ring->spare_fd);
+
+    // The listening socket is non-blocking, so this cannot wait.
+    fd = accept(ring->sockfd, NULL, NULL);
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    ring->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return fd >= 0 ? 0 : -1;
+}
+
+/**
+ * @brief Answers every complete message at the start of data.
+ *
+ * The replies are queued back to back on conn->out so they go out in
+ * one sendmsg, in order. An HTTP request that asks for the connection
+ * to be closed, or a malformed one (which gets a 400), ends the
+ * connection: nothing after it is answered, and conn->closing is set.
+ *
+ * @param ring
+ * @param conn
+ * @param data
+ * @param len
+ * @return how many bytes the answered messages took, or -1 if a
+ * message is invalid (other than HTTP) or memory is exhausted.
+ */
+static ssize_t uring_answer(struct uring *ring, struct uring_conn *conn, const char *data, size_t len)
+{
+    char reply[HANDLER_REPLY_MAX];
+    struct frame frame;
+    ssize_t consumed;
+    size_t off = 0;
+    size_t reply_len;
+    uint64_t start;
+    int handler;
+
+    while ((consumed = framer_next(&conn->framer, data + off, len - off, &frame)) > 0)
+    {
+        log_bytes("Here is the message: %.*s\n", frame.data, frame.len);
+        start = metrics_now();
+        handler = handler_route(&frame, &ring->arena);
+        if (handler == -2)
+        {
+            return -1;
+        }
+        reply_len = handler_run(handler >= 0 ? handler : ring->config->handler, frame.data, frame.len, reply);
+        metrics_time(METRIC_HANDLER, start);
+        if (frame.request != NULL)
+        {
+            conn->closing = !frame.request->keep_alive;
+            if (http_respond(&conn->out, 200, reply, reply_len, !conn->closing) < 0)
+            {
+                return -1;
+            }
+        }
+        else if (framing_encode(ring->config->framing, &conn->out, reply, reply_len) < 0)
+        {
+            return -1;
+        }
+        metrics_time(METRIC_REQUEST, start);
+        arena_reset(&ring->arena);
+        off += consumed;
+        if (conn->closing)
+        {
+            return off;
+        }
+    }
+    if (consumed < 0)
+    {
+        metrics_count(METRIC_ERR_INVALID, 1);
+        if (ring->config->framing != FRAMING_HTTP)
+        {
+            return -1;
+        }
+        // A malformed request gets a 400 before the connection is closed.
+        conn->closing = 1;
+        if (http_respond(&conn->out, 400, "", 0, 0) < 0)
+        {
+            return -1;
+        }
+    }
+    return off;
+}
+
+/**
+ * @brief Answers every complete message in freshly received bytes.
+ *
+ * In the common case whole messages arrive in one recv and are
+ * parsed straight out of the provided buffer; only a trailing
+ * partial message is copied into the connection to wait for the
+ * rest.
+ *
+ * When part of a message is already waiting there, the new bytes are
+ * appended only as far as the buffer may grow, and the messages that
+ * completes are answered and dropped before the rest is taken. So a
+ * message close to the size limit followed by pipelined ones never
+ * needs more room than one message does, as on the epoll path.
+ *
+ * @param ring
+ * @param conn
+ * @param data the bytes just received.
+ * @param len
+ * @return 0 on success, -1 if a message is too large or memory is exhausted.
+ */
+static int uring_consume(struct uring *ring, struct uring_conn *conn, const char *data, size_t len)
+{
+    size_t limit = conn->framer.max_frame + FRAMING_HEADER_LEN;
+    ssize_t off;
+    size_t n;
+
+    while (buffer_len(&conn->in) > 0 && len > 0)
+    {
+        n = limit - buffer_len(&conn->in);
+        if (n > len)
+        {
+            n = len;
+        }
+        if (n == 0 || buffer_reserve(&conn->in, n, limit) < 0)
+        {
+            return -1;
+        }
+        memcpy(conn->in.data + conn->in.end, data, n);
+        conn->in.end += n;
+        data += n;
+        len -= n;
+
+        off = uring_answer(ring, conn, conn->in.data + conn->in.start, buffer_len(&conn->in));
+        if (off < 0)
+        {
+            return -1;
+        }
+        buffer_consume(&conn->in, off);
+        if (conn->closing)
+        {
+            return 0;
+        }
+    }
+    if (len == 0)
+    {
+        return 0;
+    }
+
+    off = uring_answer(ring, conn, data, len);
+    if (off < 0)
+    {
+        return -1;
+    }
+    if (!conn->closing && (size_t) off < len)
+    {
+        /*
+            The framer has already scanned this partial message, so
+            it resumes where it left off once the copy is extended.
+        */
+        if (buffer_reserve(&conn->in, len - off, limit) < 0)
+        {
+            return -1;
+        }
+        memcpy(conn->in.data + conn->in.end, data + off, len - off);
+        conn->in.end += len - off;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reacts to one completion.
+ *
+ * @param ring
+ * @param cqe
+ */
+static void uring_complete(struct uring *ring, struct io_uring_cqe *cqe)
+{
+    struct uring_conn *conn = (struct uring_conn *) (uintptr_t) (cqe->user_data & ~(uint64_t) URING_OP_MASK);
+    unsigned bid;
+    int rc;
+
+    switch (cqe->user_data & URING_OP_MASK)
+    {
+    case URING_OP_ACCEPT:
+        if (cqe->res >= 0)
+        {
+            conn = malloc(sizeof(*conn));
+            if (conn == NULL)
+            {
+                close(cqe->res);
+            }
+            else
+            {
+                conn->fd = cqe->res;
+                conn->opened = metrics_now();
+                conn->closing = 0;
+                conn->message_start = 0;
+                metrics_count(METRIC_ACCEPTED, 1);
+                framer_init(&conn->framer, ring->config->framing, ring->config->max_frame);
+                memset(&conn->in, 0, sizeof(conn->in));
+                memset(&conn->out, 0, sizeof(conn->out));
+                conn->prev = NULL;
+                conn->next = ring->conns;
+                if (ring->conns != NULL)
+                {
+                    ring->conns->prev = conn;
+                }
+                ring->conns = conn;
+                uring_prep_recv(ring, conn);
+            }
+        }
+        else if (cqe->res == -EMFILE || cqe->res == -ENFILE)
+        {
+            /*
+                Out of descriptors. io_uring fails the accept before
+                it looks at the queue, so armed again straight away it
+                would fail at once, over and over. A waiting
+                connection is shed instead, as the epoll listener
+                does; with none waiting, or no spare descriptor, the
+                accept waits a while for connections to close.
+            */
+            if (!(cqe->flags & IORING_CQE_F_MORE) && uring_shed(ring) < 0)
+            {
+                uring_prep_backoff(ring);
+                break;
+            }
+        }
+        else if (cqe->res != -EAGAIN && cqe->res != -ECONNABORTED)
+        {
+            // Anything else is waited out too, so the worker does not spin on it.
+            fprintf(stderr, "ERROR on accept: %s\n", strerror(-cqe->res));
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+            {
+                uring_prep_backoff(ring);
+                break;
+            }
+        }
+        // The kernel dropped the multishot request, so arm a new one.
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+        {
+            uring_prep_accept(ring);
+        }
+        break;
+
+    case URING_OP_BACKOFF:
+        uring_prep_accept(ring);
+        break;
+
+    case URING_OP_TIMEOUT:
+        /*
+            Either it expired, and the operation it was linked to
+            completes with -ECANCELED, or that operation finished
+            first and cancelled it. The connection may be gone by
+            now, so nothing is done with it here.
+        */
+        break;
+
+    case URING_OP_RECV:
+        if (cqe->res == -ENOBUFS)
+        {
+            // Every provided buffer is in use; try again next round.
+            uring_prep_recv(ring, conn);
+            break;
+        }
+        if (cqe->res == -ECANCELED)
+        {
+            // Its linked timeout expired.
+            metrics_count(METRIC_ERR_TIMEOUT, 1);
+            uring_prep_close(ring, conn);
+            break;
+        }
+        if (cqe->res <= 0)
+        {
+            // The client has closed the connection (or it failed).
+            metrics_count(METRIC_ERR_IO, cqe->res < 0);
+            uring_prep_close(ring, conn);
+            break;
+        }
+        metrics_count(METRIC_BYTES_IN, cqe->res);
+
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        rc = uring_consume(ring, conn, ring->bufs + (size_t) bid * URING_BUF_SIZE, cqe->res);
+        uring_recycle_buffer(ring, bid);
+        if (buffer_len(&conn->in) == 0)
+        {
+            conn->message_start = 0;
+        }
+        else if (conn->message_start == 0)
+        {
+            conn->message_start = metrics_now();
+        }
+
+        if (rc < 0)
+        {
+            uring_prep_close(ring, conn);
+        }
+        else if (conn->out.bytes > 0)
+        {
+            uring_prep_send(ring, conn);
+        }
+        else
+        {
+            // Only part of a message so far: wait for the rest.
+            uring_prep_recv(ring, conn);
+        }
+        break;
+
+    case URING_OP_SEND:
+        if (cqe->res == -ECANCELED)
+        {
+            metrics_count(METRIC_ERR_TIMEOUT, 1);
+            uring_prep_close(ring, conn);
+            break;
+        }
+        if (cqe->res < 0)
+        {
+            metrics_count(METRIC_ERR_IO, 1);
+            uring_prep_close(ring, conn);
+            break;
+        }
+        metrics_count(METRIC_BYTES_OUT, cqe->res);
+        if (conn->opened != 0 && cqe->res > 0)
+        {
+            metrics_time(METRIC_FIRST_BYTE, conn->opened);
+            conn->opened = 0;
+        }
+
+        /*
+            Unless the last reply has been sent, the connection stays
+            open: once every reply has gone out, wait for the client's
+            next messages.
+        */
+        output_advance(&conn->out, cqe->res);
+        if (conn->out.bytes > 0)
+        {
+            uring_prep_send(ring, conn);
+        }
+        else if (conn->closing)
+        {
+            uring_prep_close(ring, conn);
+        }
+        else
+        {
+            uring_prep_recv(ring, conn);
+        }
+        break;
+
+    case URING_OP_CLOSE:
+        metrics_count(METRIC_CLOSED, 1);
+        uring_conn_free(ring, conn);
+        break;
+    }
+}
+
+/**
+ * @brief Serves clients on sockfd with io_uring until a fatal error.
+ *
+ * This replaces the reactor for the whole process: accept, recv,
+ * send and close are all issued as ring operations and one
+ * io_uring_enter() both submits the next batch and waits for the
+ * completions of the previous one.
+ *
+ * If the ring fails, every connection on it is closed and the ring is
+ * torn down before returning, leaving the listening socket to the
+ * caller.
+ *
+ * @param sockfd the bound, listening socket.
+ * @param config
+ * @return -1 with errno set if the ring could not be used.
+ */
+int uring_run(int sockfd, const struct config *config)
+{
+    struct uring ring;
+    unsigned head, tail;
+
+    if (uring_init(&ring) < 0 || uring_setup_buffers(&ring) < 0)
+    {
+        uring_destroy(&ring);
+        return -1;
+    }
+    ring.config = config;
+    ring.sockfd = sockfd;
+    ring.spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    arena_init(&ring.arena);
+
+    uring_prep_accept(&ring);
+
+    for (;;)
+    {
+        /*
+            EBUSY and EAGAIN are not fatal: the kernel's completion
+            queue is full, or it is short of memory, and reaping
+            completions makes room. The SQEs it did not take are
+            submitted again next time round.
+        */
+        uring_requeue(&ring);
+        if (uring_submit(&ring, 1) < 0 && errno != EBUSY && errno != EAGAIN)
+        {
+            uring_teardown(&ring);
+            return -1;
+        }
+
+        head = *ring.cq_head;
+        tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            uring_complete(&ring, &ring.cqes[head & *ring.cq_mask]);
+            head++;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+}
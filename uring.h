@@ -0,0 +1,8 @@
+#ifndef URING_H
+#define URING_H
+
+#include "config.h"
+
+int uring_run(int sockfd, const struct config *config);
+
+#endif